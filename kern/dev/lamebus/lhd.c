@@ -36,7 +36,8 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,15 +97,230 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Request queue.
+ *
+ * Requests wait on lh_queue, sorted by starting sector. A request
+ * that begins right where a queued one (plus whatever has been merged
+ * behind it) ends, in the same direction, is merged: it is chained on
+ * dr_merged and its sectors go straight after the others' without
+ * going back through the elevator. The same happens if it ends right
+ * where a queued one begins, except that it then takes that one's
+ * place in the queue.
+ *
+ * The elevator is C-LOOK: the next request is the first at or above
+ * the sector the disk last transferred, or, if there isn't one, the
+ * lowest. The hardware does one sector at a time; the interrupt
+ * handler moves the data through the on-card buffer and starts the
+ * next sector, so once started the queue drains with no thread
+ * involved.
+ */
+
+/* Most sectors to put in one merged chain */
+#define LHD_MAXMERGE	128
+
+/*
+ * Last request in a merged chain, and the sector after the chain.
+ */
+static
+struct devreq *
+lhd_chaintail(struct devreq *dr)
+{
+	while (dr->dr_merged != NULL) {
+		dr = dr->dr_merged;
+	}
+	return dr;
+}
+
+static
+uint32_t
+lhd_chainsects(struct devreq *dr)
+{
+	uint32_t n = 0;
+
+	for (; dr != NULL; dr = dr->dr_merged) {
+		n += dr->dr_nblocks;
+	}
+	return n;
+}
+
+/*
+ * Put a request on the queue, merging it if possible.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct devreq *dr)
+{
+	struct devreq **pp, *q, *tail;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	for (pp = &lh->lh_queue; (q = *pp) != NULL; pp = &q->dr_next) {
+		if (q->dr_iswrite != dr->dr_iswrite ||
+		    lhd_chainsects(q) + dr->dr_nblocks > LHD_MAXMERGE) {
+			continue;
+		}
+		tail = lhd_chaintail(q);
+		if (tail->dr_block + tail->dr_nblocks == dr->dr_block) {
+			/* back merge */
+			tail->dr_merged = dr;
+			return;
+		}
+		if (dr->dr_block + dr->dr_nblocks == q->dr_block) {
+			/* front merge: dr takes q's place */
+			dr->dr_merged = q;
+			dr->dr_next = q->dr_next;
+			q->dr_next = NULL;
+			*pp = dr;
+			return;
+		}
+	}
+
+	for (pp = &lh->lh_queue; (q = *pp) != NULL; pp = &q->dr_next) {
+		if (q->dr_block > dr->dr_block) {
+			break;
+		}
+	}
+	dr->dr_next = q;
+	*pp = dr;
+}
+
+/*
+ * Take the next request off the queue, C-LOOK order.
+ */
+static
+struct devreq *
+lhd_dequeue(struct lhd_softc *lh)
+{
+	struct devreq **pp, *q;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	for (pp = &lh->lh_queue; (q = *pp) != NULL; pp = &q->dr_next) {
+		if (q->dr_block >= lh->lh_headpos) {
+			break;
+		}
+	}
+	if (q == NULL) {
+		/* nothing further along; sweep back to the start */
+		pp = &lh->lh_queue;
+		q = *pp;
+	}
+	if (q != NULL) {
+		*pp = q->dr_next;
+		q->dr_next = NULL;
+	}
+	return q;
+}
+
+/*
+ * Start the transfer of the current sector of lh_cur.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct devreq *dr = lh->lh_cur;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	/* Are we writing? If so, transfer the data to the on-card buffer. */
+	if (dr->dr_iswrite) {
+		memcpy(lh->lh_buf,
+		       (char *)dr->dr_data + lh->lh_cursect * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, dr->dr_block + lh->lh_cursect);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, start on the next request.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_cur != NULL) {
+		return;
+	}
+	lh->lh_cur = lhd_dequeue(lh);
+	if (lh->lh_cur != NULL) {
+		lh->lh_cursect = 0;
+		lhd_startsector(lh);
+	}
+}
+
+/*
+ * Record that a sector has completed: move the data, and go on to the
+ * next sector, request in the merged chain, or request in the queue.
+ * If that finishes a request, report it.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq *dr, *finished;
+	void (*done)(struct devreq *);
+
+	spinlock_acquire(&lh->lh_lock);
+
+	dr = lh->lh_cur;
+	if (dr == NULL) {
+		/* spurious */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/*
+	 * Are we reading? If so, and if we succeeded, transfer the
+	 * data out of the on-card buffer.
+	 */
+	if (err == 0 && !dr->dr_iswrite) {
+		membar_load_load();
+		memcpy((char *)dr->dr_data + lh->lh_cursect * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+	lh->lh_headpos = dr->dr_block + lh->lh_cursect + 1;
+	lh->lh_cursect++;
+
+	finished = NULL;
+	if (err != 0 || lh->lh_cursect == dr->dr_nblocks) {
+		finished = dr;
+		finished->dr_result = err;
+		lh->lh_cur = dr->dr_merged;
+		lh->lh_cursect = 0;
+		if (lh->lh_cur != NULL) {
+			lhd_startsector(lh);
+		}
+		else {
+			lhd_start(lh);
+		}
+	}
+	else {
+		lhd_startsector(lh);
+	}
+
+	done = NULL;
+	if (finished != NULL) {
+		/* after this, synchronous callers may free it */
+		done = finished->dr_done;
+		finished->dr_complete = true;
+		wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	if (done != NULL) {
+		done(finished);
+	}
 }
 
 /*
@@ -194,8 +410,84 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Check a transfer's range.
+ */
+static
+bool
+lhd_range_ok(struct lhd_softc *lh, uint32_t sector, uint32_t len)
+{
+	return len <= lh->lh_dev.d_blocks &&
+		sector <= lh->lh_dev.d_blocks - len;
+}
+
+/*
+ * Asynchronous I/O.
+ */
+static
+int
+lhd_submit(struct device *d, struct devreq *dr)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	if (dr->dr_nblocks == 0 ||
+	    !lhd_range_ok(lh, dr->dr_block, dr->dr_nblocks)) {
+		return EINVAL;
+	}
+
+	dr->dr_result = 0;
+	dr->dr_complete = false;
+	dr->dr_next = NULL;
+	dr->dr_merged = NULL;
+
+	spinlock_acquire(&lh->lh_lock);
+	lhd_enqueue(lh, dr);
+	lhd_start(lh);
+	spinlock_release(&lh->lh_lock);
+	return 0;
+}
+
+/*
+ * Queue a request and wait for it.
+ */
+static
+int
+lhd_transfer(struct lhd_softc *lh, uint32_t sector, uint32_t len,
+	     void *data, bool iswrite)
+{
+	struct devreq dr;
+
+	dr.dr_block = sector;
+	dr.dr_nblocks = len;
+	dr.dr_data = data;
+	dr.dr_iswrite = iswrite;
+	dr.dr_done = NULL;
+	dr.dr_arg = NULL;
+	dr.dr_result = 0;
+	dr.dr_complete = false;
+	dr.dr_next = NULL;
+	dr.dr_merged = NULL;
+
+	spinlock_acquire(&lh->lh_lock);
+	lhd_enqueue(lh, &dr);
+	lhd_start(lh);
+	while (!dr.dr_complete) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return dr.dr_result;
+}
+
+/* Size of the bounce buffer for I/O to user memory, in sectors */
+#define LHD_BOUNCESECTS	16
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * A single kernel buffer is transferred in place. Anything else
+ * (user memory, several iovecs) goes through a bounce buffer, since
+ * the data is moved by the interrupt handler.
  */
 static
 int
@@ -207,8 +499,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool iswrite = uio->uio_rw == UIO_WRITE;
+	struct iovec *iov;
+	void *bounce;
+	uint32_t n;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -217,66 +511,57 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (!lhd_range_ok(lh, sector, len)) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1) {
+		iov = uio->uio_iov;
+		KASSERT(iov->iov_len == uio->uio_resid);
+		result = lhd_transfer(lh, sector, len, iov->iov_kbase, iswrite);
+		if (result) {
+			return result;
+		}
+		/* account for it the way uiomove would */
+		iov->iov_kbase = (char *)iov->iov_kbase + len * LHD_SECTSIZE;
+		iov->iov_len = 0;
+		uio->uio_resid = 0;
+		uio->uio_offset += len * LHD_SECTSIZE;
+		return 0;
+	}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+	bounce = kmalloc(LHD_BOUNCESECTS * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	result = 0;
+	while (len > 0) {
+		n = len < LHD_BOUNCESECTS ? len : LHD_BOUNCESECTS;
+		if (iswrite) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		result = lhd_transfer(lh, sector, n, bounce, iswrite);
 		if (result) {
-			return result;
+			break;
+		}
+		if (!iswrite) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
+		sector += n;
+		len -= n;
 	}
-
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -284,6 +569,7 @@ static const struct device_ops lhd_devops = {
 	.devop_lastclose = lhd_lastclose,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_submit = lhd_submit,
 };
 
 /*
@@ -300,17 +586,16 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_cursect = 0;
+	lh->lh_headpos = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -51,9 +52,12 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects everything below */
+	struct wchan *lh_wchan;		/* Synchronous callers wait here */
+	struct devreq *lh_queue;	/* Pending requests, by sector */
+	struct devreq *lh_cur;		/* Request being transferred */
+	uint32_t lh_cursect;		/* Sector within lh_cur */
+	uint32_t lh_headpos;		/* Sector after the last one done */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -1,5 +1,6 @@
 #include <types.h>
 #include <current.h>
+#include <thread.h>
 #include <lib.h>
 #include <limits.h>
 #include <log.h>
@@ -8,7 +9,6 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <kern/iovec.h>
-#include <vector.h>
 #include <fs.h>
 #include <sfs.h>
 #include <buf.h>
@@ -20,8 +20,10 @@
 #define JOURNAL_START_BLOCK 7
 
 static struct log_buffer *buf1, *buf2;
-static Vector tvector;
-static uint64_t wrap_times;
+static bool log_created;
+
+static void log_writer_thread(void *x1, unsigned long x2);
+static void log_checkpoint_thread(void *x1, unsigned long x2);
 
 
 static 
@@ -69,11 +71,15 @@ read_log_from_disk(struct fs *fs, unsigned off, char *buf, unsigned size){
 	return 0;
 }
 
+// Journal appends start wherever the head is, usually partway into a block. Rather than reading that
+// block back from disk on every flush, keep a copy of it here and write whole blocks from the staging area.
+static char *log_tail_block;
+static char *log_staging;
+
 static 
 int 
 write_log_to_disk(struct fs *fs, unsigned off, char *buf, unsigned size){
     KASSERT(size <= LOG_BUFFER_SIZE);
-	kprintf("Writing to disk\n");
     if (size == 0) return -1;
 
     // restore the actual offset into the disk
@@ -82,38 +88,19 @@ write_log_to_disk(struct fs *fs, unsigned off, char *buf, unsigned size){
     unsigned buf_index = offset % BLOCK_SIZE; 
     // computer the first block to mofidy
     unsigned first_block = offset / BLOCK_SIZE;
-    // compute the number of blocks to write
-    unsigned nblocks = size / BLOCK_SIZE;
-    // in case size is not block aligned
-    unsigned bytes_left = size % BLOCK_SIZE;
-    
-    char *local_buf = kmalloc(BLOCK_SIZE);
-    int rv;
+    // the whole blocks covering the old bytes of the first block plus the new ones
+    unsigned total = buf_index + size;
+    unsigned nblocks = DIVROUNDUP(total, BLOCK_SIZE);
 
-    // read first block, modify, write back in case size is not block aligned
-    rv = FSOP_READBLOCK(fs, first_block, local_buf, BLOCK_SIZE);
-    if (rv) return -1;
-    memcpy(local_buf + buf_index, buf, BLOCK_SIZE - buf_index);
-    buf += buf_index;
-    rv = FSOP_WRITEBLOCK(fs, first_block, local_buf, BLOCK_SIZE);
-    if (rv) return -1;
-    
-    // write subsequent block-aligned blocks
-    for (unsigned i = 1; i < nblocks; i++) {
-        rv = FSOP_WRITEBLOCK(fs, first_block + i, buf, BLOCK_SIZE);
-        buf += BLOCK_SIZE;
-        if (rv) return -1;
-    }
-    
-    // write bytes from the last block if it's not block aligned
-    if (bytes_left != 0 && nblocks != 0) {
-        memset(local_buf, 0, BLOCK_SIZE);
-        memcpy(local_buf, buf, bytes_left);
-        rv = FSOP_WRITEBLOCK(fs, first_block + nblocks, local_buf, BLOCK_SIZE);
-        if (rv) return -1;
-    }
+    memcpy(log_staging, log_tail_block, buf_index);
+    memcpy(log_staging + buf_index, buf, size);
+    bzero(log_staging + total, nblocks * BLOCK_SIZE - total);
 
-    kfree(local_buf);
+    if (sfs_writeblock_uncached(fs, first_block, log_staging, nblocks * BLOCK_SIZE) != 0)
+        return -1;
+
+    // the next append starts in the last block we wrote, unless we ended on a boundary
+    memcpy(log_tail_block, log_staging + (nblocks - 1) * BLOCK_SIZE, BLOCK_SIZE);
 
 	return 0;
 }
@@ -138,40 +125,219 @@ static int read_meta_data_from_disk(struct fs *fs, char *buf){
 }
 
 static int write_meta_data_to_disk(struct fs *fs, char *buf){
-	int rv = FSOP_WRITEBLOCK(fs, METADATA_BLOCK, buf, BLOCK_SIZE);
+	int rv = sfs_writeblock_uncached(fs, METADATA_BLOCK, buf, BLOCK_SIZE);
     if (rv) return -1;
     return 0;
 }
 
-// Creates the log buffer global object and log info global object 
-// call this before recovery
+// Open transactions, hashed by id and listed in the order they started. Since transactions start in log
+// order, the oldest one, where the tail can move up to, is always at the front of the list.
+struct log_txn {
+	uint64_t lt_id;
+	unsigned lt_offset; // byte index of its first record
+	daddr_t *lt_blocks; // data blocks to write before the commit record
+	unsigned lt_nblocks;
+	unsigned lt_maxblocks;
+	struct log_txn *lt_hashnext;
+	struct log_txn *lt_next; // toward newer
+	struct log_txn *lt_prev; // toward older
+};
+
+#define LOG_TXN_BUCKETS 64 // power of 2
+
+static struct log_txn *txn_hash[LOG_TXN_BUCKETS];
+static struct log_txn txn_open; // list head; next is the oldest
+
+static struct log_txn **txn_bucket(uint64_t id){
+	return &txn_hash[(unsigned)id & (LOG_TXN_BUCKETS - 1)];
+}
+
+static void txn_begin(uint64_t id, unsigned offset){
+	struct log_txn *t, **bucket;
+
+	KASSERT(lock_do_i_hold(log_info.lock));
+
+	t = kmalloc(sizeof(struct log_txn));
+	if(t == NULL)
+		panic("log: out of memory for transaction table\n");
+	t->lt_id = id;
+	t->lt_offset = offset;
+	t->lt_blocks = NULL;
+	t->lt_nblocks = 0;
+	t->lt_maxblocks = 0;
+
+	bucket = txn_bucket(id);
+	t->lt_hashnext = *bucket;
+	*bucket = t;
+
+	t->lt_next = &txn_open;
+	t->lt_prev = txn_open.lt_prev;
+	txn_open.lt_prev->lt_next = t;
+	txn_open.lt_prev = t;
+}
+
+static void txn_end(uint64_t id){
+	struct log_txn *t, **tp;
+
+	KASSERT(lock_do_i_hold(log_info.lock));
+
+	for(tp = txn_bucket(id); *tp != NULL; tp = &(*tp)->lt_hashnext){
+		t = *tp;
+		if(t->lt_id == id){
+			*tp = t->lt_hashnext;
+			t->lt_prev->lt_next = t->lt_next;
+			t->lt_next->lt_prev = t->lt_prev;
+			kfree(t->lt_blocks);
+			kfree(t);
+			return;
+		}
+	}
+}
+
+static struct log_txn *txn_find(uint64_t id){
+	struct log_txn *t;
+
+	KASSERT(lock_do_i_hold(log_info.lock));
+
+	for(t = *txn_bucket(id); t != NULL; t = t->lt_hashnext)
+		if(t->lt_id == id)
+			return t;
+	return NULL;
+}
+
+// Ordered data: BLOCK holds file data written as part of transaction TXN_ID, so make sure it's on disk
+// before the transaction's commit record. The data itself isn't logged.
+void log_order_block(uint64_t txn_id, daddr_t block){
+	struct log_txn *t;
+	daddr_t *blocks;
+	unsigned max;
+
+	lock_acquire(log_info.lock);
+	t = txn_find(txn_id);
+	if(t == NULL || (t->lt_nblocks > 0 && t->lt_blocks[t->lt_nblocks - 1] == block)){
+		lock_release(log_info.lock);
+		return;
+	}
+	if(t->lt_nblocks == t->lt_maxblocks){
+		max = t->lt_maxblocks ? 2 * t->lt_maxblocks : 16;
+		blocks = kmalloc(max * sizeof(daddr_t));
+		if(blocks == NULL){
+			// Can't remember it, so write it now
+			lock_release(log_info.lock);
+			if(buffer_sync_block(log_info.fs, block, BLOCK_SIZE) != 0)
+				kprintf("log: warning: ordered data write failed\n");
+			return;
+		}
+		if(t->lt_nblocks > 0)
+			memcpy(blocks, t->lt_blocks, t->lt_nblocks * sizeof(daddr_t));
+		kfree(t->lt_blocks);
+		t->lt_blocks = blocks;
+		t->lt_maxblocks = max;
+	}
+	t->lt_blocks[t->lt_nblocks++] = block;
+	lock_release(log_info.lock);
+}
+
+// Write out the data blocks ordered before the commit of transaction TXN_ID
+static int txn_sync_data(uint64_t txn_id){
+	struct log_txn *t;
+	daddr_t *blocks;
+	unsigned nblocks, i;
+	int result = 0;
+
+	lock_acquire(log_info.lock);
+	t = txn_find(txn_id);
+	if(t == NULL || t->lt_nblocks == 0){
+		lock_release(log_info.lock);
+		return 0;
+	}
+	blocks = t->lt_blocks;
+	nblocks = t->lt_nblocks;
+	t->lt_blocks = NULL;
+	t->lt_nblocks = t->lt_maxblocks = 0;
+	lock_release(log_info.lock);
+
+	for(i = 0; i < nblocks && result == 0; i++)
+		result = buffer_sync_block(log_info.fs, blocks[i], BLOCK_SIZE);
+	kfree(blocks);
+	return result;
+}
+
+// Creates the log buffer global object and log info global object
+// call this before recovery, on every mount
+//
+// The buffers, locks, cvs and the two log threads are set up on the first mount and kept from then on;
+// the threads sleep on those cvs between mounts. Later mounts only reset the per-mount state.
 int log_buffer_bootstrap(void){
 
-	// Head, tail and last_id will be set during pulling data from disk
-	buf1 = kmalloc(sizeof(struct log_buffer));
-	if(buf1 == NULL) goto out;
+	if(!log_created){
+		buf1 = kmalloc(sizeof(struct log_buffer));
+		if(buf1 == NULL) goto out;
 
-	buf1->lock = lock_create("buffer lock 1");
-	if (buf1->lock == NULL) goto out;
+		buf1->lock = lock_create("buffer lock 1");
+		if (buf1->lock == NULL) goto out;
 
-	buf1->buffer_filled = 0;
+		buf2 = kmalloc(sizeof(struct log_buffer));
+		if(buf2 == NULL) goto out;
 
-	buf2 = kmalloc(sizeof(struct log_buffer));
-	if(buf2 == NULL) goto out;
+		buf2->lock = lock_create("buffer lock 2");
+		if (buf2->lock == NULL) goto out;
 
-	buf2->lock = lock_create("buffer lock 2");
-	if (buf2->lock == NULL) goto out;
+		log_tail_block = kmalloc(BLOCK_SIZE);
+		if (log_tail_block == NULL) goto out;
+		log_staging = kmalloc(LOG_BUFFER_SIZE + BLOCK_SIZE);
+		if (log_staging == NULL) goto out;
 
-	buf2->buffer_filled = 0;
+		log_info.lock = lock_create("log info lock");
+		if (log_info.lock == NULL) goto out;
+
+		log_info.flush_cv = cv_create("log flush");
+		if (log_info.flush_cv == NULL) goto out;
+
+		log_info.durable_cv = cv_create("log durable");
+		if (log_info.durable_cv == NULL) goto out;
+
+		log_info.checkpoint_lock = lock_create("log checkpoint lock");
+		if (log_info.checkpoint_lock == NULL) goto out;
+
+		log_info.checkpoint_cv = cv_create("log checkpoint");
+		if (log_info.checkpoint_cv == NULL) goto out;
+
+		log_info.space_cv = cv_create("log space");
+		if (log_info.space_cv == NULL) goto out;
+
+		log_info.appended = 0;
+		log_info.forced = 0;
+		log_info.durable = 0;
+		log_info.reserved = 0;
+		log_info.checkpoint_wanted = false;
+
+		txn_open.lt_next = txn_open.lt_prev = &txn_open;
 
-	log_info.lock = lock_create("log info lock");
-	if (log_info.lock == NULL) goto out;
+		if(thread_fork("journal writer", NULL, log_writer_thread, NULL, 0) != 0)
+			goto out;
+		if(thread_fork("checkpointer", NULL, log_checkpoint_thread, NULL, 0) != 0)
+			goto out;
+		log_created = true;
+	}
+
+	// Head, tail and last_id will be set during pulling data from disk
+	lock_acquire(log_info.lock);
 
-    vector_init(&tvector);
+	// The sequence numbers carry on from the last mount, but its transactions don't; any still open
+	// (only possible once its journal failed) belong to the old log
+	while(txn_open.lt_next != &txn_open)
+		txn_end(txn_open.lt_next->lt_id);
+
+	buf1->buffer_filled = 0;
+	buf2->buffer_filled = 0;
+	bzero(log_tail_block, BLOCK_SIZE);
+	log_info.error = 0;
 
 	// Auto set to buf1
 	log_info.active_buffer = buf1;
 
+	lock_release(log_info.lock);
 
 	return 0;
 
@@ -189,7 +355,6 @@ static int pull_meta_data(struct log_info *log_info){
 	if(read_meta_data_from_disk(log_info->fs, (char *)st) != 0)
 		panic("failed to read from disk");
 
-	log_info->earliest_transaction = 0;
 	log_info->page_count = 0;
 
 	// Check if we have never written meta data to disk before
@@ -216,320 +381,361 @@ static int pull_meta_data(struct log_info *log_info){
 }
 
 
-static int circular_read_log_from_disk(struct fs *fs, unsigned off, char *buf, unsigned size){
-
-	unsigned remainder = DISK_LOG_SIZE - off;
-
-	// TODO is this math correct
-	if(remainder >= size){
-		if (read_log_from_disk(fs, off, buf, size) != 0)
-			return -1;
-	}
-	else{
-		// In this case we split to 2 seperate writes to wrap around the buffer
-		if (read_log_from_disk(fs, off, buf, remainder) != 0)
-			return -1;
-		if (read_log_from_disk(fs, 0, buf+remainder, size-remainder) != 0)
-			return -1;
-	}
-	return 0;
-}
-
-static void redo(char* op_list, unsigned op_list_fill){
-
-	unsigned offset = 0;
-	while(true){
-		struct record_header *header =  (struct record_header *)&op_list[offset];
-		char *st = (char *)header + sizeof(struct record_header);
-		// These are all idempotent operations
-		switch(header->op){
-			case ADD_DIRENTRY:
-			{
-				struct sfs_vnode *sv;
-				if(sfs_loadvnode((struct sfs_fs*)log_info.fs->fs_data, ((struct add_direntry *)st)->target_inode_id, SFS_TYPE_INVAL, &sv) != 0)
-					panic("Error reading from disk");
-				sfs_dir_link(sv, ((struct add_direntry *)st)->name, ((struct add_direntry *)st)->inode_id, NULL);
-				break;
-			}
-			case MODIFY_SIZE:
-			{
-				struct sfs_dinode *inodeptr = kmalloc(sizeof(struct sfs_dinode));
-				if (sfs_readblock(log_info.fs, ((struct modify_size *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
-					panic("Error reading from disk.\n");
-				inodeptr->sfi_dindirect = ((struct modify_size *)st)->new_sfi_dindirect;
-				inodeptr->sfi_tindirect = ((struct modify_size *)st)->new_sfi_tindirect;
-				inodeptr->sfi_indirect = ((struct modify_size *)st)->new_sfi_indirect;
-				inodeptr->sfi_size = ((struct modify_size *)st)->new_len;
-
-				for(int i = 0; i < SFS_NDIRECT; i++)
-					inodeptr->sfi_direct[i] = ((struct modify_size *)st)->new_sfi_direct[i];
-
-				if (sfs_writeblock(log_info.fs, ((struct modify_size *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
-					panic("Error writing to disk.\n");
-				kfree(inodeptr);
-				break;
-			}
-			case MODIFY_LINKCOUNT:
-			{
-				struct sfs_dinode *inodeptr = kmalloc(sizeof(struct sfs_dinode));
-				if (sfs_readblock(log_info.fs, ((struct modify_linkcount *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
-					panic("Error reading from disk.\n");
-				inodeptr->sfi_linkcount = ((struct modify_linkcount *)st)->new_linkcount;
-				if (sfs_writeblock(log_info.fs, ((struct modify_linkcount *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
-					panic("Error writing to disk.\n");
-				kfree(inodeptr);
-				break;
-			}
-			case REMOVE_DIRENTRY:
-			{
-				struct sfs_vnode *sv;
-				if(sfs_loadvnode((struct sfs_fs*)log_info.fs->fs_data, ((struct remove_direntry *)st)->victim_inode, SFS_TYPE_INVAL, &sv) != 0)
-					panic("Error reading from disk");
-				sfs_dir_unlink(sv, ((struct remove_direntry *)st)->slot);
-				break;
-			}
-			case ALLOC_INODE:
-				sfs_balloc((struct sfs_fs*)log_info.fs->fs_data, (daddr_t *)&((struct alloc_inode *)st)->inode_id, NULL);
-				break;
-			case FREE_INODE:
-				sfs_bfree((struct sfs_fs*)log_info.fs->fs_data, (daddr_t)((struct free_inode *)st)->inode_id);
-				break;
-			case NOP:
-				break;
-			default:
-				panic("Undefined log entry code\n");
-				break;
+// Reapply one logged operation
+static void redo_record(struct record_header *header, char *st){
+	// These are all idempotent operations
+	switch(header->op){
+		case ADD_DIRENTRY:
+		{
+			struct sfs_vnode *sv;
+			if(sfs_loadvnode((struct sfs_fs*)log_info.fs->fs_data, ((struct add_direntry *)st)->target_inode_id, SFS_TYPE_INVAL, &sv) != 0)
+				panic("Error reading from disk");
+			sfs_dir_link(sv, ((struct add_direntry *)st)->name, ((struct add_direntry *)st)->inode_id, NULL);
+			break;
 		}
+		case MODIFY_SIZE:
+		{
+			struct sfs_dinode *inodeptr = kmalloc(sizeof(struct sfs_dinode));
+			if (sfs_readblock(log_info.fs, ((struct modify_size *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
+				panic("Error reading from disk.\n");
+			inodeptr->sfi_dindirect = ((struct modify_size *)st)->new_sfi_dindirect;
+			inodeptr->sfi_tindirect = ((struct modify_size *)st)->new_sfi_tindirect;
+			inodeptr->sfi_indirect = ((struct modify_size *)st)->new_sfi_indirect;
+			inodeptr->sfi_size = ((struct modify_size *)st)->new_len;
+
+			for(int i = 0; i < SFS_NDIRECT; i++)
+				inodeptr->sfi_direct[i] = ((struct modify_size *)st)->new_sfi_direct[i];
+
+			/* A file with blocks was promoted out of its inode */
+			if (inodeptr->sfi_direct[0] != 0 &&
+			    (inodeptr->sfi_flags & SFS_DF_INLINE)) {
+				inodeptr->sfi_flags &= ~SFS_DF_INLINE;
+				bzero(inodeptr->sfi_inline, sizeof(inodeptr->sfi_inline));
+			}
 
-		offset += header->size + sizeof(struct record_header);
-		op_list_fill -= header->size - sizeof(struct record_header);
-		if(op_list_fill == 0)
+			if (sfs_writeblock_uncached(log_info.fs, ((struct modify_size *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
+				panic("Error writing to disk.\n");
+			kfree(inodeptr);
+			break;
+		}
+		case MODIFY_LINKCOUNT:
+		{
+			struct sfs_dinode *inodeptr = kmalloc(sizeof(struct sfs_dinode));
+			if (sfs_readblock(log_info.fs, ((struct modify_linkcount *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
+				panic("Error reading from disk.\n");
+			inodeptr->sfi_linkcount = ((struct modify_linkcount *)st)->new_linkcount;
+			if (sfs_writeblock_uncached(log_info.fs, ((struct modify_linkcount *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
+				panic("Error writing to disk.\n");
+			kfree(inodeptr);
+			break;
+		}
+		case REMOVE_DIRENTRY:
+		{
+			struct sfs_vnode *sv;
+			if(sfs_loadvnode((struct sfs_fs*)log_info.fs->fs_data, ((struct remove_direntry *)st)->victim_inode, SFS_TYPE_INVAL, &sv) != 0)
+				panic("Error reading from disk");
+			sfs_dir_unlink(sv, ((struct remove_direntry *)st)->slot);
+			break;
+		}
+		case ALLOC_INODE:
+			sfs_balloc((struct sfs_fs*)log_info.fs->fs_data, (daddr_t *)&((struct alloc_inode *)st)->inode_id, NULL);
+			break;
+		case FREE_INODE:
+			sfs_bfree((struct sfs_fs*)log_info.fs->fs_data, (daddr_t)((struct free_inode *)st)->inode_id);
+			break;
+		case NOP:
+			break;
+		default:
+			panic("Undefined log entry code\n");
 			break;
 	}
 }
 
-static void undo(char* op_list, unsigned op_list_fill){
-	while(true){
-		unsigned offset = 0;
-		struct record_header *header;
-		char *st;
-
-		// Read to the end and pull the last entry that hasn't been read
-		while(true){
-			header =  (struct record_header *)&op_list[offset];
-			if(offset + header->size + sizeof(struct record_header) == op_list_fill){
-				st = (char *)header + sizeof(struct record_header);
-				op_list_fill -= header->size - sizeof(struct record_header);
-				break;
-			}
-			offset += header->size + sizeof(struct record_header);
-		}
-
-		// These are all idempotent operations
-		switch(header->op){
-			case ADD_DIRENTRY:
-			{
-				struct sfs_vnode *sv;
-				int slot;
-				// re-link the node first
-				if(sfs_loadvnode((struct sfs_fs*)log_info.fs->fs_data, ((struct add_direntry *)st)->target_inode_id, SFS_TYPE_INVAL, &sv) != 0)
-					panic("Error reading from disk");
-				sfs_dir_link(sv, ((struct add_direntry *)st)->name, ((struct add_direntry *)st)->inode_id, &slot); // Getting EEXIST is fine here
-
-				// now unlink the node
-				sfs_dir_unlink(sv, slot);
-				break;
+// Roll back one logged operation
+static void undo_record(struct record_header *header, char *st){
+	// These are all idempotent operations
+	switch(header->op){
+		case ADD_DIRENTRY:
+		{
+			struct sfs_vnode *sv;
+			int slot;
+			// re-link the node first
+			if(sfs_loadvnode((struct sfs_fs*)log_info.fs->fs_data, ((struct add_direntry *)st)->target_inode_id, SFS_TYPE_INVAL, &sv) != 0)
+				panic("Error reading from disk");
+			sfs_dir_link(sv, ((struct add_direntry *)st)->name, ((struct add_direntry *)st)->inode_id, &slot); // Getting EEXIST is fine here
+
+			// now unlink the node
+			sfs_dir_unlink(sv, slot);
+			break;
             }
-			case MODIFY_SIZE:
-			{
-				struct sfs_dinode *inodeptr = kmalloc(sizeof(struct sfs_dinode));
-				if (sfs_readblock(log_info.fs, ((struct modify_size *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
-					panic("Error reading from disk.\n");
-				inodeptr->sfi_dindirect = ((struct modify_size *)st)->old_sfi_dindirect;
-				inodeptr->sfi_tindirect = ((struct modify_size *)st)->old_sfi_tindirect;
-				inodeptr->sfi_indirect = ((struct modify_size *)st)->old_sfi_indirect;
-				inodeptr->sfi_size = ((struct modify_size *)st)->old_len;
-
-				for(int i = 0; i < SFS_NDIRECT; i++)
-					inodeptr->sfi_direct[i] = ((struct modify_size *)st)->old_sfi_direct[i];
-
-				if (sfs_writeblock(log_info.fs, ((struct modify_size *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
-					panic("Error writing to disk.\n");
-				kfree(inodeptr);
-				break;
-			}
-			case MODIFY_LINKCOUNT:
-			{
-				struct sfs_dinode *inodeptr = kmalloc(sizeof(struct sfs_dinode));
-				if (sfs_readblock(log_info.fs, ((struct modify_linkcount *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
-					panic("Error reading from disk.\n");
-				inodeptr->sfi_linkcount = ((struct modify_linkcount *)st)->old_linkcount;
-				if (sfs_writeblock(log_info.fs, ((struct modify_linkcount *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
-					panic("Error writing to disk.\n");
-				kfree(inodeptr);
-				break;
-			}
-			case REMOVE_DIRENTRY:
-			{
-				struct sfs_vnode *sv;
-				if(sfs_loadvnode((struct sfs_fs*)log_info.fs->fs_data, ((struct remove_direntry *)st)->victim_inode, SFS_TYPE_INVAL, &sv) != 0)
-					panic("Error reading from disk");
-				sfs_dir_link(sv, ((struct remove_direntry *)st)->victim_name, ((struct remove_direntry *)st)->dir_inode_id, NULL);
-				break;
-			}
-			case ALLOC_INODE:
-				sfs_bfree((struct sfs_fs*)log_info.fs->fs_data, (daddr_t)((struct alloc_inode *)st)->inode_id);
-				break;
-			case FREE_INODE:
-				sfs_balloc((struct sfs_fs*)log_info.fs->fs_data, (daddr_t *)&((struct free_inode *)st)->inode_id, NULL);
-				break;
-			case NOP:
-				break;
-			default:
-				panic("Undefined log entry code\n");
-				break;
+		case MODIFY_SIZE:
+		{
+			struct sfs_dinode *inodeptr = kmalloc(sizeof(struct sfs_dinode));
+			if (sfs_readblock(log_info.fs, ((struct modify_size *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
+				panic("Error reading from disk.\n");
+			inodeptr->sfi_dindirect = ((struct modify_size *)st)->old_sfi_dindirect;
+			inodeptr->sfi_tindirect = ((struct modify_size *)st)->old_sfi_tindirect;
+			inodeptr->sfi_indirect = ((struct modify_size *)st)->old_sfi_indirect;
+			inodeptr->sfi_size = ((struct modify_size *)st)->old_len;
+
+			for(int i = 0; i < SFS_NDIRECT; i++)
+				inodeptr->sfi_direct[i] = ((struct modify_size *)st)->old_sfi_direct[i];
+
+			if (sfs_writeblock_uncached(log_info.fs, ((struct modify_size *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
+				panic("Error writing to disk.\n");
+			kfree(inodeptr);
+			break;
 		}
-
-		if(op_list_fill == 0)
+		case MODIFY_LINKCOUNT:
+		{
+			struct sfs_dinode *inodeptr = kmalloc(sizeof(struct sfs_dinode));
+			if (sfs_readblock(log_info.fs, ((struct modify_linkcount *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
+				panic("Error reading from disk.\n");
+			inodeptr->sfi_linkcount = ((struct modify_linkcount *)st)->old_linkcount;
+			if (sfs_writeblock_uncached(log_info.fs, ((struct modify_linkcount *)st)->inode_id, inodeptr, sizeof(struct sfs_dinode)) != 0)
+				panic("Error writing to disk.\n");
+			kfree(inodeptr);
+			break;
+		}
+		case REMOVE_DIRENTRY:
+		{
+			struct sfs_vnode *sv;
+			if(sfs_loadvnode((struct sfs_fs*)log_info.fs->fs_data, ((struct remove_direntry *)st)->victim_inode, SFS_TYPE_INVAL, &sv) != 0)
+				panic("Error reading from disk");
+			sfs_dir_link(sv, ((struct remove_direntry *)st)->victim_name, ((struct remove_direntry *)st)->dir_inode_id, NULL);
+			break;
+		}
+		case ALLOC_INODE:
+			sfs_bfree((struct sfs_fs*)log_info.fs->fs_data, (daddr_t)((struct alloc_inode *)st)->inode_id);
+			break;
+		case FREE_INODE:
+			sfs_balloc((struct sfs_fs*)log_info.fs->fs_data, (daddr_t *)&((struct free_inode *)st)->inode_id, NULL);
+			break;
+		case NOP:
+			break;
+		default:
+			panic("Undefined log entry code\n");
 			break;
 	}
 }
 
-// Scans from the current tail forward
-static void recover_transaction(struct record_header *header, unsigned seek_location, int flag){
-
-	// Initialization
-	char* op_list = kmalloc(LOG_BUFFER_SIZE);
-	unsigned op_list_fill;
-
-	uint64_t transaction = header->transaction_id;
-
-	unsigned filled = buf1 ->buffer_filled;
-	unsigned offset = 0;
-	struct log_buffer *active = buf1;
-
-	// Check if obj is within bounds of buffer, if not pull into new buffer with this as tail and set char*
-	// I know I can read this whole struct from memory
-	while(true){
-
-		// Make sure we have enough space to read the next entry
-		if(((LOG_BUFFER_SIZE - filled) < sizeof(struct record_header)) ||
-				((LOG_BUFFER_SIZE - filled) < (sizeof(struct record_header) + header->size))){
-			circular_read_log_from_disk(log_info.fs, ((seek_location + offset) % DISK_LOG_SIZE), buf2->buffer, LOG_BUFFER_SIZE);
-			header =  (struct record_header *)&buf2->buffer[0];
-			filled = LOG_BUFFER_SIZE;
-			active = buf2;
-		}
-
-		if(header->transaction_id == transaction){
-			switch(header->op){
-			case CHECKPOINT:
-				panic("Invalid transaction id for checkpoint.\n");
-				break;
-			case ABORT:
-				if(flag == UNDO)
-					undo(op_list, op_list_fill);
-				goto out;
-				break;
-			case COMMIT:
-				if(flag == REDO)
-					redo(op_list, op_list_fill);
-				goto out;
-			default:
-				memcpy((void *)&op_list[op_list_fill], (void *)header, sizeof(struct record_header) + header->size);
-				op_list_fill += sizeof(struct record_header) + header->size;
-				break;
-			}
+// Recovery reads the live log through a window of a few blocks at a time, so it needs the same small
+// amount of memory however full the log is
+#define LOG_WINDOW_BLOCKS 8
+#define LOG_RECORD_MAX (BLOCK_SIZE - sizeof(struct record_header)) // no record body is bigger than this
+
+struct log_reader{
+	struct fs *lr_fs;
+	char *lr_window;
+	unsigned lr_first; // log block the window starts at
+	unsigned lr_nblocks; // blocks in the window; 0 if nothing is loaded
+};
+
+// Copy LEN bytes of the log from byte index OFF on, which can wrap past the end, loading windows as needed
+static int log_reader_copy(struct log_reader *lr, unsigned off, void *dst, unsigned len){
+	unsigned pos, block, n, end;
+	int result;
+
+	while(len > 0){
+		pos = off % DISK_LOG_SIZE;
+		block = pos / BLOCK_SIZE;
+		if(lr->lr_nblocks == 0 || block < lr->lr_first || block >= lr->lr_first + lr->lr_nblocks){
+			// Windows don't wrap, so the last one can be short
+			n = DISK_LOG_SIZE / BLOCK_SIZE - block;
+			if(n > LOG_WINDOW_BLOCKS)
+				n = LOG_WINDOW_BLOCKS;
+			lr->lr_nblocks = 0;
+			result = FSOP_READBLOCK(lr->lr_fs, JOURNAL_START_BLOCK + block, lr->lr_window, n * BLOCK_SIZE);
+			if(result)
+				return result;
+			lr->lr_first = block;
+			lr->lr_nblocks = n;
 		}
+		end = (lr->lr_first + lr->lr_nblocks) * BLOCK_SIZE;
+		n = end - pos < len ? end - pos : len;
+		memcpy(dst, lr->lr_window + (pos - lr->lr_first * BLOCK_SIZE), n);
+		dst = (char *)dst + n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
 
-		// TODO will this work?
-		// Move up to next header
-		header = (struct record_header *)((char *)header + sizeof(struct record_header) + header->size);
-
-		// Decrement how much of the buffer is left to read
-		filled -= sizeof(struct record_header) + header->size;
+// Read the header of the record OFF bytes past the tail, and its body too if BODY isn't NULL
+static int read_record(struct log_reader *lr, unsigned off, struct record_header *header, char *body){
+	int result;
 
-		// Increment offset into log from the tail
-		offset += sizeof(struct record_header) + header->size;
+	result = log_reader_copy(lr, log_info.tail + off, header, sizeof(struct record_header));
+	if(result == 0 && body != NULL && header->size > 0)
+		result = log_reader_copy(lr, log_info.tail + off + sizeof(struct record_header), body, header->size);
+	return result;
+}
 
-		if(offset >= log_info.len){
-			if(flag == UNDO)
-				undo(op_list, op_list_fill);
-			goto out;
-		}
-	}
+// Set of committed transaction ids, open addressed; SIZE is a power of 2 and 0 marks an empty slot
+static unsigned txnset_slot(uint64_t *set, unsigned size, uint64_t id){
+	unsigned i = (unsigned)((id * 0x9e3779b97f4a7c15ULL) >> 32) & (size - 1);
 
-out:
-	kfree(op_list);
+	while(set[i] != 0 && set[i] != id)
+		i = (i + 1) & (size - 1);
+	return i;
 }
 
-static void scan_buffer(int flag){
+static bool is_data_record(struct record_header *header){
+	return header->op != CHECKPOINT && header->op != ABORT && header->op != COMMIT;
+}
 
-	unsigned offset = 0;
-	struct record_header *header;
+// Recover from the live part of the log. The first scan finds where the whole records end and counts
+// the commits, the second collects the committed transaction ids, and the third counts the records of
+// transactions that didn't commit. Nothing has been changed on disk up to then, so running out of memory
+// or failing to read the log just fails the mount. Then redo the committed transactions in log order,
+// noting where the others' records are, and undo those newest first.
+static int replay_log(void){
+	unsigned len = (log_info.head + DISK_LOG_SIZE - log_info.tail) % DISK_LOG_SIZE;
+	unsigned end, off, nrecords, ncommits, nundo, setsize, i;
+	struct record_header header;
+	struct log_reader lr;
+	unsigned *undo = NULL;
+	uint64_t *committed = NULL;
+	char *body = NULL;
+	int result;
 
-	circular_read_log_from_disk(log_info.fs, log_info.tail, buf1->buffer, LOG_BUFFER_SIZE);
-	header = (struct record_header *)&buf1->buffer[0];
+	if(len == 0)
+		return 0;
 
-	while(true){
+	lr.lr_fs = log_info.fs;
+	lr.lr_nblocks = 0;
+	lr.lr_window = kmalloc(LOG_WINDOW_BLOCKS * BLOCK_SIZE);
+	body = kmalloc(LOG_RECORD_MAX);
+	if(lr.lr_window == NULL || body == NULL){
+		result = ENOMEM;
+		goto out;
+	}
 
-		// Make sure we have enough space to read the next entry
-		if(((LOG_BUFFER_SIZE - buf1->buffer_filled) < sizeof(struct record_header)) ||
-				((LOG_BUFFER_SIZE - buf1->buffer_filled) < (sizeof(struct record_header) + header->size))){
-			circular_read_log_from_disk(log_info.fs, ((log_info.tail + offset) % DISK_LOG_SIZE), buf1->buffer, LOG_BUFFER_SIZE);
-			buf1->buffer_filled = LOG_BUFFER_SIZE;
-		}
+	// Find the end, stopping at the first record that isn't whole or isn't the next in sequence
+	nrecords = ncommits = 0;
+	for(off = 0; off + sizeof(struct record_header) <= len;
+	    off += sizeof(struct record_header) + header.size){
+		result = read_record(&lr, off, &header, NULL);
+		if(result)
+			goto out;
+		if(header.op < CHECKPOINT || header.op > NOP || header.size > LOG_RECORD_MAX ||
+		   off + sizeof(struct record_header) + header.size > len)
+			break;
+		if(nrecords > 0 && header.record_id != log_info.last_id)
+			break;
 
-		if(header->record_id == header->transaction_id)
-			recover_transaction(header, ((log_info.tail + offset) % DISK_LOG_SIZE), flag);
+		nrecords++;
+		log_info.last_id = header.record_id + 1;
+		if(header.op == COMMIT)
+			ncommits++;
+	}
+	end = off;
 
-		// Move up to next header
-		header = (struct record_header *)((char *)header + sizeof(struct record_header) + header->size);
+	for(setsize = 16; setsize < 2 * ncommits; setsize *= 2);
+	committed = kmalloc(setsize * sizeof(committed[0]));
+	if(committed == NULL){
+		result = ENOMEM;
+		goto out;
+	}
+	bzero(committed, setsize * sizeof(committed[0]));
 
-		// Decrement how much of the buffer is left to read
-		buf1->buffer_filled -= sizeof(struct record_header) + header->size;
+	nundo = 0;
+	for(off = 0; off < end; off += sizeof(struct record_header) + header.size){
+		result = read_record(&lr, off, &header, NULL);
+		if(result)
+			goto out;
+		if(header.op == COMMIT)
+			committed[txnset_slot(committed, setsize, header.transaction_id)] = header.transaction_id;
+	}
+	for(off = 0; off < end; off += sizeof(struct record_header) + header.size){
+		result = read_record(&lr, off, &header, NULL);
+		if(result)
+			goto out;
+		if(is_data_record(&header) &&
+		   committed[txnset_slot(committed, setsize, header.transaction_id)] == 0)
+			nundo++;
+	}
+	if(nundo > 0){
+		undo = kmalloc(nundo * sizeof(undo[0]));
+		if(undo == NULL){
+			result = ENOMEM;
+			goto out;
+		}
+	}
 
-		// Increment offset into log from the tail
-		offset += sizeof(struct record_header) + header->size;
+	// From here on the file system is being changed, and like the redo and undo themselves a disk error
+	// can't be backed out of
+	i = 0;
+	for(off = 0; off < end; off += sizeof(struct record_header) + header.size){
+		if(read_record(&lr, off, &header, body) != 0)
+			panic("Error reading from disk.\n");
+		if(!is_data_record(&header))
+			continue;
+		if(committed[txnset_slot(committed, setsize, header.transaction_id)] != 0)
+			redo_record(&header, body);
+		else
+			undo[i++] = off;
+	}
+	KASSERT(i == nundo);
 
+	while(i-- > 0){
+		if(read_record(&lr, undo[i], &header, body) != 0)
+			panic("Error reading from disk.\n");
+		undo_record(&header, body);
 	}
+	result = 0;
+
+out:
+	kfree(undo);
+	kfree(committed);
+	kfree(body);
+	kfree(lr.lr_window);
+	return result;
 }
 
 
+// Returns an error if the log can't be set up or read, before any of it has been applied; the mount
+// has to fail then, or later checkpoints would move the tail past records that were never replayed
 int recover(){
+	int result;
+
 	(void)read_log_from_disk;
 	// Read meta data from byte 0 checking if there is no data there
 	if(pull_meta_data(&log_info) != 0){
 		// TODO this assumes disk_log_size % page_size == 0 right?
 		// Zero disk to claim space for log and meta data (this loop will take a while but it is only for 1st time setup)
 		char *zero_page = kmalloc(PAGE_SIZE);
+		if (zero_page == NULL)
+			return ENOMEM;
+		bzero(zero_page, PAGE_SIZE);
 		for(unsigned i = 0; i < (DISK_LOG_SIZE/PAGE_SIZE); i++){
 			if (write_log_to_disk(log_info.fs, (i*PAGE_SIZE), zero_page,
                                     PAGE_SIZE) != 0) {
                 kfree(zero_page);
-				return -1;
+				return EIO;
             }
 		}
         kfree(zero_page);
 
 		// Add checkpoint to ensure we don't redo this if we crash
-		lock_acquire(log_info.lock);
-		checkpoint();
-		lock_release(log_info.lock);
-
 		// This is the first time we have accessed the disk so skip recovery and return
-		return 0;
+		return checkpoint();
 	}
 
-	// TODO possibly do one more scan for user writes to ensure no user data is leaked
-	// Do redo loop
-	scan_buffer(REDO);
-	// Do undo loop
-	scan_buffer(UNDO);
+	// Appends pick up partway into the block the head is in
+	result = FSOP_READBLOCK(log_info.fs, JOURNAL_START_BLOCK + log_info.head / BLOCK_SIZE,
+				log_tail_block, BLOCK_SIZE);
+	if (result)
+		return result;
 
-	lock_acquire(log_info.lock);
-	checkpoint();
-	lock_release(log_info.lock);
+	// File data was written before any commit that made it reachable, so there's nothing to do for it
+	result = replay_log();
+	if (result)
+		return result;
+
+	// The log has been applied, so the mount goes ahead; if this fails the records just stay in the log
+	if (checkpoint() != 0)
+		kprintf("log: warning: checkpoint after recovery failed\n");
 	return 0;
 }
 
@@ -575,8 +781,6 @@ static int flush_meta_data_to_disk(struct log_info *info){
 
 // Flushes buffer, if there is anything to flush, to disk at this point the len is up to date
 static int flush_log_to_disk(struct log_buffer *buf, struct log_info *info){
-	kprintf("Writing log to disk\n");
-
 	// Lock the buffer so it can't be switched to active during the flush
 	lock_acquire(buf->lock);
 
@@ -613,58 +817,187 @@ static int flush_log_to_disk(struct log_buffer *buf, struct log_info *info){
 	return 0;
 
 out:
+	// The records are lost either way; free the buffer so the writer can swap it back in
+	buf->buffer_filled = 0;
 	lock_release(buf->lock);
 	return -1;
 }
 
 
-// TODO does this work
-static int flush_buffer_cache_to_disk(struct log_info *info){
-	int result = FSOP_SYNC(info->fs);
-	return result;
+// The journal writer. Whenever someone is waiting on the log, take everything in the active buffer,
+// swap in the spare buffer so writers can carry on, and write the batch out. Commits that come in
+// while a write is in progress all go out together in the next one. If a write fails, the records in
+// it are gone, so every commit from then on fails too.
+static void log_writer_thread(void *x1, unsigned long x2){
+	struct log_buffer *buf;
+	struct log_info cpy;
+	uint64_t target;
+	bool failed;
+
+	(void)x1;
+	(void)x2;
+
+	lock_acquire(log_info.lock);
+	while(true){
+		while(log_info.forced <= log_info.durable)
+			cv_wait(log_info.flush_cv, log_info.lock);
+
+		target = log_info.appended;
+
+		// Copy the meta data as of this batch; flushing moves the copy's head to the end of it
+		memcpy(&cpy, &log_info, sizeof(struct log_info));
+		buf = switch_buffer();
+		log_info.head = (log_info.head + buf->buffer_filled) % DISK_LOG_SIZE;
+		cv_broadcast(log_info.durable_cv, log_info.lock);
+		lock_release(log_info.lock);
+
+		failed = flush_log_to_disk(buf, &cpy) != 0;
+
+		lock_acquire(log_info.lock);
+		if(failed && log_info.error == 0){
+			kprintf("log: journal write failed; commits will fail from now on\n");
+			log_info.error = EIO;
+		}
+		log_info.durable = target;
+		cv_broadcast(log_info.durable_cv, log_info.lock);
+	}
 }
 
 
-// Flushes current buffer after adding a checkpoint, blocking all writes to the log buffer and hence the cache
-// TODO check this ordering, also should we change this to rolling?
-int checkpoint(){
-	kprintf("Checkpointing\n");
+// Wait until everything in the log up to LSN is on disk. Fails if the journal can't be written.
+static int log_force(uint64_t lsn){
+	KASSERT(lock_do_i_hold(log_info.lock));
+
+	if(lsn > log_info.forced){
+		log_info.forced = lsn;
+		cv_signal(log_info.flush_cv, log_info.lock);
+	}
+	while(log_info.durable < lsn)
+		cv_wait(log_info.durable_cv, log_info.lock);
+	return log_info.error;
+}
+
+
+// Wake the checkpointer if it isn't already going to run
+static void request_checkpoint(void){
 	KASSERT(lock_do_i_hold(log_info.lock));
 
-	flush_log_to_disk(log_info.active_buffer, &log_info);
+	if(!log_info.checkpoint_wanted){
+		log_info.checkpoint_wanted = true;
+		cv_signal(log_info.checkpoint_cv, log_info.lock);
+	}
+}
 
-	flush_buffer_cache_to_disk(&log_info);
 
-	// Create a new checkpoint entry
+// Rolling checkpoint. Writes back only the buffers changed before it started, which is everything the
+// transactions committed so far touched, then moves the tail up to the oldest transaction still open.
+// Writers carry on meanwhile; one checkpoint runs at a time.
+int checkpoint(){
 	struct checkpoint ch;
-	if(log_info.earliest_transaction)
-		ch.new_tail = log_info.head;
+	unsigned epoch;
+	int result;
+
+	lock_acquire(log_info.checkpoint_lock);
+	lock_acquire(log_info.lock);
+
+	epoch = buffer_epoch_advance();
+	if(txn_open.lt_next != &txn_open)
+		ch.new_tail = txn_open.lt_next->lt_offset;
 	else
-		ch.new_tail = log_info.earliest_transaction;
+		ch.new_tail = (log_info.head + log_info.active_buffer->buffer_filled) % DISK_LOG_SIZE;
+
+	// The records have to be on disk before the buffers they describe
+	result = log_force(log_info.appended);
+	lock_release(log_info.lock);
+
+	if(result == 0)
+		result = sync_fs_buffers_before(log_info.fs, epoch);
+	if(result == 0)
+		result = sfs_sync_freemap(log_info.fs->fs_data);
 
-	// Updates the meta data of the log
-	log_info.tail = ch.new_tail;
+	lock_acquire(log_info.lock);
+	if(result == 0){
+		// Updates the meta data of the log; records appended since the flush are still in memory
+		log_info.tail = ch.new_tail;
+		log_info.len = (log_info.head + DISK_LOG_SIZE - log_info.tail) % DISK_LOG_SIZE +
+			log_info.active_buffer->buffer_filled;
+
+		log_write(CHECKPOINT, sizeof(struct checkpoint), (char *)&ch, 0);
+		result = log_force(log_info.appended);
 
-	// TODO is this math correct?
-	log_info.len = 0;
-	for(unsigned ptr = log_info.tail; ptr != log_info.head;){
-		ptr =  (ptr + 1) % DISK_LOG_SIZE;
-		log_info.len++;
+		log_info.page_count = 0;
 	}
+	cv_broadcast(log_info.space_cv, log_info.lock);
+	lock_release(log_info.lock);
+	lock_release(log_info.checkpoint_lock);
 
-	log_write(CHECKPOINT, sizeof(struct checkpoint), (char *)&ch, 0);
+	return result;
+}
 
-	flush_log_to_disk(log_info.active_buffer, &log_info);
 
-	log_info.page_count = 0;
+// Runs checkpoints in the background when the log starts filling up
+static void log_checkpoint_thread(void *x1, unsigned long x2){
+	(void)x1;
+	(void)x2;
 
-	return 0;
+	lock_acquire(log_info.lock);
+	while(true){
+		while(!log_info.checkpoint_wanted)
+			cv_wait(log_info.checkpoint_cv, log_info.lock);
+		log_info.checkpoint_wanted = false;
+		lock_release(log_info.lock);
+
+		if(checkpoint() != 0)
+			kprintf("log: warning: checkpoint failed\n");
+
+		lock_acquire(log_info.lock);
+	}
+}
+
+// Log space reservations. Every file system operation that can write to the journal calls log_reserve
+// before it takes any vnode locks or buffers, and that's the only place anyone waits for the log to have
+// room. Waiting any later could deadlock: the writer might hold buffers the checkpoint has to write out,
+// or the oldest open transaction, which keeps the tail from moving. The records an operation writes come
+// out of its reservation and the margin, so log_write never waits for space.
+void log_reserve(void){
+	lock_acquire(log_info.lock);
+	while(log_info.len + log_info.reserved + LOG_OP_RESERVE > DISK_LOG_SIZE - MARGIN &&
+	      log_info.error == 0){
+		request_checkpoint();
+		cv_wait(log_info.space_cv, log_info.lock);
+	}
+	log_info.reserved += LOG_OP_RESERVE;
+	if(log_info.len + log_info.reserved > LOG_CHECKPOINT_START)
+		request_checkpoint();
+	lock_release(log_info.lock);
+}
+
+void log_unreserve(void){
+	lock_acquire(log_info.lock);
+	KASSERT(log_info.reserved >= LOG_OP_RESERVE);
+	log_info.reserved -= LOG_OP_RESERVE;
+	cv_broadcast(log_info.space_cv, log_info.lock);
+	lock_release(log_info.lock);
 }
 
+// log_write taking the lock. A COMMIT returns once it is on disk, or 0 if it can't be put there.
 uint64_t safe_log_write(enum operation op, uint16_t size, void *operation_struct, uint64_t txn_id){
 	uint64_t ret;
+
+	// If the transaction's ordered data didn't make it to disk, committing would expose whatever is in
+	// those blocks instead, so abort it
+	if(op == COMMIT && txn_sync_data(txn_id) != 0){
+		lock_acquire(log_info.lock);
+		log_write(ABORT, 0, NULL, txn_id);
+		lock_release(log_info.lock);
+		return 0;
+	}
+
 	lock_acquire(log_info.lock);
 	ret = log_write(op, size, operation_struct, txn_id);
+	// A transaction is done once its commit record is durable
+	if(op == COMMIT && ret != 0 && log_force(log_info.appended) != 0)
+		ret = 0;
 	lock_release(log_info.lock);
 	return ret;
 }
@@ -686,36 +1019,39 @@ static void log_dump(){
 
 
 // Operation struct can be NULL, pass in 0 for txn_id to get a unique txn_id back, and attached to this function
+// Returns 0 once the journal has failed
 uint64_t log_write(enum operation op, uint16_t size, void *operation_struct, uint64_t txn_id){
 	KASSERT(lock_do_i_hold(log_info.lock));
 
-	// Check if we blow the buffer
-	if(sizeof(struct record_header) + size + log_info.active_buffer->buffer_filled >= LOG_BUFFER_SIZE){
-		struct log_buffer *buf = switch_buffer();
-
-		// Copy current state of meta data as it will be updated during flushing
-		struct log_info cpy;
-		memcpy(&cpy, &log_info, sizeof(struct log_info));
-
-		// TODO thread fork this to allow for non-quiesence
-		// TODO will forking here mess up the locks?
-		if(flush_log_to_disk(buf, &cpy) != 0) goto out;
-
+	// If we blow the buffer, have the journal writer take it and wait for it to swap in the spare
+	while(sizeof(struct record_header) + size + log_info.active_buffer->buffer_filled >= LOG_BUFFER_SIZE){
+		if(log_info.appended > log_info.forced){
+			log_info.forced = log_info.appended;
+			cv_signal(log_info.flush_cv, log_info.lock);
+		}
+		cv_wait(log_info.durable_cv, log_info.lock);
 	}
 
-	// Augment len and check if we will blow the log, if the op is a checkpoint, then don't infinitely recurse
-	if(size+sizeof(struct record_header)+log_info.len > DISK_LOG_SIZE - MARGIN){
-		if(op == CHECKPOINT){
-			// check that we don't run the head into the tail (in case we can't clear enough memory with checkpointing)
-			KASSERT(size+sizeof(struct record_header)+log_info.len < DISK_LOG_SIZE);
-		}else{
-			// TODO checkpoint and if it fails goto out, should we thread fork?
-			if(checkpoint() != 0) goto out;
-			// Ensure that there is space after checkpoint
-			KASSERT(size+sizeof(struct record_header)+log_info.len <= DISK_LOG_SIZE - MARGIN);
+	// Augment len and check if we will blow the log, if the op is a checkpoint, then don't wait on ourselves
+	if(op == CHECKPOINT){
+		// check that we don't run the head into the tail (in case we can't clear enough memory with checkpointing)
+		KASSERT(size+sizeof(struct record_header)+log_info.len < DISK_LOG_SIZE);
+	}else{
+		// Checkpoint in the background well before the log fills. Space was waited for when the operation
+		// started (see log_reserve), so this never waits; if the margin runs out anyway, fail the journal
+		// rather than run the head into the tail.
+		if(log_info.len > LOG_CHECKPOINT_START)
+			request_checkpoint();
+		if(size+sizeof(struct record_header)+log_info.len >= DISK_LOG_SIZE && log_info.error == 0){
+			kprintf("log: journal full; commits will fail from now on\n");
+			log_info.error = EIO;
 		}
 	}
 
+	// Once the journal has failed nothing more goes in it, so no transaction can commit
+	if(log_info.error != 0)
+		return 0;
+
 	struct record_header header;
 	header.size = size;
 	header.op = op;
@@ -729,7 +1065,7 @@ uint64_t log_write(enum operation op, uint16_t size, void *operation_struct, uin
 	else
 		header.transaction_id = 0;
 
-    uint64_t offset = ((log_info.head + log_info.active_buffer->buffer_filled) % DISK_LOG_SIZE) + (wrap_times * DISK_LOG_SIZE);
+	unsigned offset = (log_info.head + log_info.active_buffer->buffer_filled) % DISK_LOG_SIZE;
 
 	// Copy onto the buffer
 	// TODO is this pointer math right?
@@ -740,27 +1076,20 @@ uint64_t log_write(enum operation op, uint16_t size, void *operation_struct, uin
 		memcpy(&log_info.active_buffer->buffer[log_info.active_buffer->buffer_filled], operation_struct, size);
 		log_info.active_buffer->buffer_filled += size;
 	}
+	log_info.appended += size + sizeof(struct record_header);
 
     // before = (info->head + buf->buffer_filled) % DISK_LOG_SIZE
 	// Augment the log info data but don't augment the head till its flushed, so we can know where to flush to
 	log_info.len += size + sizeof(struct record_header);
-    if ((log_info.head + size + sizeof(struct record_header)) / DISK_LOG_SIZE == 1) 
-        wrap_times++;
-    
-    if (op == COMMIT) { // remove it from the queue
-        int index = vector_find(&tvector, offset);
-        KASSERT (index != -1);  // if it's a commit, the transaction must be in the vector
-        vector_set(&tvector, index, 0);  // invalidate
-        log_info.earliest_transaction = vector_get_min(&tvector);  // get the next mininun offset or 0
-    } else { // new transaction or another operation of the yet uncommited transaction
-        vector_insert(&tvector, offset);    // if already there, vector_insert does nothing
-    }
+
+	// Keep track of which transactions are open and where they start
+	if(op == COMMIT || op == ABORT)
+		txn_end(header.transaction_id);
+	else if(op != CHECKPOINT && txn_id == 0)
+		txn_begin(header.transaction_id, offset);
 
     (void)log_dump;
 	return header.record_id;
-
-out:
-	return 0;
 }
 
 
@@ -33,6 +33,7 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <synch.h>
@@ -73,6 +74,154 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
 	return 0;
 }
 
+/*
+ * Allocation policy.
+ *
+ * The volume is divided into groups of SFS_GROUPBLOCKS blocks, and we
+ * keep a count of the free blocks in each (sfs_groupfree), so that
+ * searches can skip full or nearly full parts of the disk without
+ * looking at the bitmap.
+ *
+ * File blocks are allocated from a preallocation window kept in the
+ * vnode: a run of up to SFS_PREALLOC blocks, marked in use, that the
+ * file's next allocations are taken from in order. A new window is
+ * looked for starting just past the last block given to the file (or
+ * at the inode, for the first), so a file grows contiguously even
+ * when other files are growing at the same time. The rest of a window
+ * is given back when the file is truncated or its vnode reclaimed.
+ * (If we crash with a window outstanding, its blocks stay marked in
+ * use on disk until sfsck reclaims them.)
+ *
+ * Other blocks (inodes, blocks allocated by log recovery) go first-fit.
+ */
+
+#define SFS_GROUPBLOCKS		1024
+#define SFS_PREALLOC		8
+
+/*
+ * Mark and unmark blocks in the bitmap, keeping the group counts.
+ */
+static
+void
+sfs_bmark(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_bitlock));
+	KASSERT(block < sfs->sfs_super.sp_nblocks);
+
+	bitmap_mark(sfs->sfs_freemap, block);
+	KASSERT(sfs->sfs_groupfree[block / SFS_GROUPBLOCKS] > 0);
+	sfs->sfs_groupfree[block / SFS_GROUPBLOCKS]--;
+	sfs->sfs_freemapdirty = true;
+}
+
+static
+void
+sfs_bunmark(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_bitlock));
+	KASSERT(block < sfs->sfs_super.sp_nblocks);
+
+	bitmap_unmark(sfs->sfs_freemap, block);
+	sfs->sfs_groupfree[block / SFS_GROUPBLOCKS]++;
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Set up the group counts from the freemap. Called at mount time.
+ */
+int
+sfs_balloc_init(struct sfs_fs *sfs)
+{
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	uint32_t i;
+
+	sfs->sfs_ngroups = DIVROUNDUP(nblocks, SFS_GROUPBLOCKS);
+	sfs->sfs_groupfree =
+		kmalloc(sfs->sfs_ngroups * sizeof(sfs->sfs_groupfree[0]));
+	if (sfs->sfs_groupfree == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<sfs->sfs_ngroups; i++) {
+		sfs->sfs_groupfree[i] = 0;
+	}
+	for (i=0; i<nblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_freemap, i)) {
+			sfs->sfs_groupfree[i / SFS_GROUPBLOCKS]++;
+		}
+	}
+	return 0;
+}
+
+void
+sfs_balloc_cleanup(struct sfs_fs *sfs)
+{
+	kfree(sfs->sfs_groupfree);
+	sfs->sfs_groupfree = NULL;
+	sfs->sfs_ngroups = 0;
+}
+
+/*
+ * Find free blocks near GOAL: a run of up to WANT free blocks. Tries
+ * first for whatever run begins at the first free block at or after
+ * GOAL in GOAL's group, then for a run of the full WANT blocks in the
+ * groups after it (wrapping around), then for any free block at all.
+ * Returns the run in START_RET and LEN_RET.
+ */
+static
+int
+sfs_findfree(struct sfs_fs *sfs, daddr_t goal, uint32_t want,
+	     daddr_t *start_ret, uint32_t *len_ret)
+{
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	uint32_t g, n, group, lo, hi, b, run;
+	bool any;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_bitlock));
+	KASSERT(want > 0);
+
+	if (goal >= nblocks) {
+		goal = 0;
+	}
+
+	for (any = false; ; any = true) {
+		for (n = 0; n <= sfs->sfs_ngroups; n++) {
+			/* the goal's group twice: from goal, then from start */
+			g = (goal / SFS_GROUPBLOCKS + n) % sfs->sfs_ngroups;
+			if (sfs->sfs_groupfree[g] == 0 ||
+			    (!any && n > 0 && sfs->sfs_groupfree[g] < want)) {
+				continue;
+			}
+			group = g * SFS_GROUPBLOCKS;
+			lo = (n == 0) ? goal : group;
+			hi = group + SFS_GROUPBLOCKS;
+			if (hi > nblocks) {
+				hi = nblocks;
+			}
+
+			for (b = lo; b < hi; b += run + 1) {
+				/* skip over allocated stretches wholesale */
+				if (bitmap_findzero(sfs->sfs_freemap, b, &b) ||
+				    b >= hi) {
+					break;
+				}
+				run = 0;
+				while (b + run < hi && run < want &&
+				       !bitmap_isset(sfs->sfs_freemap, b + run)) {
+					run++;
+				}
+				if (run > 0 && (any || n == 0 || run == want)) {
+					*start_ret = b;
+					*len_ret = run;
+					return 0;
+				}
+			}
+		}
+		if (any) {
+			return ENOSPC;
+		}
+	}
+}
+
 /*
  * Allocate a block.
  *
@@ -85,31 +234,101 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
 int
 sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret)
 {
+	uint32_t len;
 	int result;
 
 	lock_acquire(sfs->sfs_bitlock);
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	result = sfs_findfree(sfs, 0, 1, diskblock, &len);
 	if (result) {
 		lock_release(sfs->sfs_bitlock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_bmark(sfs, *diskblock);
 
 	lock_release(sfs->sfs_bitlock);
 
-	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
-		panic("sfs: balloc: invalid block %u\n", *diskblock);
+	/* Clear block before returning it */
+	result = sfs_clearblock(sfs, *diskblock, bufret);
+	if (result) {
+		sfs_bfree(sfs, *diskblock);
 	}
+	return result;
+}
+
+/*
+ * Allocate a block for file SV (data or indirect), from its
+ * preallocation window.
+ *
+ * Locking: must hold vnode lock. Gets/releases sfs_bitlock.
+ *
+ * Uses 1 buffer.
+ */
+int
+sfs_balloc_file(struct sfs_vnode *sv, daddr_t *diskblock,
+		struct buf **bufret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	daddr_t goal, start;
+	uint32_t len, i;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	lock_acquire(sfs->sfs_bitlock);
+
+	if (sv->sv_npalloc == 0) {
+		goal = sv->sv_lastblock != 0 ? sv->sv_lastblock + 1 : sv->sv_ino;
+		result = sfs_findfree(sfs, goal, SFS_PREALLOC, &start, &len);
+		if (result) {
+			lock_release(sfs->sfs_bitlock);
+			return result;
+		}
+		for (i=0; i<len; i++) {
+			sfs_bmark(sfs, start + i);
+		}
+		sv->sv_palloc = start;
+		sv->sv_npalloc = len;
+	}
+
+	*diskblock = sv->sv_palloc++;
+	sv->sv_npalloc--;
+	sv->sv_lastblock = *diskblock;
+
+	lock_release(sfs->sfs_bitlock);
 
 	/* Clear block before returning it */
 	result = sfs_clearblock(sfs, *diskblock, bufret);
 	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		sfs_bfree(sfs, *diskblock);
 	}
 	return result;
 }
 
+/*
+ * Give back what's left of SV's preallocation window.
+ *
+ * Locking: must hold vnode lock. Gets/releases sfs_bitlock.
+ */
+void
+sfs_balloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_npalloc == 0) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_bitlock);
+	while (sv->sv_npalloc > 0) {
+		sfs_bunmark(sfs, sv->sv_palloc++);
+		sv->sv_npalloc--;
+	}
+	lock_release(sfs->sfs_bitlock);
+}
+
 /*
  * Free a block.
  */
@@ -117,8 +336,7 @@ void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
 	lock_acquire(sfs->sfs_bitlock);
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_bunmark(sfs, diskblock);
 	lock_release(sfs->sfs_bitlock);
 }
 
@@ -141,4 +359,3 @@ sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 
 	return result;
 }
-
@@ -112,7 +112,7 @@ sfs_get_indirection(uint32_t fileblock, unsigned *indir_ret,
  */
 static
 int
-sfs_bmap_get(struct sfs_fs *sfs, uint32_t *blockptr, bool *dirtyptr,
+sfs_bmap_get(struct sfs_vnode *sv, uint32_t *blockptr, bool *dirtyptr,
 	     bool doalloc, daddr_t *diskblock_ret)
 {
 	daddr_t block;
@@ -127,7 +127,7 @@ sfs_bmap_get(struct sfs_fs *sfs, uint32_t *blockptr, bool *dirtyptr,
 	 * Do we need to allocate?
 	 */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block, NULL);
+		result = sfs_balloc_file(sv, &block, NULL);
 		if (result) {
 			return result;
 		}
@@ -160,12 +160,13 @@ sfs_bmap_get(struct sfs_fs *sfs, uint32_t *blockptr, bool *dirtyptr,
  */
 static
 int
-sfs_bmap_subtree(struct sfs_fs *sfs,
+sfs_bmap_subtree(struct sfs_vnode *sv,
 		 uint32_t *blockptr, unsigned indir, bool *dirtyptr,
 		 uint32_t fileblock, bool doalloc,
 		 daddr_t *diskblock_ret)
 {
-	daddr_t block;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	daddr_t block, idblock;
 	struct buf *idbuf;
 	uint32_t *iddata;
 	bool idbuf_dirty;
@@ -176,7 +177,7 @@ sfs_bmap_subtree(struct sfs_fs *sfs,
 	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(iddata[0]) == SFS_BLOCKSIZE);
 
 	/* Get the block that blockptr points to (maybe allocating) */
-	result = sfs_bmap_get(sfs, blockptr, dirtyptr, doalloc,
+	result = sfs_bmap_get(sv, blockptr, dirtyptr, doalloc,
 			      &block);
 	if (result) {
 		return result;
@@ -192,7 +193,8 @@ sfs_bmap_subtree(struct sfs_fs *sfs,
 		}
 
 		/* Read the indirect block */
-		result = buffer_read(&sfs->sfs_absfs, block,
+		idblock = block;
+		result = buffer_read(&sfs->sfs_absfs, idblock,
 				     SFS_BLOCKSIZE, &idbuf);
 		if (result) {
 			return result;
@@ -225,7 +227,7 @@ sfs_bmap_subtree(struct sfs_fs *sfs,
 		indir--;
 
 		/* Get the address of the next layer down (maybe allocating) */
-		result = sfs_bmap_get(sfs, blockptr, &idbuf_dirty, doalloc,
+		result = sfs_bmap_get(sv, blockptr, &idbuf_dirty, doalloc,
 				      &block);
 		if (result) {
 			buffer_release(idbuf);
@@ -235,11 +237,119 @@ sfs_bmap_subtree(struct sfs_fs *sfs,
 			buffer_mark_dirty(idbuf);
 		}
 		buffer_release(idbuf);
+
+		/*
+		 * An indirect block a growing write allocated or added
+		 * to has to reach disk before the commit that makes the
+		 * inode point into it, like the data blocks do.
+		 */
+		if (idbuf_dirty && sv->sv_ordertxn != 0) {
+			log_order_block(sv->sv_ordertxn, idblock);
+		}
 	}
 	*diskblock_ret = block;
 	return 0;
 }
 
+/*
+ * Move the data of an inline file out of the inode into a new block
+ * 0, so the file can grow past SFS_INLINESIZE.
+ *
+ * Locking: must hold vnode lock, with the inode loaded.
+ *
+ * Uses 1 buffer.
+ */
+int
+sfs_inline_promote(struct sfs_vnode *sv, struct sfs_dinode *inodeptr)
+{
+	struct buf *buf;
+	daddr_t block;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(inodeptr->sfi_flags & SFS_DF_INLINE);
+	KASSERT(inodeptr->sfi_direct[0] == 0);
+
+	/* comes back zeroed and dirty */
+	result = sfs_balloc_file(sv, &block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(buf), inodeptr->sfi_inline, SFS_INLINESIZE);
+	buffer_release(buf);
+	if (sv->sv_ordertxn != 0) {
+		log_order_block(sv->sv_ordertxn, block);
+	}
+
+	inodeptr->sfi_direct[0] = block;
+	inodeptr->sfi_flags &= ~SFS_DF_INLINE;
+	bzero(inodeptr->sfi_inline, sizeof(inodeptr->sfi_inline));
+	sfs_dinode_mark_dirty(sv);
+	return 0;
+}
+
+/*
+ * Per-vnode cache of recent bmap results, kept as extents so that a
+ * contiguously allocated file needs one slot per run rather than one
+ * per block. Only blocks that exist are cached: a hole can be filled
+ * by allocation later, but an allocated block only moves or goes away
+ * by truncation, which empties the cache. Protected by the vnode lock.
+ */
+void
+sfs_bmapcache_clear(struct sfs_vnode *sv)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_BMAPCACHE; i++) {
+		sv->sv_bmap[i].be_len = 0;
+	}
+	sv->sv_bmapnext = 0;
+}
+
+static
+daddr_t
+sfs_bmapcache_lookup(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_bmapent *be;
+	unsigned i;
+
+	for (i=0; i<SFS_BMAPCACHE; i++) {
+		be = &sv->sv_bmap[i];
+		if (fileblock >= be->be_fileblock &&
+		    fileblock - be->be_fileblock < be->be_len) {
+			return be->be_diskblock +
+				(fileblock - be->be_fileblock);
+		}
+	}
+	return 0;
+}
+
+static
+void
+sfs_bmapcache_insert(struct sfs_vnode *sv, uint32_t fileblock,
+		     daddr_t diskblock)
+{
+	struct sfs_bmapent *be;
+	unsigned i;
+
+	/* Grow an extent this block continues, if there is one */
+	for (i=0; i<SFS_BMAPCACHE; i++) {
+		be = &sv->sv_bmap[i];
+		if (be->be_len > 0 &&
+		    be->be_fileblock + be->be_len == fileblock &&
+		    be->be_diskblock + be->be_len == diskblock) {
+			be->be_len++;
+			return;
+		}
+	}
+
+	be = &sv->sv_bmap[sv->sv_bmapnext];
+	sv->sv_bmapnext = (sv->sv_bmapnext + 1) % SFS_BMAPCACHE;
+	be->be_fileblock = fileblock;
+	be->be_diskblock = diskblock;
+	be->be_len = 1;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
@@ -260,10 +370,17 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	bool inode_dirty;
 	unsigned indir, indirnum;
 	uint32_t *blockptr;
+	uint32_t origblock = fileblock;
 	int result;
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
+	/* Skip the walk if we've resolved this block recently */
+	*diskblock = sfs_bmapcache_lookup(sv, fileblock);
+	if (*diskblock != 0) {
+		return 0;
+	}
+
 	/* Figure out where to start */
 	result = sfs_get_indirection(fileblock, &indir, &indirnum, &fileblock);
 	if (result) {
@@ -277,6 +394,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 	inodeptr = sfs_dinode_map(sv);
 
+	/* Inline files have no blocks; sfs_io deals with them */
+	KASSERT((inodeptr->sfi_flags & SFS_DF_INLINE) == 0);
+
 	/* Get the initial block pointer */
 	switch (indir) {
 	    case 0:
@@ -300,12 +420,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 
 	/* Do the work in the indicated subtree */
-    struct alloc_inode op1;
-	op1.inode_id = (uint32_t)diskblock;
-	op1.type = INDIRECTION;
-    safe_log_write(ALLOC_INODE, sizeof (struct alloc_inode), &op1, 0);
-
-	result = sfs_bmap_subtree(sfs,
+	result = sfs_bmap_subtree(sv,
 				  blockptr, indir, &inode_dirty,
 				  fileblock, doalloc,
 				  diskblock);
@@ -325,6 +440,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		      "marked free\n",
 		      *diskblock, fileblock, sv->sv_ino);
 	}
+	if (*diskblock != 0) {
+		sfs_bmapcache_insert(sv, origblock, *diskblock);
+	}
 	return 0;
 }
 
@@ -357,12 +475,38 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len, uint64_t tr_id)
 	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(iddata[0]) == SFS_BLOCKSIZE);
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
+	/* The preallocation window no longer follows the end of the file. */
+	sfs_balloc_release(sv);
+	sfs_bmapcache_clear(sv);
+	sfs_dirindex_destroy(sv);
+
 	result = sfs_dinode_load(sv);
 	if (result) {
 		return result;
 	}
 	inodeptr = sfs_dinode_map(sv);
 
+	/*
+	 * Inline files: growing past what fits means moving the data
+	 * out to a block; shrinking means zeroing the dropped bytes,
+	 * since the space past EOF must stay zero. Neither leaves
+	 * blocks for the code below to free.
+	 */
+	if (inodeptr->sfi_flags & SFS_DF_INLINE) {
+		if (len > SFS_INLINESIZE) {
+			result = sfs_inline_promote(sv, inodeptr);
+			if (result) {
+				sfs_dinode_unload(sv);
+				return result;
+			}
+		}
+		else if (len < inodeptr->sfi_size) {
+			bzero(inodeptr->sfi_inline + len,
+			      inodeptr->sfi_size - len);
+			sfs_dinode_mark_dirty(sv);
+		}
+	}
+
 	for (int i = 0; i < SFS_NDIRECT; i++)
 		op2.old_sfi_direct[i] = inodeptr->sfi_direct[i];
 
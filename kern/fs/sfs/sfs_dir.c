@@ -39,6 +39,7 @@
 #include <synch.h>
 #include <buf.h>
 #include <sfs.h>
+#include <namecache.h>
 #include "sfsprivate.h"
 
 /*
@@ -102,12 +103,16 @@ sfs_writedir(struct sfs_vnode *sv, int slot, struct sfs_dir *sd)
 	KASSERT(slot>=0);
 	actualpos = slot * sizeof(struct sfs_dir);
 
+	/* Keep the name index, if any, in step */
+	sfs_dirindex_update(sv, slot, sd);
+
 	/* Set up a uio to do the write */
 	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
 
 	/* do it */
 	result = sfs_io(sv, &ku);
 	if (result) {
+		sfs_dirindex_destroy(sv);
 		return result;
 	}
 
@@ -160,7 +165,8 @@ sfs_dir_nentries(struct sfs_vnode *sv, int *ret)
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * empty directory slot if one is found. (For directories with a name
+ * index, the empty slot is only looked for if the name isn't found.)
  *
  * Locking: must hold vnode lock. May get/release sfs_bitlock.
  *
@@ -175,11 +181,24 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
+	if (sv->sv_dirindex != NULL) {
+		return sfs_dirindex_findname(sv, name, ino, slot, emptyslot);
+	}
+
 	result = sfs_dir_nentries(sv, &nentries);
 	if (result) {
 		return result;
 	}
 
+	/* Big directories get a name index instead of a scan */
+	result = sfs_dirindex_build(sv, nentries);
+	if (result) {
+		return result;
+	}
+	if (sv->sv_dirindex != NULL) {
+		return sfs_dirindex_findname(sv, name, ino, slot, emptyslot);
+	}
+
 	/* For each slot... */
 	found = 0;
 	for (i=0; i<nentries; i++) {
@@ -347,7 +366,7 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
  * Returns the vnode with its inode unloaded.
  *
  * Locking: must hold vnode lock. May get/release sfs_bitlock.
- *    Also gets/releases sfs_vnlock.
+ *    Also gets/releases a vnode table bucket lock.
  *    Returns the result vnode locked.
  *
  * Requires up to 3 buffers.
@@ -395,7 +414,7 @@ sfs_dir_checkempty(struct sfs_vnode *sv)
  * file, if there is one.
  *
  * Locking: must hold vnode lock. May get/release sfs_bitlock.
- *    Also gets/releases sfs_vnlock.
+ *    Also gets/releases a vnode table bucket lock.
  *
  * Requires up to 3 buffers.
  */
@@ -412,6 +431,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name, struct sfs_vnode **ret,
 	
 	result = sfs_dir_findname(sv, name, &ino, slot, &emptyslot);
 	if (result == ENOENT) {
+		namecache_enter(&sv->sv_v, name, NULL);
 		*ret = NULL;
 		if (slot != NULL) {
 			if (emptyslot < 0) {
@@ -432,6 +452,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name, struct sfs_vnode **ret,
 	if (result) {
 		return result;
 	}
+	namecache_enter(&sv->sv_v, name, &(*ret)->sv_v);
 
 	return 0;
 }
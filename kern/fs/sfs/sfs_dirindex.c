@@ -0,0 +1,381 @@
+/*
+ * SFS filesystem
+ *
+ * In-memory name index for large directories.
+ *
+ * Looking a name up in a directory otherwise reads every slot, so
+ * create, lookup and remove all cost a buffer lookup per entry. Once
+ * a directory has SFS_DIRINDEX_MIN slots, the first lookup builds a
+ * hash of its names that lives with the vnode; after that a lookup
+ * reads only the slots whose names hash the same, which is normally
+ * one. The index holds only hashes and slot numbers, and every hit
+ * is checked against the real entry, so it can't hand back a wrong
+ * answer, only a slow one.
+ *
+ * Empty slots are tracked by count plus a hint below which there are
+ * none, so sfs_dir_link can skip the scan when there are no holes and
+ * otherwise starts where the last hole was found.
+ *
+ * All directory writes go through sfs_writedir, which keeps the index
+ * up to date; truncating the directory or failing to update the
+ * index throws it away, and the next lookup rebuilds it.
+ *
+ * Locking: everything here is protected by the directory's vnode lock.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Directories with fewer slots than this are just scanned */
+#define SFS_DIRINDEX_MIN	32
+
+/* Initial hash size; doubled whenever the chains average 2 long */
+#define SFS_DIRINDEX_NBUCKETS	16
+
+struct sfs_dirname {
+	uint32_t dn_hash;
+	int dn_slot;
+	struct sfs_dirname *dn_next;
+};
+
+struct sfs_dirindex {
+	struct sfs_dirname **di_buckets;
+	unsigned di_nbuckets;		/* always a power of 2 */
+	unsigned di_nnames;		/* names in the index */
+	int di_nslots;			/* slots in the directory */
+	unsigned di_nfree;		/* empty slots among them */
+	int di_freehint;		/* no empty slot below this */
+};
+
+/*
+ * FNV-1a over the name, which may fill sfd_name without a
+ * terminating null.
+ */
+static
+uint32_t
+sfs_dirindex_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+	unsigned i;
+
+	for (i=0; i<SFS_NAMELEN && name[i] != 0; i++) {
+		h = (h ^ (unsigned char)name[i]) * 16777619U;
+	}
+	return h;
+}
+
+static
+struct sfs_dirname **
+sfs_dirindex_bucket(struct sfs_dirindex *di, uint32_t hash)
+{
+	return &di->di_buckets[hash & (di->di_nbuckets - 1)];
+}
+
+/*
+ * Double the number of buckets. Failing is harmless; the chains just
+ * get longer.
+ */
+static
+void
+sfs_dirindex_grow(struct sfs_dirindex *di)
+{
+	struct sfs_dirname **old, *dn;
+	unsigned i, oldn;
+
+	old = di->di_buckets;
+	oldn = di->di_nbuckets;
+
+	di->di_buckets = kmalloc(2 * oldn * sizeof(di->di_buckets[0]));
+	if (di->di_buckets == NULL) {
+		di->di_buckets = old;
+		return;
+	}
+	di->di_nbuckets = 2 * oldn;
+	for (i=0; i<di->di_nbuckets; i++) {
+		di->di_buckets[i] = NULL;
+	}
+
+	for (i=0; i<oldn; i++) {
+		while ((dn = old[i]) != NULL) {
+			old[i] = dn->dn_next;
+			dn->dn_next = *sfs_dirindex_bucket(di, dn->dn_hash);
+			*sfs_dirindex_bucket(di, dn->dn_hash) = dn;
+		}
+	}
+	kfree(old);
+}
+
+static
+int
+sfs_dirindex_add(struct sfs_dirindex *di, uint32_t hash, int slot)
+{
+	struct sfs_dirname *dn, **bucket;
+
+	dn = kmalloc(sizeof(*dn));
+	if (dn == NULL) {
+		return ENOMEM;
+	}
+	dn->dn_hash = hash;
+	dn->dn_slot = slot;
+
+	bucket = sfs_dirindex_bucket(di, hash);
+	dn->dn_next = *bucket;
+	*bucket = dn;
+
+	di->di_nnames++;
+	if (di->di_nnames > 2 * di->di_nbuckets) {
+		sfs_dirindex_grow(di);
+	}
+	return 0;
+}
+
+static
+void
+sfs_dirindex_remove(struct sfs_dirindex *di, uint32_t hash, int slot)
+{
+	struct sfs_dirname *dn, **dnp;
+
+	for (dnp = sfs_dirindex_bucket(di, hash); *dnp != NULL;
+	     dnp = &(*dnp)->dn_next) {
+		dn = *dnp;
+		if (dn->dn_slot == slot) {
+			KASSERT(dn->dn_hash == hash);
+			*dnp = dn->dn_next;
+			kfree(dn);
+			di->di_nnames--;
+			return;
+		}
+	}
+	panic("sfs: dirindex: slot %d missing from index\n", slot);
+}
+
+/*
+ * Throw away the index of a directory, if it has one.
+ */
+void
+sfs_dirindex_destroy(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirname *dn;
+	unsigned i;
+
+	if (di == NULL) {
+		return;
+	}
+	for (i=0; i<di->di_nbuckets; i++) {
+		while ((dn = di->di_buckets[i]) != NULL) {
+			di->di_buckets[i] = dn->dn_next;
+			kfree(dn);
+		}
+	}
+	kfree(di->di_buckets);
+	kfree(di);
+	sv->sv_dirindex = NULL;
+}
+
+/*
+ * Build the index for a directory of NENTRIES slots, if it's big
+ * enough to be worth it. Running out of memory just leaves the
+ * directory unindexed.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_dirindex_build(struct sfs_vnode *sv, int nentries)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dir tsd;
+	int i, result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_dirindex == NULL);
+
+	if (nentries < SFS_DIRINDEX_MIN) {
+		return 0;
+	}
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return 0;
+	}
+	di->di_nbuckets = SFS_DIRINDEX_NBUCKETS;
+	di->di_buckets = kmalloc(di->di_nbuckets * sizeof(di->di_buckets[0]));
+	if (di->di_buckets == NULL) {
+		kfree(di);
+		return 0;
+	}
+	for (i=0; i<(int)di->di_nbuckets; i++) {
+		di->di_buckets[i] = NULL;
+	}
+	di->di_nnames = 0;
+	di->di_nslots = nentries;
+	di->di_nfree = 0;
+	di->di_freehint = nentries;
+	sv->sv_dirindex = di;
+
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			sfs_dirindex_destroy(sv);
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			di->di_nfree++;
+			if (i < di->di_freehint) {
+				di->di_freehint = i;
+			}
+			continue;
+		}
+		result = sfs_dirindex_add(di, sfs_dirindex_hash(tsd.sfd_name),
+					  i);
+		if (result) {
+			sfs_dirindex_destroy(sv);
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find an empty slot, if there is one, starting from the hint.
+ */
+static
+int
+sfs_dirindex_freeslot(struct sfs_vnode *sv, int *emptyslot)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dir tsd;
+	int i, result;
+
+	if (di->di_nfree == 0) {
+		return 0;
+	}
+	for (i = di->di_freehint; i < di->di_nslots; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			di->di_freehint = i;
+			*emptyslot = i;
+			return 0;
+		}
+	}
+	panic("sfs: dirindex: directory %u has %u free slots but none "
+	      "at or past %d\n", sv->sv_ino, di->di_nfree, di->di_freehint);
+}
+
+/*
+ * sfs_dir_findname for an indexed directory. Looks for an empty slot
+ * only if the name isn't there.
+ *
+ * Requires up to 3 buffers.
+ */
+int
+sfs_dirindex_findname(struct sfs_vnode *sv, const char *name,
+		      uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirname *dn;
+	struct sfs_dir tsd;
+	uint32_t hash;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(di != NULL);
+
+	hash = sfs_dirindex_hash(name);
+	for (dn = *sfs_dirindex_bucket(di, hash); dn != NULL;
+	     dn = dn->dn_next) {
+		if (dn->dn_hash != hash) {
+			continue;
+		}
+		result = sfs_readdir(sv, dn->dn_slot, &tsd);
+		if (result) {
+			return result;
+		}
+		KASSERT(tsd.sfd_ino != SFS_NOINO);
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		if (!strcmp(tsd.sfd_name, name)) {
+			if (slot != NULL) {
+				*slot = dn->dn_slot;
+			}
+			if (ino != NULL) {
+				*ino = tsd.sfd_ino;
+			}
+			return 0;
+		}
+	}
+
+	if (emptyslot != NULL) {
+		result = sfs_dirindex_freeslot(sv, emptyslot);
+		if (result) {
+			return result;
+		}
+	}
+	return ENOENT;
+}
+
+/*
+ * Update the index for SD about to be written into SLOT. If the
+ * write then fails, the caller must throw the index away.
+ *
+ * Requires up to 3 buffers.
+ */
+void
+sfs_dirindex_update(struct sfs_vnode *sv, int slot, const struct sfs_dir *sd)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dir old;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (di == NULL) {
+		return;
+	}
+
+	if (slot < di->di_nslots) {
+		result = sfs_readdir(sv, slot, &old);
+		if (result) {
+			sfs_dirindex_destroy(sv);
+			return;
+		}
+		if (old.sfd_ino != SFS_NOINO) {
+			sfs_dirindex_remove(di, sfs_dirindex_hash(old.sfd_name),
+					    slot);
+		}
+		else {
+			KASSERT(di->di_nfree > 0);
+			di->di_nfree--;
+		}
+	}
+	else {
+		/* Extending the directory; any slots skipped over are empty */
+		if (slot > di->di_nslots) {
+			di->di_nfree += slot - di->di_nslots;
+			if (di->di_nslots < di->di_freehint) {
+				di->di_freehint = di->di_nslots;
+			}
+		}
+		di->di_nslots = slot + 1;
+	}
+
+	if (sd->sfd_ino != SFS_NOINO) {
+		result = sfs_dirindex_add(di, sfs_dirindex_hash(sd->sfd_name),
+					  slot);
+		if (result) {
+			sfs_dirindex_destroy(sv);
+			return;
+		}
+	}
+	else {
+		di->di_nfree++;
+		if (slot < di->di_freehint) {
+			di->di_freehint = slot;
+		}
+	}
+}
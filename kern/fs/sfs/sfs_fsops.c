@@ -101,9 +101,9 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 					       ptr, SFS_BLOCKSIZE);
 		}
 		else {
-			result = sfs_writeblock(&sfs->sfs_absfs,
-						SFS_MAP_LOCATION + j,
-						ptr, SFS_BLOCKSIZE);
+			result = sfs_writeblock_uncached(&sfs->sfs_absfs,
+							 SFS_MAP_LOCATION + j,
+							 ptr, SFS_BLOCKSIZE);
 		}
 
 		/* If we failed, stop. */
@@ -114,6 +114,45 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Write out the free block map and the superblock, if they're dirty.
+ * The journal's checkpoints use this along with syncing only older
+ * buffers.
+ */
+int
+sfs_sync_freemap(struct sfs_fs *sfs)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_bitlock);
+
+	/* If the free block map needs to be written, write it. */
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_mapio(sfs, UIO_WRITE);
+		if (result) {
+			lock_release(sfs->sfs_bitlock);
+			return result;
+		}
+		sfs->sfs_freemapdirty = false;
+	}
+
+	/* If the superblock needs to be written, write it. */
+	if (sfs->sfs_superdirty) {
+		result = sfs_writeblock_uncached(&sfs->sfs_absfs,
+						 SFS_SB_LOCATION,
+						 &sfs->sfs_super, SFS_BLOCKSIZE);
+		if (result) {
+			lock_release(sfs->sfs_bitlock);
+			return result;
+		}
+		sfs->sfs_superdirty = false;
+	}
+
+	lock_release(sfs->sfs_bitlock);
+
+	return 0;
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -164,32 +203,7 @@ sfs_sync(struct fs *fs)
 		return result;
 	}
 
-	lock_acquire(sfs->sfs_bitlock);
-
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
-		if (result) {
-			lock_release(sfs->sfs_bitlock);
-			return result;
-		}
-		sfs->sfs_freemapdirty = false;
-	}
-
-	/* If the superblock needs to be written, write it. */
-	if (sfs->sfs_superdirty) {
-		result = sfs_writeblock(&sfs->sfs_absfs, SFS_SB_LOCATION,
-					&sfs->sfs_super, SFS_BLOCKSIZE);
-		if (result) {
-			lock_release(sfs->sfs_bitlock);
-			return result;
-		}
-		sfs->sfs_superdirty = false;
-	}
-
-	lock_release(sfs->sfs_bitlock);
-
-	return 0;
+	return sfs_sync_freemap(sfs);
 }
 
 /*
@@ -226,31 +240,30 @@ sfs_unmount(struct fs *fs)
 	struct sfs_fs *sfs = fs->fs_data;
 
 
-	lock_acquire(sfs->sfs_vnlock);
-	lock_acquire(sfs->sfs_bitlock);
-
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		lock_release(sfs->sfs_bitlock);
-		lock_release(sfs->sfs_vnlock);
+	if (!sfs_vnhash_empty(sfs)) {
 		return EBUSY;
 	}
 
+	lock_acquire(sfs->sfs_bitlock);
+
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Don't let the read-ahead thread touch us after we're gone. */
+	buffer_readahead_cancel(fs);
+
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_vnhash_cleanup(sfs);
+	sfs_balloc_cleanup(sfs);
 	bitmap_destroy(sfs->sfs_freemap);
 
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
 
 	/* Free the lock. VFS guarantees we can do this safely */
-	lock_release(sfs->sfs_vnlock);
 	lock_release(sfs->sfs_bitlock);
-	lock_destroy(sfs->sfs_vnlock);
 	lock_destroy(sfs->sfs_bitlock);
 	lock_destroy(sfs->sfs_renamelock);
 
@@ -323,11 +336,11 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Set up the vnode table */
+	result = sfs_vnhash_init(sfs);
+	if (result) {
 		kfree(sfs);
-		return ENOMEM;
+		return result;
 	}
 
 	/* Set the device so we can use sfs_readblock() */
@@ -338,17 +351,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	sfs->sfs_absfs.fs_ops = &sfs_fsops;
 
 	/* Create and acquire the locks so various stuff works right */
-	sfs->sfs_vnlock = lock_create("sfs_vnlock");
-	if (sfs->sfs_vnlock == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		return ENOMEM;
-	}
-
 	sfs->sfs_bitlock = lock_create("sfs_bitlock");
 	if (sfs->sfs_bitlock == NULL) {
-		lock_destroy(sfs->sfs_vnlock);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
 		return ENOMEM;
 	}
@@ -356,25 +361,21 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	sfs->sfs_renamelock = lock_create("sfs_renamelock");
 	if (sfs->sfs_renamelock == NULL) {
 		lock_destroy(sfs->sfs_bitlock);
-		lock_destroy(sfs->sfs_vnlock);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
 		return ENOMEM;
 	}
 
-	lock_acquire(sfs->sfs_vnlock);
 	lock_acquire(sfs->sfs_bitlock);
 
 	/* Load superblock */
 	result = sfs_readblock(&sfs->sfs_absfs, SFS_SB_LOCATION,
 			       &sfs->sfs_super, SFS_BLOCKSIZE);
 	if (result) {
-		lock_release(sfs->sfs_vnlock);
 		lock_release(sfs->sfs_bitlock);
-		lock_destroy(sfs->sfs_vnlock);
 		lock_destroy(sfs->sfs_bitlock);
 		lock_destroy(sfs->sfs_renamelock);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
 		return result;
 	}
@@ -386,12 +387,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		lock_release(sfs->sfs_vnlock);
 		lock_release(sfs->sfs_bitlock);
-		lock_destroy(sfs->sfs_vnlock);
 		lock_destroy(sfs->sfs_bitlock);
 		lock_destroy(sfs->sfs_renamelock);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
 		return EINVAL;
 	}
@@ -407,24 +406,33 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		lock_release(sfs->sfs_vnlock);
 		lock_release(sfs->sfs_bitlock);
-		lock_destroy(sfs->sfs_vnlock);
 		lock_destroy(sfs->sfs_bitlock);
 		lock_destroy(sfs->sfs_renamelock);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
-		lock_release(sfs->sfs_vnlock);
 		lock_release(sfs->sfs_bitlock);
-		lock_destroy(sfs->sfs_vnlock);
 		lock_destroy(sfs->sfs_bitlock);
 		lock_destroy(sfs->sfs_renamelock);
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
+		kfree(sfs);
+		return result;
+	}
+	bitmap_rescan(sfs->sfs_freemap);
+
+	/* Count up the free space in each allocation group */
+	result = sfs_balloc_init(sfs);
+	if (result) {
+		lock_release(sfs->sfs_bitlock);
+		lock_destroy(sfs->sfs_bitlock);
+		lock_destroy(sfs->sfs_renamelock);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
 		return result;
 	}
@@ -433,17 +441,29 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	sfs->sfs_superdirty = false;
 	sfs->sfs_freemapdirty = false;
 
-	/* Hand back the abstract fs */
-	*ret = &sfs->sfs_absfs;
-
 	// Bootstrap log here
 	// TODO scale to arbitrary # of file systems (by creating new object and linking it)
 	log_info.fs = &sfs->sfs_absfs;
 	log_buffer_bootstrap();
-	recover();
+	result = recover();
+	if (result) {
+		/* Without the log replayed the volume isn't consistent */
+		kprintf("sfs: %s: journal recovery failed: %s\n",
+			sfs->sfs_super.sp_volname, strerror(result));
+		log_info.fs = NULL;
+		lock_release(sfs->sfs_bitlock);
+		lock_destroy(sfs->sfs_bitlock);
+		lock_destroy(sfs->sfs_renamelock);
+		sfs_balloc_cleanup(sfs);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_vnhash_cleanup(sfs);
+		kfree(sfs);
+		return result;
+	}
 
+	/* Hand back the abstract fs */
+	*ret = &sfs->sfs_absfs;
 
-	lock_release(sfs->sfs_vnlock);
 	lock_release(sfs->sfs_bitlock);
 
 	return 0;
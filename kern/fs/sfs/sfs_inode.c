@@ -41,6 +41,7 @@
 #include <vfs.h>
 #include <buf.h>
 #include <sfs.h>
+#include <namecache.h>
 #include "sfsprivate.h"
 #include <log.h>
 
@@ -66,6 +67,16 @@ sfs_vnode_create(uint32_t ino, unsigned type)
 	sv->sv_type = type;
 	sv->sv_dinobuf = NULL;
 	sv->sv_dinobufcount = 0;
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+	sv->sv_palloc = 0;
+	sv->sv_npalloc = 0;
+	sv->sv_lastblock = 0;
+	sfs_bmapcache_clear(sv);
+	sv->sv_hashnext = NULL;
+	sv->sv_dirindex = NULL;
+	sv->sv_ordertxn = 0;
 	return sv;
 }
 
@@ -76,10 +87,84 @@ static
 void
 sfs_vnode_destroy(struct sfs_vnode *victim)
 {
+	sfs_dirindex_destroy(victim);
 	lock_destroy(victim->sv_lock);
 	kfree(victim);
 }
 
+////////////////////////////////////////////////////////////
+// Vnode table
+
+/*
+ * Bucket for inode INO. Inode numbers are block numbers and so tend
+ * to come in runs with regular gaps; multiplicative hashing spreads
+ * them out.
+ */
+static
+struct sfs_vnbucket *
+sfs_vnbucket(struct sfs_fs *sfs, uint32_t ino)
+{
+	return &sfs->sfs_vnodes[(ino * 0x9e3779b1U) >> (32 - SFS_VNHASH_BITS)];
+}
+
+/*
+ * Set up the table at mount time.
+ */
+int
+sfs_vnhash_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		sfs->sfs_vnodes[i].vb_lock = rwlock_create("sfs_vnlock");
+		if (sfs->sfs_vnodes[i].vb_lock == NULL) {
+			while (i-- > 0) {
+				rwlock_destroy(sfs->sfs_vnodes[i].vb_lock);
+			}
+			return ENOMEM;
+		}
+		sfs->sfs_vnodes[i].vb_vnodes = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Tear the table down at unmount time. It must be empty.
+ */
+void
+sfs_vnhash_cleanup(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		KASSERT(sfs->sfs_vnodes[i].vb_vnodes == NULL);
+		rwlock_destroy(sfs->sfs_vnodes[i].vb_lock);
+	}
+}
+
+/*
+ * Check if any vnodes are loaded. Only meaningful if nothing can be
+ * loading any, i.e., at unmount time when VFS holds no references.
+ */
+bool
+sfs_vnhash_empty(struct sfs_fs *sfs)
+{
+	struct sfs_vnbucket *vb;
+	bool empty;
+	unsigned i;
+
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		vb = &sfs->sfs_vnodes[i];
+		rwlock_acquire_read(vb->vb_lock);
+		empty = vb->vb_vnodes == NULL;
+		rwlock_release_read(vb->vb_lock);
+		if (!empty) {
+			return false;
+		}
+	}
+	return true;
+}
+
 /*
  * Load the on-disk inode into sv->sv_dinobuf. This should be done at
  * the beginning of any operation that will need to read or change the
@@ -176,8 +261,9 @@ sfs_dinode_mark_dirty(struct sfs_vnode *sv)
  *
  * This function should try to avoid returning errors other than EBUSY.
  *
- * Locking: gets/releases vnode lock. Gets/releases sfs_vnlock, and 
- *    possibly also sfs_bitlock, while holding the vnode lock.
+ * Locking: gets/releases vnode lock. Gets/releases the vnode table
+ *    bucket lock, and possibly also sfs_bitlock, while holding the
+ *    vnode lock.
  *
  * Requires 1 buffer locally but may also afterward call sfs_itrunc,
  * which takes 4.
@@ -187,13 +273,21 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_vnbucket *vb = sfs_vnbucket(sfs, sv->sv_ino);
+	struct sfs_vnode **svp;
 	struct sfs_dinode *iptr;
-	unsigned ix, i, num;
 	bool buffers_needed;
 	int result;
 
 	lock_acquire(sv->sv_lock);
-	lock_acquire(sfs->sfs_vnlock);
+	rwlock_acquire_write(vb->vb_lock);
+
+	/*
+	 * Drop any name cache entries first, so a namecache_lookup
+	 * racing with us has either already taken its reference (and
+	 * we'll see it below) or won't find the vnode at all.
+	 */
+	namecache_purge(v);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
@@ -208,7 +302,7 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(vb->vb_lock);
 		lock_release(sv->sv_lock);
 		return EBUSY;
 	}
@@ -232,7 +326,7 @@ sfs_reclaim(struct vnode *v)
 		 * This case is likely to lead to problems, but
 		 * there's essentially no helping it...
 		 */
-		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(vb->vb_lock);
 		lock_release(sv->sv_lock);
 		if (buffers_needed) {
 			unreserve_buffers(4, SFS_BLOCKSIZE);
@@ -241,15 +335,24 @@ sfs_reclaim(struct vnode *v)
 	}
 	iptr = sfs_dinode_map(sv);
 
-	/* If there are no on-disk references to the file either, erase it. */
-    struct nop op1;
-    uint64_t tr_id = safe_log_write(NOP, sizeof (struct nop), &op1, 0);
+	/* Give back any blocks set aside for the file to grow into. */
+	sfs_balloc_release(sv);
 
+	/* If there are no on-disk references to the file either, erase it. */
 	if (iptr->sfi_linkcount==0) {
+		/*
+		 * Reclaim can run from inside other operations, or with
+		 * who knows what locked, so it can't wait for log space
+		 * (see log_reserve); its records go in the margin.
+		 */
+		struct nop op1;
+		uint64_t tr_id = safe_log_write(NOP, sizeof (struct nop), &op1, 0);
+
 		result = sfs_itrunc(sv, 0, tr_id);
 		if (result) {
+			safe_log_write(ABORT, 0, NULL, tr_id);
 			sfs_dinode_unload(sv);
-			lock_release(sfs->sfs_vnlock);
+			rwlock_release_write(vb->vb_lock);
 			lock_release(sv->sv_lock);
 			if (buffers_needed) {
 				unreserve_buffers(4, SFS_BLOCKSIZE);
@@ -267,8 +370,10 @@ sfs_reclaim(struct vnode *v)
         op2.inode_id = sv->sv_ino;
         safe_log_write(FREE_INODE, sizeof (struct free_inode), &op2, tr_id);
 
-        safe_log_write(COMMIT, 0, NULL, tr_id);
-		sfs_bfree(sfs, sv->sv_ino);
+        /* if the journal failed, leave the inode allocated rather than reuse it */
+        if (safe_log_write(COMMIT, 0, NULL, tr_id) != 0) {
+            sfs_bfree(sfs, sv->sv_ino);
+        }
 	}
 	else {
 		sfs_dinode_unload(sv);
@@ -279,25 +384,18 @@ sfs_reclaim(struct vnode *v)
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	for (svp = &vb->vb_vnodes; *svp != sv; svp = &(*svp)->sv_hashnext) {
+		if (*svp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
 		}
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
 
 	vnode_cleanup(&sv->sv_v);
 
-	lock_release(sfs->sfs_vnlock);
+	rwlock_release_write(vb->vb_lock);
 	lock_release(sv->sv_lock);
 
 	sfs_vnode_destroy(sv);
@@ -306,13 +404,54 @@ sfs_reclaim(struct vnode *v)
 	return 0;
 }
 
+/*
+ * Look for inode INO in bucket VB of the table of loaded vnodes. If
+ * it's there, take a reference to it and return it; otherwise return
+ * NULL.
+ *
+ * Locking: caller must hold the bucket lock, for reading or writing.
+ */
+static
+struct sfs_vnode *
+sfs_findvnode(struct sfs_fs *sfs, struct sfs_vnbucket *vb, uint32_t ino,
+	      int forcetype)
+{
+	struct sfs_vnode *sv;
+
+	for (sv = vb->vb_vnodes; sv != NULL; sv = sv->sv_hashnext) {
+		if (sv->sv_ino==ino) {
+			/* Found */
+
+			/* Every inode in memory must be in an allocated block */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: Found inode %u in unallocated "
+				      "block\n", sv->sv_ino);
+			}
+
+			/* forcetype is only allowed when creating objects */
+			KASSERT(forcetype==SFS_TYPE_INVAL);
+
+			/*
+			 * Readers may race each other here; that's fine,
+			 * the refcount has its own spinlock. Reclaim,
+			 * which drops the count to zero, holds the bucket
+			 * lock for writing and so can't run concurrently.
+			 */
+			VOP_INCREF(&sv->sv_v);
+			return sv;
+		}
+	}
+	return NULL;
+}
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
  *
  * The vnode is returned unlocked and with its inode not loaded.
  *
- * Locking: gets/releases sfs_vnlock.
+ * Locking: gets/releases INO's vnode table bucket lock, first for
+ *    reading and then, if the vnode has to be loaded, for writing.
  * 
  * May require 3 buffers if VOP_DECREF triggers reclaim.
  */
@@ -320,43 +459,33 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	struct buf *dinobuf;
 	struct sfs_dinode *dino;
 	const struct vnode_ops *ops;
-	unsigned i, num;
+	struct sfs_vnbucket *vb = sfs_vnbucket(sfs, ino);
 	int result;
 
-	/* sfs_vnlock protects the vnodes table */
-	lock_acquire(sfs->sfs_vnlock);
-
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
-		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_v);
-			lock_release(sfs->sfs_vnlock);
+	/* The bucket lock protects INO's chain; most lookups are hits */
+	rwlock_acquire_read(vb->vb_lock);
+	sv = sfs_findvnode(sfs, vb, ino, forcetype);
+	rwlock_release_read(vb->vb_lock);
+	if (sv != NULL) {
+		*ret = sv;
+		return 0;
+	}
 
-			*ret = sv;
-			return 0;
-		}
+	/*
+	 * Not there; get exclusive access to the bucket and look again,
+	 * in case someone else loaded it while we weren't holding the
+	 * lock.
+	 */
+	rwlock_acquire_write(vb->vb_lock);
+	sv = sfs_findvnode(sfs, vb, ino, forcetype);
+	if (sv != NULL) {
+		rwlock_release_write(vb->vb_lock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
@@ -371,12 +500,12 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	 * Read the block the inode is in.
 	 *
 	 * (We can do this before creating and locking the new vnode
-	 * because we are holding the vnode table lock. Nobody else can
+	 * because we are holding the bucket lock. Nobody else can
 	 * be in here trying to load the same vnode at the same time.)
 	 */
 	result = buffer_read(&sfs->sfs_absfs, ino, SFS_BLOCKSIZE, &dinobuf);
 	if (result) {
-		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(vb->vb_lock);
 		return result;
 	}
 	dino = buffer_map(dinobuf);
@@ -419,7 +548,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	 */
 	sv = sfs_vnode_create(ino, dino->sfi_type);
 	if (sv==NULL) {
-		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(vb->vb_lock);
 		return ENOMEM;
 	}
 
@@ -429,19 +558,14 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnode_init(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
 		sfs_vnode_destroy(sv);
-		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(vb->vb_lock);
 		return result;
 	}
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_v);
-		sfs_vnode_destroy(sv);
-		lock_release(sfs->sfs_vnlock);
-		return result;
-	}
-	lock_release(sfs->sfs_vnlock);
+	sv->sv_hashnext = vb->vb_vnodes;
+	vb->vb_vnodes = sv;
+	rwlock_release_write(vb->vb_lock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -455,7 +579,8 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
  * As a matter of convenience, returns the vnode with its inode loaded.
  *
  * Locking: Gets/release sfs_bitlock.
- *    Also gets/releases sfs_vnlock, but does not hold them together.
+ *    Also gets/releases a vnode table bucket lock, but does not hold
+ *    them together.
  *
  * Requires up to 3 buffers as sfs_loadvnode might trigger reclaim and
  * truncate.
@@ -500,6 +625,12 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	dino = sfs_dinode_map(*ret);
 	KASSERT(dino->sfi_linkcount == 0);
 
+	/* New files start out with their data in the inode */
+	if (type == SFS_TYPE_FILE) {
+		dino->sfi_flags = SFS_DF_INLINE;
+		sfs_dinode_mark_dirty(*ret);
+	}
+
 	return result;
 }
 
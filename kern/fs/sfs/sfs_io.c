@@ -37,6 +37,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <synch.h>
+#include <vm.h>
 #include <vfs.h>
 #include <buf.h>
 #include <device.h>
@@ -100,7 +101,12 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block, or a run of consecutive blocks.
+ *
+ * The buffer cache reads whole clusters, and the last one can run
+ * past the end of the volume; the part beyond the end reads as
+ * zeros. (A single block is always read as asked, so this works for
+ * the superblock before sfs_super is loaded.)
  */
 int
 sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
@@ -108,15 +114,27 @@ sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
 	struct sfs_fs *sfs = fs->fs_data;
 	struct iovec iov;
 	struct uio ku;
+	size_t nblocks;
+
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	nblocks = len / SFS_BLOCKSIZE;
+	if (nblocks > 1 && block + nblocks > sfs->sfs_super.sp_nblocks) {
+		KASSERT(block < sfs->sfs_super.sp_nblocks);
+		nblocks = sfs->sfs_super.sp_nblocks - block;
+		bzero((char *)data + nblocks * SFS_BLOCKSIZE,
+		      len - nblocks * SFS_BLOCKSIZE);
+	}
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	uio_kinit(&iov, &ku, data, nblocks * SFS_BLOCKSIZE,
+		  ((off_t)block) * SFS_BLOCKSIZE, UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Write a block, or a run of consecutive blocks. As with reads, the
+ * part of a run past the end of the volume (which can only be the
+ * zeros sfs_readblock filled in) is skipped.
  */
 int
 sfs_writeblock(struct fs *fs, daddr_t block, void *data, size_t len)
@@ -124,13 +142,42 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *data, size_t len)
 	struct sfs_fs *sfs = fs->fs_data;
 	struct iovec iov;
 	struct uio ku;
+	size_t nblocks;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
+
+	nblocks = len / SFS_BLOCKSIZE;
+	if (nblocks > 1 && block + nblocks > sfs->sfs_super.sp_nblocks) {
+		KASSERT(block < sfs->sfs_super.sp_nblocks);
+		nblocks = sfs->sfs_super.sp_nblocks - block;
+	}
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	uio_kinit(&iov, &ku, data, nblocks * SFS_BLOCKSIZE,
+		  ((off_t)block) * SFS_BLOCKSIZE, UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
 
+/*
+ * Write a block, or a run of consecutive blocks, around the buffer
+ * cache. This is for the superblock, the free map, and the journal,
+ * and for inodes fixed up by journal recovery. Reading a neighboring
+ * block through the cache can bring in a copy of one, which this
+ * write makes stale, so drop it afterwards. (If a read of it is in
+ * progress, buffer_drop waits for that.)
+ */
+int
+sfs_writeblock_uncached(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	size_t i;
+	int result;
+
+	result = sfs_writeblock(fs, block, data, len);
+	for (i=0; i<len / SFS_BLOCKSIZE; i++) {
+		buffer_drop(fs, block + i, SFS_BLOCKSIZE);
+	}
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
@@ -213,6 +260,10 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	}
 
 	buffer_release(iobuffer);
+
+	if (uio->uio_rw == UIO_WRITE && sv->sv_ordertxn != 0) {
+		log_order_block(sv->sv_ordertxn, diskblock);
+	}
 	return 0;
 }
 
@@ -285,9 +336,303 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	buffer_release(iobuf);
+
+	if (uio->uio_rw == UIO_WRITE && sv->sv_ordertxn != 0) {
+		log_order_block(sv->sv_ordertxn, diskblock);
+	}
 	return 0;
 }
 
+/*
+ * Direct I/O.
+ *
+ * Large block-aligned transfers to or from a sector-aligned user
+ * buffer skip the buffer cache. The user pages are pinned and handed
+ * to the device queue by their kernel (direct-mapped) addresses, one
+ * request per page; the requests are adjacent and get merged into one
+ * transfer. Data then moves once, between the disk's transfer buffer
+ * and the user's page, instead of through a cache buffer as well.
+ *
+ * A read goes direct only for blocks that aren't in the cache, since
+ * the cache may hold newer data than the disk; the others, and holes,
+ * go through sfs_blockio as usual. A write drops any cached copy
+ * of the blocks before the transfer, so a dirty one can't be written
+ * over the new data later, and again afterwards, in case read-ahead
+ * loaded the old contents in the meantime.
+ */
+
+#define SFS_DIRECT_MINBLOCKS	8	/* smallest transfer to do direct */
+#define SFS_DIRECT_MAXRUN	64	/* most blocks per device run */
+#define SFS_DIRECT_MAXREQS	(SFS_DIRECT_MAXRUN * SFS_BLOCKSIZE / PAGE_SIZE + 1)
+
+/*
+ * Whether UIO can use direct I/O.
+ */
+static
+bool
+sfs_direct_ok(struct sfs_fs *sfs, struct uio *uio)
+{
+	return sfs->sfs_device->d_ops->devop_submit != NULL &&
+		uio->uio_segflg == UIO_USERSPACE &&
+		uio->uio_iovcnt == 1 &&
+		(vaddr_t)uio->uio_iov->iov_ubase % SFS_BLOCKSIZE == 0 &&
+		uio->uio_resid >= SFS_DIRECT_MINBLOCKS * SFS_BLOCKSIZE;
+}
+
+/*
+ * Completion callback: count the request off.
+ */
+static
+void
+sfs_direct_done(struct devreq *dr)
+{
+	V((struct semaphore *)dr->dr_arg);
+}
+
+/*
+ * Transfer NBLOCKS blocks starting at disk block DISKBLOCK directly
+ * between the disk and the user buffer of UIO, and advance UIO.
+ */
+static
+int
+sfs_direct_run(struct sfs_fs *sfs, struct uio *uio, daddr_t diskblock,
+	       uint32_t nblocks, struct semaphore *sem)
+{
+	struct devreq reqs[SFS_DIRECT_MAXREQS];
+	bool iswrite = uio->uio_rw == UIO_WRITE;
+	vaddr_t va, pageva;
+	paddr_t pa;
+	size_t len, done, frag;
+	unsigned nreqs, npinned, naccepted, i;
+	int result, err;
+
+	KASSERT(nblocks <= SFS_DIRECT_MAXRUN);
+
+	va = (vaddr_t)uio->uio_iov->iov_ubase;
+	len = nblocks * SFS_BLOCKSIZE;
+	KASSERT(uio->uio_iov->iov_len >= len);
+
+	if (iswrite) {
+		for (i=0; i<nblocks; i++) {
+			buffer_drop(&sfs->sfs_absfs, diskblock + i,
+				    SFS_BLOCKSIZE);
+		}
+	}
+
+	/* Pin the pages and build a request for each. */
+	result = 0;
+	nreqs = npinned = 0;
+	for (done = 0; done < len; done += frag) {
+		pageva = (va + done) & PAGE_FRAME;
+		frag = PAGE_SIZE - ((va + done) - pageva);
+		if (frag > len - done) {
+			frag = len - done;
+		}
+
+		/* reading from disk writes to user memory */
+		result = vm_pin_user(pageva, !iswrite, &pa);
+		if (result) {
+			break;
+		}
+		npinned++;
+
+		KASSERT(nreqs < SFS_DIRECT_MAXREQS);
+		reqs[nreqs].dr_block = diskblock + done / SFS_BLOCKSIZE;
+		reqs[nreqs].dr_nblocks = frag / SFS_BLOCKSIZE;
+		reqs[nreqs].dr_data = (void *)(PADDR_TO_KVADDR(pa) +
+					       ((va + done) - pageva));
+		reqs[nreqs].dr_iswrite = iswrite;
+		reqs[nreqs].dr_done = sfs_direct_done;
+		reqs[nreqs].dr_arg = sem;
+		nreqs++;
+	}
+
+	if (result == 0) {
+		/* Submit them all, then wait for all that were accepted. */
+		naccepted = 0;
+		for (i=0; i<nreqs; i++) {
+			err = DEVOP_SUBMIT(sfs->sfs_device, &reqs[i]);
+			if (err) {
+				reqs[i].dr_result = err;
+			}
+			else {
+				naccepted++;
+			}
+		}
+		for (i=0; i<naccepted; i++) {
+			P(sem);
+		}
+		for (i=0; i<nreqs && result == 0; i++) {
+			result = reqs[i].dr_result;
+		}
+	}
+
+	for (i=0; i<npinned; i++) {
+		vm_unpin_user(((va & PAGE_FRAME) + i * PAGE_SIZE));
+	}
+
+	if (iswrite) {
+		for (i=0; i<nblocks; i++) {
+			buffer_drop(&sfs->sfs_absfs, diskblock + i,
+				    SFS_BLOCKSIZE);
+		}
+	}
+
+	if (result) {
+		return result;
+	}
+
+	/* account for it the way uiomove would */
+	uio->uio_iov->iov_ubase = (userptr_t)(va + len);
+	uio->uio_iov->iov_len -= len;
+	uio->uio_resid -= len;
+	uio->uio_offset += len;
+	return 0;
+}
+
+/*
+ * Do NBLOCKS whole blocks of I/O, direct where possible.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_bitlock.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+int
+sfs_directio(struct sfs_vnode *sv, struct uio *uio, uint32_t nblocks)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct semaphore *sem;
+	bool iswrite = uio->uio_rw == UIO_WRITE;
+	daddr_t diskblock, first;
+	uint32_t fileblock, run;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	sem = sem_create("sfsdirect", 0);
+	if (sem == NULL) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	first = 0;
+	while (nblocks > 0) {
+		fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+
+		/* Find a run of blocks that are adjacent on disk. */
+		for (run = 0; run < nblocks && run < SFS_DIRECT_MAXRUN; run++) {
+			result = sfs_bmap(sv, fileblock + run, iswrite,
+					  &diskblock);
+			if (result) {
+				goto out;
+			}
+			if (diskblock == 0 ||
+			    (!iswrite && buffer_incore(&sfs->sfs_absfs,
+						       diskblock,
+						       SFS_BLOCKSIZE))) {
+				break;
+			}
+			if (run == 0) {
+				first = diskblock;
+			}
+			else if (diskblock != first + run) {
+				break;
+			}
+		}
+
+		if (run == 0) {
+			/* hole, or cached: the usual way */
+			result = sfs_blockio(sv, uio);
+			run = 1;
+		}
+		else {
+			result = sfs_direct_run(sfs, uio, first, run, sem);
+		}
+		if (result) {
+			goto out;
+		}
+		nblocks -= run;
+	}
+
+ out:
+	sem_destroy(sem);
+	return result;
+}
+
+/*
+ * Read-ahead.
+ *
+ * A read that starts where the previous read of the vnode ended
+ * continues a sequential stream. For a stream, we keep the next
+ * sv_rawindow blocks of the file queued for the buffer cache's
+ * read-ahead thread, doubling the window each time the stream goes on,
+ * up to SFS_RA_MAXWINDOW. New blocks are queued once less than half
+ * a window is left ahead of the reader. Any other read resets it.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 2 buffers (for sfs_bmap).
+ */
+#define SFS_RA_MINWINDOW	4
+#define SFS_RA_MAXWINDOW	64
+
+static
+void
+sfs_readahead(struct sfs_vnode *sv, struct sfs_dinode *inodeptr,
+	      off_t start, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t fileblock, nextblock, lastblock, eofblock;
+	daddr_t diskblock;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (start != sv->sv_ranext) {
+		/* seek: not (or no longer) sequential */
+		sv->sv_ranext = end;
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+		return;
+	}
+	sv->sv_ranext = end;
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RA_MINWINDOW;
+	}
+	else if (sv->sv_rawindow < SFS_RA_MAXWINDOW) {
+		sv->sv_rawindow *= 2;
+	}
+
+	/* The first block the reader hasn't touched yet */
+	nextblock = DIVROUNDUP(end, SFS_BLOCKSIZE);
+	if (sv->sv_raend >= nextblock + sv->sv_rawindow / 2) {
+		/* plenty already on the way */
+		return;
+	}
+
+	eofblock = DIVROUNDUP(inodeptr->sfi_size, SFS_BLOCKSIZE);
+	lastblock = nextblock + sv->sv_rawindow;
+	if (lastblock > eofblock) {
+		lastblock = eofblock;
+	}
+
+	fileblock = sv->sv_raend > nextblock ? sv->sv_raend : nextblock;
+	for (; fileblock < lastblock; fileblock++) {
+		result = sfs_bmap(sv, fileblock, false, &diskblock);
+		if (result) {
+			/* it's only a hint; the real read will see the error */
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_readahead(&sfs->sfs_absfs, diskblock,
+					 SFS_BLOCKSIZE);
+		}
+	}
+	sv->sv_raend = fileblock;
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  *
@@ -304,6 +649,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t extraresid = 0;
 	struct sfs_dinode *inodeptr;
     uint64_t old_size;
+	off_t startpos = uio->uio_offset;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	bool direct = false;
+	bool inlined = false;
 
     KASSERT(lock_do_i_hold(sv->sv_lock));
 
@@ -346,6 +695,47 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	/*
+	 * A write that grows the file gets its transaction now, so the
+	 * blocks it writes can be put on disk ahead of the commit that
+	 * makes them part of the file (ordered data). Writes within the
+	 * file change no metadata and aren't ordered.
+	 */
+	if (LOG_ORDERED_DATA && uio->uio_rw == UIO_WRITE &&
+	    uio->uio_offset + uio->uio_resid > (off_t)inodeptr->sfi_size) {
+		struct nop nop;
+		sv->sv_ordertxn = safe_log_write(NOP, sizeof(struct nop),
+						 &nop, 0);
+	}
+
+	/*
+	 * Tiny files keep their data in the inode. A write that won't
+	 * fit there moves the data out to a block and carries on.
+	 */
+	if (inodeptr->sfi_flags & SFS_DF_INLINE) {
+		if (uio->uio_rw == UIO_READ ||
+		    uio->uio_offset + uio->uio_resid <= SFS_INLINESIZE) {
+			KASSERT(uio->uio_offset + uio->uio_resid
+				<= SFS_INLINESIZE);
+			inlined = true;
+			result = uiomove(inodeptr->sfi_inline + uio->uio_offset,
+					 uio->uio_resid, uio);
+			if (result == 0 && uio->uio_rw == UIO_WRITE) {
+				sfs_dinode_mark_dirty(sv);
+				/* the data is in the inode block itself */
+				if (sv->sv_ordertxn != 0) {
+					log_order_block(sv->sv_ordertxn,
+							sv->sv_ino);
+				}
+			}
+			goto out;
+		}
+		result = sfs_inline_promote(sv, inodeptr);
+		if (result) {
+			goto out;
+		}
+	}
+
 	/*
 	 * First, do any leading partial block.
 	 */
@@ -379,12 +769,21 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	if (sfs_direct_ok(sfs, uio)) {
+		direct = true;
+		result = sfs_directio(sv, uio, nblocks);
 		if (result) {
 			goto out;
 		}
 	}
+	else {
+		for (i=0; i<nblocks; i++) {
+			result = sfs_blockio(sv, uio);
+			if (result) {
+				goto out;
+			}
+		}
+	}
 
 	/*
 	 * Now do any remaining partial block at the end.
@@ -400,6 +799,16 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
  out:
 
+	if (uio->uio_rw == UIO_READ && result == 0 && !inlined) {
+		if (direct) {
+			/* big reads go direct; don't fill the cache for them */
+			sv->sv_ranext = uio->uio_offset;
+		}
+		else {
+			sfs_readahead(sv, inodeptr, startpos, uio->uio_offset);
+		}
+	}
+
     old_size = inodeptr->sfi_size;
 	/* If writing, adjust file length */
 	if (uio->uio_rw == UIO_WRITE &&
@@ -417,12 +826,20 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
         op1.old_len = old_size;
         op1.new_len = inodeptr->sfi_size;
 
-        uint64_t tr_id = safe_log_write(MODIFY_SIZE, sizeof (struct modify_size), &op1, 0);
+        uint64_t tr_id = safe_log_write(MODIFY_SIZE, sizeof (struct modify_size), &op1, sv->sv_ordertxn);
 
-        safe_log_write(COMMIT, 0, NULL, tr_id);
+        if (safe_log_write(COMMIT, 0, NULL, tr_id) == 0 && result == 0) {
+            result = EIO;
+        }
+		sv->sv_ordertxn = 0;
 
 		sfs_dinode_mark_dirty(sv);
 	}
+	if (sv->sv_ordertxn != 0) {
+		/* didn't grow after all */
+		safe_log_write(ABORT, 0, NULL, sv->sv_ordertxn);
+		sv->sv_ordertxn = 0;
+	}
 	sfs_dinode_unload(sv);
 
 	/* Add in any extra amount we couldn't read because of EOF */
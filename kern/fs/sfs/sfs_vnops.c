@@ -43,6 +43,7 @@
 #include <vfs.h>
 #include <buf.h>
 #include <sfs.h>
+#include <namecache.h>
 #include "sfsprivate.h"
 #include <log.h>
 
@@ -50,7 +51,7 @@
  * Locking protocol for sfs:
  *    The following locks exist:
  *       vnode locks (sv_lock)
- *       vnode table lock (sfs_vnlock)
+ *       vnode table lock (vb_lock, one per hash bucket)
  *       bitmap lock (sfs_bitlock)
  *       rename lock (sfs_renamelock)
  *       buffer lock
@@ -63,7 +64,7 @@
  *       buffer lock      before  bitmap lock
  *
  *    I believe the vnode table lock and the buffer locks are
- *    independent.
+ *    independent. No thread holds more than one vnode table lock.
  *
  *    Ordering among vnode locks:
  *       directory lock    before  lock of a file within the directory
@@ -187,12 +188,14 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	log_reserve();
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(3, SFS_BLOCKSIZE);
 
 	result = sfs_io(sv, uio);
 
 	unreserve_buffers(3, SFS_BLOCKSIZE);
+	log_unreserve();
 	lock_release(sv->sv_lock);
 
 	return result;
@@ -434,6 +437,7 @@ sfs_truncate(struct vnode *v, off_t len)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
+	log_reserve();
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(4, SFS_BLOCKSIZE);
 
@@ -441,9 +445,12 @@ sfs_truncate(struct vnode *v, off_t len)
     uint64_t tr_id = safe_log_write(NOP, sizeof (struct nop), &op1, 0);
 	result = sfs_itrunc(sv, len, tr_id);
 
-    safe_log_write(COMMIT, 0, NULL, tr_id);
+    if (safe_log_write(COMMIT, 0, NULL, tr_id) == 0 && result == 0) {
+        result = EIO;
+    }
 
 	unreserve_buffers(4, SFS_BLOCKSIZE);
+	log_unreserve();
 	lock_release(sv->sv_lock);
 	return result;
 }
@@ -603,12 +610,14 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
+	log_reserve();
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(4, SFS_BLOCKSIZE);
 
 	result = sfs_dinode_load(sv);
 	if (result) {
 		unreserve_buffers(4, SFS_BLOCKSIZE);
+		log_unreserve();
 		lock_release(sv->sv_lock);
 		return result;
 	}
@@ -617,6 +626,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	if (sv_inodebuf->sfi_linkcount == 0) {
 		sfs_dinode_unload(sv);
 		unreserve_buffers(4, SFS_BLOCKSIZE);
+		log_unreserve();
 		lock_release(sv->sv_lock);
 		return ENOENT;
 	}
@@ -627,6 +637,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
 		unreserve_buffers(4, SFS_BLOCKSIZE);
+		log_unreserve();
 		lock_release(sv->sv_lock);
 		return result;
 	}
@@ -634,6 +645,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
 		unreserve_buffers(4, SFS_BLOCKSIZE);
+		log_unreserve();
 		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
@@ -643,12 +655,14 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
 			unreserve_buffers(4, SFS_BLOCKSIZE);
+			log_unreserve();
 			lock_release(sv->sv_lock);
 			return result;
 		}
 
 		*ret = &newguy->sv_v;
 		unreserve_buffers(4, SFS_BLOCKSIZE);
+		log_unreserve();
 		lock_release(sv->sv_lock);
 		return 0;
 	}
@@ -657,6 +671,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
 		unreserve_buffers(4, SFS_BLOCKSIZE);
+		log_unreserve();
 		lock_release(sv->sv_lock);
 		return result;
 	}
@@ -694,23 +709,32 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		unreserve_buffers(4, SFS_BLOCKSIZE);
 
         safe_log_write(ABORT, 0, NULL, tr_id);
+		log_unreserve();
 		return result;
 	}
+	namecache_remove(&sv->sv_v, name);
 
 	/* Update the linkcount of the new file */
 	new_inodeptr->sfi_linkcount++;
 
-    safe_log_write(COMMIT, 0, NULL, tr_id);
+    if (safe_log_write(COMMIT, 0, NULL, tr_id) == 0) {
+        result = EIO;
+    }
 
 	/* and consequently mark it dirty. */
 	sfs_dinode_mark_dirty(newguy);
 
-	*ret = &newguy->sv_v;
-
 	sfs_dinode_unload(newguy);
 	unreserve_buffers(4, SFS_BLOCKSIZE);
+	log_unreserve();
 	lock_release(newguy->sv_lock);
 	lock_release(sv->sv_lock);
+	if (result) {
+		VOP_DECREF(&newguy->sv_v);
+		return result;
+	}
+
+	*ret = &newguy->sv_v;
 	return 0;
 }
 
@@ -736,6 +760,7 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
+	log_reserve();
 	reserve_buffers(4, SFS_BLOCKSIZE);
 
 	/* directory must be locked first */
@@ -747,6 +772,7 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 		lock_release(f->sv_lock);
 		lock_release(sv->sv_lock);
 		unreserve_buffers(4, SFS_BLOCKSIZE);
+		log_unreserve();
 		return result;
 	}
 
@@ -770,11 +796,15 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 		lock_release(sv->sv_lock);
 		unreserve_buffers(4, SFS_BLOCKSIZE);
         safe_log_write(ABORT, 0, NULL, tr_id);
+		log_unreserve();
 
 		return result;
 	}
+	namecache_remove(&sv->sv_v, name);
 
-    safe_log_write(COMMIT, 0, NULL, tr_id);
+    if (safe_log_write(COMMIT, 0, NULL, tr_id) == 0) {
+        result = EIO;
+    }
 
 	/* and update the link count, marking the inode dirty */
 	inodeptr = sfs_dinode_map(f);
@@ -785,7 +815,8 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	lock_release(f->sv_lock);
 	lock_release(sv->sv_lock);
 	unreserve_buffers(4, SFS_BLOCKSIZE);
-	return 0;
+	log_unreserve();
+	return result;
 }
 
 /*
@@ -813,6 +844,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 
 	(void)mode;
 
+	log_reserve();
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(4, SFS_BLOCKSIZE);
 	
@@ -898,6 +930,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 	if (result) {
 		goto die_uncreate;
 	}
+	namecache_remove(&sv->sv_v, name);
 
         /*
          * Increment link counts (Note: not until after the names are
@@ -909,7 +942,9 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
          * remove it.
          */
 
-    safe_log_write(COMMIT, 0, NULL, tr_id);
+    if (safe_log_write(COMMIT, 0, NULL, tr_id) == 0) {
+        result = EIO;
+    }
 
 	new_inodeptr->sfi_linkcount += 2;
 	dir_inodeptr->sfi_linkcount++;
@@ -923,8 +958,8 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 	VOP_DECREF(&newguy->sv_v);
 
 	unreserve_buffers(4, SFS_BLOCKSIZE);
+	log_unreserve();
 
-	KASSERT(result==0);
 	return result;
 
 die_uncreate:
@@ -938,6 +973,7 @@ die_simple:
 
 die_early:
 	unreserve_buffers(4, SFS_BLOCKSIZE);
+	log_unreserve();
 	lock_release(sv->sv_lock);
 	return result;
 }
@@ -966,6 +1002,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 		return EINVAL;
 	}
 
+	log_reserve();
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(4, SFS_BLOCKSIZE);
 
@@ -1031,6 +1068,8 @@ sfs_rmdir(struct vnode *v, const char *name)
         safe_log_write(ABORT, 0, NULL, tr_id);
 		goto die_total;
 	}
+	namecache_remove(&sv->sv_v, name);
+	namecache_purge(&victim->sv_v);
 
 	KASSERT(dir_inodeptr->sfi_linkcount > 1);
 	KASSERT(victim_inodeptr->sfi_linkcount==2);
@@ -1044,7 +1083,9 @@ sfs_rmdir(struct vnode *v, const char *name)
 
 	result = sfs_itrunc(victim, 0, tr_id);
 	/* XXX: I guess we corrupt the fs if truncate fails */
-    safe_log_write(COMMIT, 0, NULL, tr_id);
+    if (safe_log_write(COMMIT, 0, NULL, tr_id) == 0 && result == 0) {
+        result = EIO;
+    }
 
 die_total:
 	sfs_dinode_unload(victim);
@@ -1055,6 +1096,7 @@ die_linkcount:
 	sfs_dinode_unload(sv);
 die_loadsv:
  	unreserve_buffers(4, SFS_BLOCKSIZE);
+ 	log_unreserve();
  	lock_release(sv->sv_lock);
 
 	return result;
@@ -1084,6 +1126,7 @@ sfs_remove(struct vnode *dir, const char *name)
 		return EISDIR;
 	}
 
+	log_reserve();
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(4, SFS_BLOCKSIZE);
 
@@ -1139,8 +1182,11 @@ sfs_remove(struct vnode *dir, const char *name)
         safe_log_write(ABORT, 0, NULL, tr_id);
 		goto out_reference;
 	}
+	namecache_remove(&sv->sv_v, name);
 
-    safe_log_write(COMMIT, 0, NULL, tr_id);
+    if (safe_log_write(COMMIT, 0, NULL, tr_id) == 0) {
+        result = EIO;
+    }
 
 	/* Decrement the link count. */
 	KASSERT(victim_inodeptr->sfi_linkcount > 0);
@@ -1159,6 +1205,7 @@ out_loadsv:
 out_buffers:
 	lock_release(sv->sv_lock);
 	unreserve_buffers(4, SFS_BLOCKSIZE);
+	log_unreserve();
 	return result;
 }
 
@@ -1285,6 +1332,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 * need, the rename lock goes outside all the vnode locks.
 	 */
 
+	log_reserve();
 	reserve_buffers(7, SFS_BLOCKSIZE);
 
 	lock_acquire(sfs->sfs_renamelock);
@@ -1522,6 +1570,18 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	}
 	dir1_inodeptr = sfs_dinode_map(dir1);
 
+	/*
+	 * Whether or not the rest succeeds, the cached names involved
+	 * may no longer be right. If obj1 is a directory its ".." may
+	 * change, and obj2, if any, may be removed.
+	 */
+	namecache_remove(&dir1->sv_v, name1);
+	namecache_remove(&dir2->sv_v, name2);
+	namecache_remove(&obj1->sv_v, "..");
+	if (obj2 != NULL) {
+		namecache_purge(&obj2->sv_v);
+	}
+
     struct nop op1;
     uint64_t tr_id = safe_log_write(NOP, sizeof (struct nop), &op1, 0);
 	/*
@@ -1607,7 +1667,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
             op1.slot = slot2;
             op1.victim_inode = obj2->sv_ino;
             strcpy(op1.victim_name, name2);
-            safe_log_write(REMOVE_DIRENTRY, sizeof (struct remove_direntry), &op1, 0);
+            safe_log_write(REMOVE_DIRENTRY, sizeof (struct remove_direntry), &op1, tr_id);
 
 			/* Remove the name */
 			result = sfs_dir_unlink(dir2, slot2);
@@ -1796,6 +1856,12 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	}
 
  out4:
+    if (result != 0) {
+        safe_log_write(ABORT, 0, NULL, tr_id);
+    }
+    else if (safe_log_write(COMMIT, 0, NULL, tr_id) == 0) {
+        result = EIO;
+    }
  	sfs_dinode_unload(dir1);
  out3:
  	sfs_dinode_unload(dir2);
@@ -1820,10 +1886,10 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	}
 
 	unreserve_buffers(7, SFS_BLOCKSIZE);
+	log_unreserve();
 
 	lock_release(sfs->sfs_renamelock);
 
-    if (result != 0) safe_log_write(ABORT, 0, NULL, tr_id);
 	return result;
 }
 
@@ -1834,6 +1900,7 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_vnode *next;
+	struct vnode *nextv;
 	char *s;
 	int result;
 
@@ -1854,9 +1921,15 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
 		*s = 0;
 		s++;
 
-		lock_acquire(sv->sv_lock);
-		result = sfs_lookonce(sv, path, &next, NULL);
-		lock_release(sv->sv_lock);
+		if (namecache_lookup(&sv->sv_v, path, &nextv)) {
+			next = nextv != NULL ? nextv->vn_data : NULL;
+			result = nextv != NULL ? 0 : ENOENT;
+		}
+		else {
+			lock_acquire(sv->sv_lock);
+			result = sfs_lookonce(sv, path, &next, NULL);
+			lock_release(sv->sv_lock);
+		}
 		
 		if (result) {
 			VOP_DECREF(&sv->sv_v);
@@ -1919,6 +1992,7 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct vnode *dirv;
 	struct sfs_vnode *dir;
 	struct sfs_vnode *final;
+	struct vnode *finalv;
 	int result;
 	char name[SFS_NAMELEN];
 
@@ -1931,11 +2005,15 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	}
 	
 	dir = dirv->vn_data;
-	lock_acquire(dir->sv_lock);
-
-	result = sfs_lookonce(dir, name, &final, NULL);
-
-	lock_release(dir->sv_lock);
+	if (namecache_lookup(dirv, name, &finalv)) {
+		final = finalv != NULL ? finalv->vn_data : NULL;
+		result = finalv != NULL ? 0 : ENOENT;
+	}
+	else {
+		lock_acquire(dir->sv_lock);
+		result = sfs_lookonce(dir, name, &final, NULL);
+		lock_release(dir->sv_lock);
+	}
 	VOP_DECREF(dirv);
 	
 	if (result) {
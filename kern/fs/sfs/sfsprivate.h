@@ -43,11 +43,18 @@ extern const struct vnode_ops sfs_dirops;
 
 
 /* Functions in sfs_balloc.c */
+int sfs_balloc_init(struct sfs_fs *sfs);
+void sfs_balloc_cleanup(struct sfs_fs *sfs);
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret);
+int sfs_balloc_file(struct sfs_vnode *sv, daddr_t *diskblock,
+		    struct buf **bufret);
+void sfs_balloc_release(struct sfs_vnode *sv);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
 /* Functions in sfs_bmap.c */
+int sfs_inline_promote(struct sfs_vnode *sv, struct sfs_dinode *inodeptr);
+void sfs_bmapcache_clear(struct sfs_vnode *sv);
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock,
 		bool doalloc, daddr_t *diskblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len, uint64_t td_id);
@@ -68,12 +75,26 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_dirindex.c */
+int sfs_dirindex_build(struct sfs_vnode *sv, int nentries);
+int sfs_dirindex_findname(struct sfs_vnode *sv, const char *name,
+			  uint32_t *ino, int *slot, int *emptyslot);
+void sfs_dirindex_update(struct sfs_vnode *sv, int slot,
+			 const struct sfs_dir *sd);
+void sfs_dirindex_destroy(struct sfs_vnode *sv);
+
+/* Functions in sfs_fsops.c */
+int sfs_sync_freemap(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
 int sfs_dinode_load(struct sfs_vnode *sv);
 void sfs_dinode_unload(struct sfs_vnode *sv);
 struct sfs_dinode *sfs_dinode_map(struct sfs_vnode *sv);
 void sfs_dinode_mark_dirty(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
+int sfs_vnhash_init(struct sfs_fs *sfs);
+void sfs_vnhash_cleanup(struct sfs_fs *sfs);
+bool sfs_vnhash_empty(struct sfs_fs *sfs);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
 int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
@@ -82,6 +103,8 @@ struct vnode *sfs_getroot(struct fs *fs);
 /* Functions in sfs_io.c */
 int sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct fs *fs, daddr_t block, void *data, size_t len);
+int sfs_writeblock_uncached(struct fs *fs, daddr_t block, void *data,
+			    size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 
 
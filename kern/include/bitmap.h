@@ -37,7 +37,11 @@
  *     bitmap_create  - allocate a new bitmap object.
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
+ *     bitmap_rescan  - recompute internal state after the raw bit data
+ *                      has been changed through bitmap_getdata.
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_findzero - find the first cleared bit at or after an index,
+ *                      without setting it. Returns ENOSPC if none.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
@@ -49,7 +53,10 @@ struct bitmap;  /* Opaque. */
 
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
+void           bitmap_rescan(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_findzero(struct bitmap *, unsigned start,
+                               unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
@@ -39,16 +39,17 @@ struct fs;  /* fs.h */
  * virtually indexed, where the key is a vnode and block offset within
  * the vnode.)
  *
- * In the real world you'd want buffers to be able to be different
- * sizes (since not every FS in existence uses the same block size,
- * and some can use different block sizes as a formatting option) but
- * to reduce complexity here we'll require all buffers to be the
- * ONE_TRUE_BUFFER_SIZE, which is defined in buf.c.
- *
- * In any event each FS should use buffers of only one size, or at
- * least of a consistent size for any particular disk offset, because
- * handling partial or overlapping buffers would be extremely
- * problematic.
+ * Buffers may be any multiple of 512 bytes that divides 4096. The
+ * cache holds disk in 4 KiB clusters, each split into buffers of one
+ * size; block N of size S lives in cluster N / (4096 / S). A miss
+ * reads every missing block of the cluster in one transfer, and
+ * writeback writes adjacent dirty blocks of a cluster together, so
+ * file systems with small blocks get large device transfers without
+ * doing anything special.
+ *
+ * Each FS should use buffers of only one size, or at least of a
+ * consistent size for any particular disk offset, because handling
+ * partial or overlapping buffers would be extremely problematic.
  */
 
 struct buf; /* Opaque. */
@@ -86,6 +87,12 @@ void buffer_drop(struct fs *fs, daddr_t block, size_t size);
 void buffer_release(struct buf *buf);
 void buffer_release_and_invalidate(struct buf *buf);
 
+/*
+ * buffer_incore checks whether a block is in the cache, valid or on
+ * its way in, without getting it.
+ */
+bool buffer_incore(struct fs *fs, daddr_t block, size_t size);
+
 /*
  * Other operations on buffers.
  *
@@ -105,10 +112,43 @@ void buffer_mark_dirty(struct buf *buf);
 void buffer_mark_valid(struct buf *buf);
 int buffer_writeout(struct buf *buf);
 
+/*
+ * buffer_sync_block writes a block out right away if it's cached and
+ * dirty, without getting it; use it to order writes, e.g. file data
+ * ahead of a journal commit that makes the data reachable.
+ */
+int buffer_sync_block(struct fs *fs, daddr_t block, size_t size);
+
 /*
  * Sync.
+ *
+ * sync_fs_buffers writes out every dirty buffer of a file system.
+ *
+ * buffer_epoch_advance starts a new dirty epoch and returns its
+ * number. sync_fs_buffers_before then writes out only the buffers
+ * that became dirty before that epoch began, so a file system can
+ * flush what it changed up to some point without waiting on later
+ * changes. Dirty buffers from before the epoch that are in use are
+ * waited for, so the caller must not hold any of its own.
  */
 int sync_fs_buffers(struct fs *fs);
+unsigned buffer_epoch_advance(void);
+int sync_fs_buffers_before(struct fs *fs, unsigned epoch);
+
+/*
+ * Read-ahead.
+ *
+ * buffer_readahead queues a block to be read into the cache by a
+ * background thread, so a later buffer_read finds it without waiting
+ * for the disk. It doesn't wait and doesn't use a buffer reservation;
+ * requests for cached blocks, or beyond what the queue holds, are
+ * ignored.
+ *
+ * buffer_readahead_cancel discards queued read-ahead for a file
+ * system and waits out any in progress; call it before unmounting.
+ */
+void buffer_readahead(struct fs *fs, daddr_t block, size_t size);
+void buffer_readahead_cancel(struct fs *fs);
 
 /*
  * Starvation/deadlock avoidance logic.
@@ -59,6 +59,7 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_rcu_seq;		/* Last RCU grace period we've noted */
 
 	/*
 	 * Accessed by other cpus.
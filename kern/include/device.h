@@ -51,18 +51,46 @@ struct device {
 	void *d_data;		/* device-specific data */
 };
 
+/*
+ * Asynchronous block I/O request.
+ *
+ * The submitter fills in dr_block through dr_arg and hands the request
+ * to devop_submit, which returns at once. The device may reorder
+ * queued requests and merge adjacent ones. When the transfer is
+ * finished it sets dr_result and dr_complete and calls dr_done, if
+ * not NULL. dr_done may be called from an interrupt handler, so it
+ * must not sleep; waking a thread up is fine. dr_data must be a
+ * kernel address, and the request must stay put until it completes.
+ */
+struct devreq {
+	uint32_t dr_block;		/* first block */
+	uint32_t dr_nblocks;		/* number of blocks */
+	void *dr_data;			/* dr_nblocks * d_blocksize bytes */
+	bool dr_iswrite;
+	void (*dr_done)(struct devreq *);
+	void *dr_arg;			/* for dr_done */
+
+	/* owned by the device while queued */
+	int dr_result;
+	bool dr_complete;
+	struct devreq *dr_next;		/* device queue */
+	struct devreq *dr_merged;	/* requests merged behind this one */
+};
+
 /*
  * Device operations.
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_lastclose - called on last close for cleanup
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_submit - queue a struct devreq (block devices only; may be NULL)
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_lastclose)(struct device *);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_submit)(struct device *, struct devreq *);
 };
 
 /*
@@ -72,6 +100,7 @@ struct device_ops {
 #define DEVOP_LASTCLOSE(d)	((d)->d_ops->devop_lastclose(d))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_SUBMIT(d, r)	((d)->d_ops->devop_submit(d, r))
 
 
 /* Create vnode for a vfs-level device. */
@@ -15,6 +15,7 @@ struct file_desc {
 };
 
 struct file_desc *fd_init(struct vnode *vn, mode_t mode, int flags);
+void fd_destroy(struct file_desc *fd);
 void fd_dec_or_destroy(int index, struct proc *proc);
 
 #endif /* _FD_H_ */
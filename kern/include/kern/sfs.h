@@ -63,6 +63,12 @@
 /* Size of bitmap (in blocks) */
 #define SFS_BITBLOCKS(nblocks)  (SFS_BITMAPSIZE(nblocks)/SFS_BLOCKBITS)
 
+/* Bytes of file data that fit in the inode itself */
+#define SFS_INLINESIZE    ((128-6-SFS_NDIRECT)*4)
+
+/* Flags for sfi_flags */
+#define SFS_DF_INLINE     0x1     /* data is in sfi_inline, not blocks */
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
@@ -89,9 +95,16 @@ struct sfs_dinode {
 	uint32_t sfi_indirect;			/* Indirect block */
 	uint32_t sfi_dindirect;   /* Double indirect block */
 	uint32_t sfi_tindirect;   /* Triple indirect block */
-	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_flags;			/* SFS_DF_* above */
+	char sfi_inline[SFS_INLINESIZE];	/* inline data, else set to 0 */
 };
 
+/*
+ * A regular file with SFS_DF_INLINE set keeps its contents, sfi_size
+ * bytes of it, at the start of sfi_inline; the rest of sfi_inline
+ * and all the block pointers are 0. Directories are never inline.
+ */
+
 /*
  * On-disk directory entry
  */
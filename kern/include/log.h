@@ -7,6 +7,9 @@
 #define LOG_BUFFER_SIZE 4096
 #define DISK_LOG_SIZE (512*512)
 #define MARGIN ((512*512)/10)
+#define LOG_CHECKPOINT_START (DISK_LOG_SIZE/2) // log length at which the checkpointer starts
+#define LOG_OP_RESERVE 4096 // log space set aside for each file system operation in progress
+#define LOG_ORDERED_DATA 1 // write the data blocks of a file's growth out before the commit that makes them part of it
 #define META_DATA_MAGIC 0xB16B00B5
 
 #define UNDO 1
@@ -31,7 +34,20 @@ struct log_info{
 	unsigned len; // len in bytes of the on disk + in memory log
 	uint16_t page_count; // pages stored on disk without checkpointing
 	uint64_t last_id; // id of last entry written
-	unsigned earliest_transaction; // index in bytes of first entry of uncommitted transaction farthest in the past
+	// Group commit: the journal writer thread flushes buffers in the background
+	struct cv *flush_cv; // journal writer waits here for work
+	struct cv *durable_cv; // writers wait here for buffer space or for their commit
+	// Log sequence numbers, in bytes since boot
+	uint64_t appended; // end of the last record put in a buffer
+	uint64_t forced; // someone is waiting for everything up to here
+	uint64_t durable; // everything up to here is on disk
+	int error; // set when a journal write fails; no commit succeeds after that until the next mount
+	// Checkpoints run in the background in the checkpointer thread
+	struct lock *checkpoint_lock; // one checkpoint at a time
+	struct cv *checkpoint_cv; // checkpointer waits here for work
+	struct cv *space_cv; // log_reserve waits here for a checkpoint to free log space
+	unsigned reserved; // bytes set aside by operations in progress
+	bool checkpoint_wanted;
 }log_info;
 
 struct stored_info{
@@ -129,6 +145,9 @@ int log_buffer_bootstrap(void);
 int recover(void);
 uint64_t log_write(enum operation op, uint16_t size, void *operation_struct, uint64_t txn_id);
 uint64_t safe_log_write(enum operation op, uint16_t size, void *operation_struct, uint64_t txn_id);
+void log_order_block(uint64_t txn_id, daddr_t block);
+void log_reserve(void);
+void log_unreserve(void);
 int checkpoint(void);
 int test_read_write(int nargs, char **args);
 
@@ -0,0 +1,48 @@
+#ifndef _NAMECACHE_H_
+#define _NAMECACHE_H_
+
+/*
+ * Pathname component cache.
+ *
+ * Maps (directory vnode, name) to the vnode the name refers to, or to
+ * "doesn't exist" for negative entries, so that repeated lookups of
+ * the same paths don't have to lock and search each directory.
+ *
+ * The cache holds no references. Instead, a filesystem using it must:
+ *    - call namecache_enter only while holding the directory's lock
+ *      and a reference to the child;
+ *    - call namecache_remove for every name it adds to or removes
+ *      from a directory, while holding the directory's lock;
+ *    - call namecache_purge from its reclaim routine before checking
+ *      whether the vnode's refcount is still 1, so that a concurrent
+ *      namecache_lookup either fails or is seen to hold a reference.
+ *
+ * Names longer than NAMECACHE_NAMELEN-1 are not cached.
+ *
+ * Functions:
+ *     namecache_bootstrap - set up the cache at boot.
+ *     namecache_lookup    - look up NAME in DIR. Returns true on a hit,
+ *                           with a new reference to the vnode in RET,
+ *                           or NULL in RET if the name is known not to
+ *                           exist. Returns false if not cached.
+ *     namecache_enter     - record that NAME in DIR is VN (NULL for a
+ *                           negative entry).
+ *     namecache_remove    - forget NAME in DIR.
+ *     namecache_purge     - forget every entry for VN, both as a
+ *                           directory and as a child.
+ *     namecache_printstats - print hit rates.
+ */
+
+#define NAMECACHE_NAMELEN	32
+
+struct vnode;
+
+void namecache_bootstrap(void);
+bool namecache_lookup(struct vnode *dir, const char *name,
+		      struct vnode **ret);
+void namecache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void namecache_remove(struct vnode *dir, const char *name);
+void namecache_purge(struct vnode *vn);
+void namecache_printstats(void);
+
+#endif /* _NAMECACHE_H_ */
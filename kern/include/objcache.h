@@ -0,0 +1,78 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches for fixed-size kernel objects.
+ *
+ * Each cache carves single pages ("slabs") into objects of one size.
+ * The constructor runs once per object when its slab is created and
+ * the destructor once when the slab is given back, so an object that
+ * is freed to the cache keeps whatever the constructor set up (wait
+ * channels, initialized spinlocks) and the next objcache_alloc hands
+ * it out again without redoing that work. Code freeing an object must
+ * therefore leave it in its constructed state.
+ *
+ * Since the constructor runs over every object in a new slab at once,
+ * and free objects keep what it set up, it should only do cheap
+ * setup. Anything sizeable (stacks, page-sized arrays, per-object
+ * locks) belongs in the code that allocates the object.
+ *
+ * A constructor returns 0 or an error code; destructors must not
+ * sleep, because slabs can be released from objcache_free in contexts
+ * that can't (e.g. rcu callbacks).
+ *
+ * Caches that are used during boot, before anything could call
+ * objcache_create, are declared statically with OBJCACHE_INITIALIZER.
+ */
+
+#include <spinlock.h>
+#include <vm.h>
+
+struct objslab {
+	struct objcache *sl_cache;
+	struct objslab *sl_next;	/* on oc_slabs while it has free objs */
+	struct objslab *sl_prev;
+	void *sl_free;			/* free list, linked after each obj */
+	unsigned sl_nfree;
+};
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_size;
+	size_t oc_stride;		/* object plus free-list link */
+	unsigned oc_perslab;
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+
+	struct spinlock oc_lock;
+	struct objslab *oc_slabs;	/* slabs with at least one free obj */
+	unsigned oc_nslabs;		/* all slabs, full ones included */
+	unsigned oc_nfree;		/* free objects over all slabs */
+};
+
+#define OBJCACHE_ALIGN    8
+#define OBJCACHE_HDRSIZE  ROUNDUP(sizeof(struct objslab), OBJCACHE_ALIGN)
+#define OBJCACHE_STRIDE(size) \
+	ROUNDUP((size) + sizeof(void *), OBJCACHE_ALIGN)
+
+#define OBJCACHE_INITIALIZER(name, size, ctor, dtor) {		\
+	.oc_name = (name),						\
+	.oc_size = (size),						\
+	.oc_stride = OBJCACHE_STRIDE(size),				\
+	.oc_perslab = (PAGE_SIZE - OBJCACHE_HDRSIZE) / OBJCACHE_STRIDE(size), \
+	.oc_ctor = (ctor),						\
+	.oc_dtor = (dtor),						\
+	.oc_lock = SPINLOCK_INITIALIZER,				\
+	.oc_slabs = NULL,						\
+	.oc_nslabs = 0,							\
+	.oc_nfree = 0,							\
+}
+
+struct objcache *objcache_create(const char *name, size_t size,
+				 int (*ctor)(void *), void (*dtor)(void *));
+void objcache_destroy(struct objcache *oc);
+
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+
+#endif /* _OBJCACHE_H_ */
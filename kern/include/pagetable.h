@@ -24,6 +24,7 @@ struct page_dir{
 };
 struct page_dir* page_dir_init(void);
 int page_table_add(int index, struct page_dir* pd);
+void page_table_remove(int index, struct page_dir* pd);
 int page_set_busy(struct page_table *pt, int index, bool wait);
 int page_set_free(struct page_table *pt, int index);
 int page_dir_destroy(struct page_dir* pd);
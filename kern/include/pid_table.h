@@ -35,7 +35,8 @@ struct proc;
 int init_pid_table(void);
 void destroy_pid_table(void);
 void procmap_add(unsigned pid, struct proc *proc);
-pid_t pid_get(void);
+void procmap_remove(unsigned pid, struct proc *proc);
+int pid_get(pid_t *ret);
 void pid_destroy(pid_t pid);
 bool pid_in_use(pid_t pid);
 void set_kernel_pid(unsigned index);
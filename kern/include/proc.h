@@ -40,6 +40,7 @@
 #include <fd.h>
 #include <limits.h>
 #include <spinlock.h>
+#include <rcu.h>
 #include <thread.h> /* required for struct threadarray */
 
 struct addrspace;
@@ -75,6 +76,8 @@ struct proc {
     // TODO: change to dynamic array
     struct proc_link *children[MAX_CLD];
     struct proc_link *parent;
+
+    struct rcu_head p_rcu;          /* for deferred free in proc_destroy */
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
@@ -0,0 +1,37 @@
+#ifndef _RCU_H_
+#define _RCU_H_
+
+/*
+ * Read-copy-update style deferred reclamation.
+ *
+ * Read-side critical sections are bracketed with rcu_read_lock() and
+ * rcu_read_unlock(), which turn interrupts off: with interrupts off a
+ * cpu can't be preempted, so it can't reach a context switch while it
+ * is looking at shared data. Every call to thread_switch is therefore
+ * a quiescent state for the cpu making it. A pointer found inside a
+ * read section must not be followed after it ends.
+ *
+ * An updater unpublishes an object (so no new reader can find it) and
+ * hands it to rcu_call. Once every running cpu has passed through a
+ * quiescent state, no reader can still be holding a pointer to it, and
+ * FUNC(ARG) is called to free it. Callbacks run from thread_switch or
+ * the idle loop with interrupts off and no spinlocks held; they may
+ * kfree but must not sleep.
+ */
+
+struct rcu_head {
+	struct rcu_head *rh_next;
+	void (*rh_func)(void *);
+	void *rh_arg;
+};
+
+int rcu_read_lock(void);		/* returns the spl to pass to unlock */
+void rcu_read_unlock(int spl);
+void rcu_call(struct rcu_head *rh, void (*func)(void *), void *arg);
+
+/* Hooks for the thread system. */
+void rcu_cpu_online(void);	/* a cpu starts scheduling threads */
+void rcu_quiescent(void);	/* curcpu is outside any read section */
+void rcu_reclaim(void);		/* run callbacks whose grace period ended */
+
+#endif /* _RCU_H_ */
@@ -50,6 +50,18 @@ struct buf; /* in buf.h */
  */
 #include <kern/sfs.h>
 
+/*
+ * Cached block-map extent: file blocks be_fileblock through
+ * be_fileblock+be_len-1 live at disk blocks be_diskblock onward.
+ */
+struct sfs_bmapent {
+	uint32_t be_fileblock;
+	daddr_t be_diskblock;
+	uint32_t be_len;		/* 0 if the slot is unused */
+};
+
+#define SFS_BMAPCACHE 4
+
 /*
  * In-memory inode
  */
@@ -60,6 +72,29 @@ struct sfs_vnode {
 	struct buf *sv_dinobuf;		/* buffer holding dinode */
 	uint32_t sv_dinobufcount;	/* # times dinobuf has been loaded */
 	struct lock *sv_lock;		/* lock for vnode */
+	off_t sv_ranext;		/* where a sequential read would start */
+	uint32_t sv_rawindow;		/* read-ahead window, in blocks */
+	uint32_t sv_raend;		/* file block read-ahead has reached */
+	daddr_t sv_palloc;		/* next preallocated block */
+	uint32_t sv_npalloc;		/* # preallocated blocks left */
+	daddr_t sv_lastblock;		/* last block allocated to the file */
+	struct sfs_bmapent sv_bmap[SFS_BMAPCACHE]; /* recent bmap results */
+	unsigned sv_bmapnext;		/* next sv_bmap slot to replace */
+	struct sfs_vnode *sv_hashnext;	/* next in vnode table bucket */
+	struct sfs_dirindex *sv_dirindex; /* name index, for big dirs */
+	uint64_t sv_ordertxn;		/* txn new data is written ahead of */
+};
+
+/*
+ * The table of loaded vnodes is hashed by inode number. Each bucket
+ * has its own lock, so lookups of different inodes don't serialize.
+ */
+#define SFS_VNHASH_BITS 6
+#define SFS_VNHASH_SIZE (1 << SFS_VNHASH_BITS)
+
+struct sfs_vnbucket {
+	struct rwlock *vb_lock;		/* lock for this bucket */
+	struct sfs_vnode *vb_vnodes;	/* chained through sv_hashnext */
 };
 
 /*
@@ -70,10 +105,11 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnbucket sfs_vnodes[SFS_VNHASH_SIZE]; /* loaded vnodes */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
-	struct lock *sfs_vnlock;	/* lock for vnode table */
+	uint32_t *sfs_groupfree;	/* free blocks in each group */
+	unsigned sfs_ngroups;		/* number of allocation groups */
 	struct lock *sfs_bitlock;	/* lock for bitmap/superblock */
 	struct lock *sfs_renamelock;	/* lock for sfs_rename() */
 };
@@ -69,24 +69,43 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
- * The name field is for easier debugging. A copy of the name is
- * (should be) made internally.
+ * The name field is for easier debugging. A copy of the name, cut
+ * to SYNCH_NAMELEN-1 characters, is kept in the lock itself so that
+ * locks can live in an object cache with their wait channel attached.
  */
+#define SYNCH_NAMELEN 32
+
 struct lock {
-    char *lk_name;
+    char lk_name[SYNCH_NAMELEN];
     struct wchan *lk_wchan;
-    struct thread *lk_holder;
+    struct thread *volatile lk_holder;
     struct spinlock lk_spinlk;
-    // (don't forget to mark things volatile as needed)
+
+    /* Contention statistics, protected by lk_spinlk */
+    unsigned lk_acquires;       /* # of successful acquisitions */
+    unsigned lk_contended;      /* # of acquisitions that found it held */
+    unsigned lk_sleeps;         /* # of times a waiter had to sleep */
+
+    /* Links on the list of all locks, protected by alllocks_lock */
+    struct lock *lk_next;
+    struct lock *lk_prev;
 };
 
+/*
+ * Number of times lock_acquire polls the holder word while the holder
+ * is running on another CPU before giving up and going to sleep.
+ */
+#define LOCK_SPIN_MAX 1024
+
 struct lock *lock_create(const char *name);
 void lock_acquire(struct lock *);
 
 /*
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
- *                   same time.
+ *                   same time. The lock is adaptive: if the holder is
+ *                   currently running on another CPU the caller spins
+ *                   (up to LOCK_SPIN_MAX polls), otherwise it sleeps.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
@@ -98,6 +117,12 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+/*
+ * Print the contention counters of every lock that has ever been
+ * found held by lock_acquire.
+ */
+void lock_printstats(void);
+
 
 /*
  * Condition variable.
@@ -109,12 +134,12 @@ void lock_destroy(struct lock *);
  * These CVs are expected to support Mesa semantics, that is, no
  * guarantees are made about scheduling.
  *
- * The name field is for easier debugging. A copy of the name is
- * (should be) made internally.
+ * The name field is for easier debugging. As with locks, a copy of
+ * the name is kept inline.
  */
 
 struct cv {
-    char *cv_name;
+    char cv_name[SYNCH_NAMELEN];
     struct wchan *cv_wchan;
     struct spinlock cv_spinlk;
 };
@@ -140,4 +165,49 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or a single
+ * writer. Writers are preferred: once a writer is waiting, new
+ * readers queue up behind it. Readers are not starved either; when a
+ * writer releases the lock, every reader waiting at that point is
+ * admitted as one batch before the next writer gets in.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+    char *rw_name;
+    struct wchan *rw_rwchan;            /* readers sleep here */
+    struct wchan *rw_wwchan;            /* writers sleep here */
+    struct spinlock rw_spinlk;
+    unsigned rw_readers;                /* # of readers holding the lock */
+    unsigned rw_rwaiting;               /* # of readers waiting */
+    unsigned rw_wwaiting;               /* # of writers waiting */
+    unsigned rw_rgeneration;            /* bumped when readers are admitted */
+    struct thread *volatile rw_writer;  /* writer holding the lock */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Blocks while a
+ *                           writer holds the lock or is waiting for it.
+ *    rwlock_release_read  - Drop a read hold.
+ *    rwlock_acquire_write - Get the lock exclusively.
+ *    rwlock_release_write - Drop the exclusive hold. Only the thread
+ *                           holding the lock for writing may do this.
+ *    rwlock_do_i_write    - Return true if the current thread holds the
+ *                           lock for writing; false otherwise.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
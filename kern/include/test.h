@@ -75,6 +75,7 @@ int nettest(int, char **);
 /* Synchronizatin unit tests */
 int lock_unittest(int, char **);
 int cv_unittest(int, char**);
+int rwlock_unittest(int, char **);
 
 /* File descriptor tests */
 int open_test(int, char **);
@@ -51,6 +51,14 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/*
+ * Hold the current process's page containing VADDR in memory, e.g.
+ * for a device to transfer into directly, and return its physical
+ * address. WILLMODIFY marks it dirty. Undo with vm_unpin_user.
+ */
+int vm_pin_user(vaddr_t vaddr, bool willmodify, paddr_t *ret);
+void vm_unpin_user(vaddr_t vaddr);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
@@ -47,11 +47,93 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * The summary is never saved anywhere, so it can use full-width
+ * words: bit j of full[s] is set when v[s*SUM_BITS + j] has no clear
+ * bits. Searches skip 256 bits at a time over full regions, and
+ * bitmap_alloc starts from the summary word it last allocated from
+ * instead of from zero, so it doesn't rescan the full front of a
+ * nearly full map on every call.
+ */
+#define SUM_BITS        32
+#define SUM_ALLBITS     (0xffffffffU)
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
+        uint32_t *full;         /* summary: which words of v are full */
+        unsigned nsum;          /* number of summary words */
+        unsigned hint;          /* summary word to search first */
 };
 
+/*
+ * Index of the lowest set bit of X, which must not be 0. MIPS32 has
+ * count-leading-zeros; MIPS-I, which the kernel is normally built
+ * for, doesn't, and gcc would turn __builtin_clz into a libgcc call
+ * we don't link with, so fall back to a binary search there.
+ */
+static
+inline
+unsigned
+bitmap_ffs(uint32_t x)
+{
+#if defined(__mips_isa_rev)
+        return 31 - __builtin_clz(x & -x);
+#else
+        unsigned n = 0;
+
+        if ((x & 0xffff) == 0) {
+                n += 16;
+                x >>= 16;
+        }
+        if ((x & 0xff) == 0) {
+                n += 8;
+                x >>= 8;
+        }
+        if ((x & 0xf) == 0) {
+                n += 4;
+                x >>= 4;
+        }
+        if ((x & 0x3) == 0) {
+                n += 2;
+                x >>= 2;
+        }
+        if ((x & 0x1) == 0) {
+                n += 1;
+        }
+        return n;
+#endif
+}
+
+/*
+ * Index of the lowest clear bit of a word that isn't full.
+ */
+static
+inline
+unsigned
+bitmap_ffz(WORD_TYPE w)
+{
+        KASSERT(w != WORD_ALLBITS);
+        return bitmap_ffs((uint32_t)(WORD_TYPE)~w);
+}
+
+/*
+ * Update the summary bit for word IX after changing it.
+ */
+static
+inline
+void
+bitmap_summarize(struct bitmap *b, unsigned ix)
+{
+        uint32_t mask = (uint32_t)1 << (ix % SUM_BITS);
+
+        if (b->v[ix] == WORD_ALLBITS) {
+                b->full[ix / SUM_BITS] |= mask;
+        }
+        else {
+                b->full[ix / SUM_BITS] &= ~mask;
+        }
+}
 
 struct bitmap *
 bitmap_create(unsigned nbits)
@@ -69,9 +151,17 @@ bitmap_create(unsigned nbits)
                 kfree(b);
                 return NULL;
         }
+        b->nsum = DIVROUNDUP(words, SUM_BITS);
+        b->full = kmalloc(b->nsum*sizeof(uint32_t));
+        if (b->full == NULL) {
+                kfree(b->v);
+                kfree(b);
+                return NULL;
+        }
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
+        b->hint = 0;
 
         /* Mark any leftover bits at the end in use */
         if (words > nbits / BITS_PER_WORD) {
@@ -86,6 +176,7 @@ bitmap_create(unsigned nbits)
                 }
         }
 
+        bitmap_rescan(b);
         return b;
 }
 
@@ -95,31 +186,84 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+void
+bitmap_rescan(struct bitmap *b)
+{
+        unsigned ix;
+        unsigned words = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+
+        bzero(b->full, b->nsum*sizeof(uint32_t));
+        for (ix=0; ix<words; ix++) {
+                bitmap_summarize(b, ix);
+        }
+
+        /* Summary bits past the last word count as full */
+        if (words % SUM_BITS != 0) {
+                b->full[b->nsum-1] |= SUM_ALLBITS << (words % SUM_BITS);
+        }
+        b->hint = 0;
+}
+
 int
 bitmap_alloc(struct bitmap *b, unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned n, s, ix, offset;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        for (n=0; n<b->nsum; n++) {
+                s = (b->hint + n) % b->nsum;
+                if (b->full[s] != SUM_ALLBITS) {
+                        ix = s*SUM_BITS + bitmap_ffs(~b->full[s]);
+                        offset = bitmap_ffz(b->v[ix]);
+                        b->v[ix] |= ((WORD_TYPE)1) << offset;
+                        bitmap_summarize(b, ix);
+                        b->hint = s;
+                        *index = (ix*BITS_PER_WORD)+offset;
+                        KASSERT(*index < b->nbits);
+                        return 0;
                 }
         }
         return ENOSPC;
 }
 
+int
+bitmap_findzero(struct bitmap *b, unsigned start, unsigned *index)
+{
+        unsigned ix, s;
+        WORD_TYPE w;
+        uint32_t sum;
+
+        if (start >= b->nbits) {
+                return ENOSPC;
+        }
+
+        /* The rest of the word START is in */
+        ix = start / BITS_PER_WORD;
+        w = b->v[ix] | (WORD_TYPE)(((WORD_TYPE)1 << (start % BITS_PER_WORD)) - 1);
+        if (w != WORD_ALLBITS) {
+                *index = ix*BITS_PER_WORD + bitmap_ffz(w);
+                KASSERT(*index < b->nbits);
+                return 0;
+        }
+
+        /* Then whole words, through the summary */
+        ix++;
+        s = ix / SUM_BITS;
+        if (s >= b->nsum) {
+                return ENOSPC;
+        }
+        sum = b->full[s] | ((((uint32_t)1) << (ix % SUM_BITS)) - 1);
+        while (sum == SUM_ALLBITS) {
+                if (++s >= b->nsum) {
+                        return ENOSPC;
+                }
+                sum = b->full[s];
+        }
+        ix = s*SUM_BITS + bitmap_ffs(~sum);
+        *index = ix*BITS_PER_WORD + bitmap_ffz(b->v[ix]);
+        KASSERT(*index < b->nbits);
+        return 0;
+}
+
 static
 inline
 void
@@ -142,6 +286,7 @@ bitmap_mark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)==0);
         b->v[ix] |= mask;
+        bitmap_summarize(b, ix);
 }
 
 void
@@ -155,6 +300,7 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        bitmap_summarize(b, ix);
 }
 
 
@@ -171,6 +317,7 @@ bitmap_isset(struct bitmap *b, unsigned index)
 void
 bitmap_destroy(struct bitmap *b)
 {
+        kfree(b->full);
         kfree(b->v);
         kfree(b);
 }
@@ -39,6 +39,8 @@
 #include <proc.h>
 #include <vfs.h>
 #include <buf.h>
+#include <namecache.h>
+#include <synch.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -441,6 +443,38 @@ cmd_bufstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_ncstats(int nargs, char **args)
+{
+	(void)args;
+
+	if (nargs == 1) {
+		namecache_printstats();
+	}
+	else {
+		kprintf("Usage: ncstats\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	(void)args;
+
+	if (nargs == 1) {
+		lock_printstats();
+	}
+	else {
+		kprintf("Usage: lockstats\n");
+	}
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -522,6 +556,7 @@ static const char *testmenu[] = {
 
     "[lk] Lock unit test        (1)      ",
     "[cv] CV unit test          (1)      ",
+    "[rw] RW lock unit test     (1)      ",
     "[lrw] Log read write       (4)      ",
 	NULL
 };
@@ -552,6 +587,8 @@ static const char *mainmenu[] = {
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
 	"[bufstats} Print buffer cache stats ",
+	"[ncstats] Print name cache stats    ",
+	"[lockstats] Print lock contention   ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -608,6 +645,8 @@ static struct {
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
 	{ "bufstats",   cmd_bufstats },
+	{ "ncstats",    cmd_ncstats },
+	{ "lockstats",  cmd_lockstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -632,6 +671,7 @@ static struct {
     /* synchronization unit tests */
     { "lk",     lock_unittest },
     { "cv",     cv_unittest },
+    { "rw",     rwlock_unittest },
     { "lrw",    test_read_write },
     /* TODO file descriptor unit tests */
 
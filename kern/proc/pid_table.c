@@ -28,18 +28,44 @@
  */
 
 #include <types.h>
+#include <lib.h>
+#include <limits.h>
+#include <rcu.h>
+#include <membar.h>
 #include <current.h>
 #include <bitmap.h>
 #include <synch.h>
 #include <pid_table.h>
 #include <kern/errno.h>
 
-#define PID_MAX 512
+/*
+ * The pid -> proc map covers the whole pid space (0 to PID_MAX) as a
+ * two-level table: a fixed directory of chunk pointers, with each
+ * chunk of PID_CHUNK slots allocated by pid_get the first time a pid
+ * in it is handed out, so procmap_add never has to allocate. Chunks
+ * live until the table is destroyed.
+ *
+ * Lookups (get_proc, pid_in_use) take no lock. They run with
+ * interrupts off, which makes them RCU read sections (see rcu.h):
+ * slots and chunk pointers are published with a barrier after the
+ * thing they point to is initialized, and a proc that is unpublished
+ * by procmap_remove is only freed after a grace period, so a lookup
+ * racing with exit never sees freed memory. A caller that wants to
+ * look inside the proc get_proc returns, and can't otherwise be sure
+ * it won't exit, has to do that in its own read section around the
+ * call. Updates serialize on pid_table->lock.
+ */
+#define PID_CHUNK 256
+#define PID_NCHUNKS ((PID_MAX + PID_CHUNK) / PID_CHUNK)
+
+struct pid_chunk {
+    struct proc *volatile procs[PID_CHUNK];
+};
 
 static struct {
     struct bitmap *pid_map;
     struct lock *lock;
-    struct proc *proc_map[PID_MAX];
+    struct pid_chunk *volatile dir[PID_NCHUNKS];
 } *pid_table;
 
 /* called in bootstrap */
@@ -47,8 +73,9 @@ int init_pid_table(void) {
 
     pid_table = kmalloc (sizeof *pid_table);
     if (pid_table == NULL) goto out;
+    bzero(pid_table, sizeof *pid_table);
 
-    pid_table->pid_map = bitmap_create(PID_MAX);
+    pid_table->pid_map = bitmap_create(PID_MAX + 1);
     if (pid_table->pid_map == NULL) goto bm_out;
 
     pid_table->lock = lock_create("pid_table_lock");
@@ -69,17 +96,49 @@ out:
 
 void
 procmap_add(unsigned pid, struct proc *proc) {
+    struct pid_chunk *chunk;
+
+    KASSERT(pid <= PID_MAX);
+
     lock_acquire(pid_table->lock);
-    pid_table->proc_map[pid] = proc;
+    KASSERT(bitmap_isset(pid_table->pid_map, pid));
+    /* pid_get set up the chunk before handing out the pid */
+    chunk = pid_table->dir[pid / PID_CHUNK];
+    KASSERT(chunk != NULL);
+    /* the (already set up) proc must be visible before the pointer */
+    membar_store_store();
+    chunk->procs[pid % PID_CHUNK] = proc;
+    lock_release(pid_table->lock);
+}
+
+void
+procmap_remove(unsigned pid, struct proc *proc) {
+    struct pid_chunk *chunk;
+
+    if (pid > PID_MAX) return;
+
+    lock_acquire(pid_table->lock);
+    chunk = pid_table->dir[pid / PID_CHUNK];
+    if (chunk != NULL && chunk->procs[pid % PID_CHUNK] == proc) {
+        chunk->procs[pid % PID_CHUNK] = NULL;
+    }
     lock_release(pid_table->lock);
 }
 
 struct proc *
 get_proc(unsigned pid) {
+    struct pid_chunk *chunk;
     struct proc *proc = NULL;
-    lock_acquire(pid_table->lock);
-    proc = pid_table->proc_map[pid];
-    lock_release(pid_table->lock);
+    int spl;
+
+    if (pid > PID_MAX) return NULL;
+
+    spl = rcu_read_lock();
+    chunk = pid_table->dir[pid / PID_CHUNK];
+    if (chunk != NULL) {
+        proc = chunk->procs[pid % PID_CHUNK];
+    }
+    rcu_read_unlock(spl);
     return proc;
 }
 
@@ -93,6 +152,13 @@ void destroy_pid_table(void) {
     bitmap_destroy(pid_table->pid_map);
     pid_table->pid_map = NULL;
 
+    for (unsigned i = 0; i < PID_NCHUNKS; i++) {
+        if (pid_table->dir[i] != NULL) {
+            kfree(pid_table->dir[i]);
+            pid_table->dir[i] = NULL;
+        }
+    }
+
     lock_release(pid_table->lock);
 
     //TODO: failing to destroy, thread.c:1028 line, KASSERT
@@ -100,36 +166,58 @@ void destroy_pid_table(void) {
     kfree(pid_table);
 }
 
-pid_t pid_get(void) {
+/*
+ * Allocate a pid into *RET, making sure the chunk its procmap slot
+ * lives in exists first. Returns ENPROC if there are no pids left and
+ * ENOMEM if the chunk can't be allocated.
+ */
+int pid_get(pid_t *ret) {
+    struct pid_chunk *chunk;
+    unsigned pid;
+
     lock_acquire(pid_table->lock);
 
-    unsigned pid;
-    if (bitmap_alloc(pid_table->pid_map, &pid) != ENOSPC){
-    	lock_release(pid_table->lock);
-    	return pid;
+    if (bitmap_alloc(pid_table->pid_map, &pid) == ENOSPC) {
+        lock_release(pid_table->lock);
+        return ENPROC;
+    }
+
+    if (pid_table->dir[pid / PID_CHUNK] == NULL) {
+        chunk = kmalloc(sizeof *chunk);
+        if (chunk == NULL) {
+            bitmap_unmark(pid_table->pid_map, pid);
+            lock_release(pid_table->lock);
+            return ENOMEM;
+        }
+        bzero(chunk, sizeof *chunk);
+        /* the empty chunk must be visible before the pointer to it */
+        membar_store_store();
+        pid_table->dir[pid / PID_CHUNK] = chunk;
     }
 
     lock_release(pid_table->lock);
 
-    return (pid_t) -1;
+    *ret = pid;
+    return 0;
 }
 
 void pid_destroy(pid_t pid) {
+    struct pid_chunk *chunk;
+
     lock_acquire(pid_table->lock);
     // TODO: check that this thread holds the pid
     KASSERT(bitmap_isset(pid_table->pid_map, (unsigned)pid));
     bitmap_unmark(pid_table->pid_map, (unsigned)pid);
-    pid_table->proc_map[pid] = NULL;
+    chunk = pid_table->dir[pid / PID_CHUNK];
+    if (chunk != NULL) {
+        chunk->procs[pid % PID_CHUNK] = NULL;
+    }
     lock_release(pid_table->lock);
 }
 
 bool pid_in_use(pid_t pid) {
-    lock_acquire(pid_table->lock);
-    if (bitmap_isset(pid_table->pid_map, (unsigned)pid)) {
-        lock_release(pid_table->lock);
-        return true;
-    }
-    lock_release(pid_table->lock);
-    return false;
-}
+    if (pid < 0 || pid > PID_MAX) return false;
 
+    /* reading one bitmap word is atomic; the bitmap itself never moves */
+    return bitmap_isset(pid_table->pid_map, (unsigned)pid);
+}
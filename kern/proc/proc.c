@@ -57,6 +57,7 @@
 #include <uio.h>
 #include <fd.h>
 #include <kern/fcntl.h>
+#include <objcache.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -64,6 +65,34 @@
 struct proc *kproc;
 static void console_init(struct proc *proc);
 
+/*
+ * Proc structures come from an object cache; the lock and thread
+ * array are set up once and kept across uses.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
+static struct objcache proc_cache =
+	OBJCACHE_INITIALIZER("proc", sizeof(struct proc), proc_ctor, proc_dtor);
+
 /*
  * Create a proc structure.
  */
@@ -72,21 +101,22 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof *proc);
+	proc = objcache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
-	// memory is set to deadbeef after free, but we need to reset to NULL
-    memset(proc, 0, sizeof *proc);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		objcache_free(&proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
+	/* descriptors and family links start out empty */
+	memset(proc->fd_table, 0, sizeof(proc->fd_table));
+	memset(proc->children, 0, sizeof(proc->children));
+	proc->parent = NULL;
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -95,8 +125,8 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 
 	if(curthread){
-		proc->pid = pid_get();
-        if (proc->pid == -1) {      /* ran out of pids */
+        proc->pid = -1;
+        if (pid_get(&proc->pid)) {  /* out of pids or memory */
             proc_destroy(proc);
             return NULL;
         }
@@ -107,6 +137,20 @@ proc_create(const char *name)
 	return proc;
 }
 
+/*
+ * Free a proc structure once no lockless lookup can still see it.
+ * Called from rcu_reclaim.
+ */
+static
+void
+proc_free(void *p)
+{
+	struct proc *proc = p;
+
+	kfree(proc->p_name);
+	objcache_free(&proc_cache, proc);
+}
+
 /*
  * Destroy a proc structure.
  *
@@ -190,11 +234,15 @@ proc_destroy(struct proc *proc)
 	// TODO this design choice allows for memory waste, consider a proc
 	// that forks 1M children and one exits, its shared struct won't be cleared
     cleanup_data(proc);
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
-	kfree(proc->p_name);
-	kfree(proc);
+	/*
+	 * get_proc doesn't lock, so someone may have just looked us up.
+	 * Take us out of the pid table and wait out a grace period
+	 * before freeing the structure itself.
+	 */
+	procmap_remove(proc->pid, proc);
+	rcu_call(&proc->p_rcu, proc_free, proc);
 }
 
 
@@ -309,36 +357,12 @@ static void console_init(struct proc *proc) {
     kfree(con_write);
     kfree(con_error);
 
-    struct file_desc *stdin = kmalloc(sizeof *stdin);
-    struct file_desc *stdout = kmalloc(sizeof *stdout);
-    struct file_desc *stderr = kmalloc(sizeof *stderr);
+    struct file_desc *stdin = fd_init(in, 0, O_RDONLY);
+    struct file_desc *stdout = fd_init(out, 0, O_WRONLY);
+    struct file_desc *stderr = fd_init(err, 0, O_WRONLY);
     if (stdin == NULL || stdout == NULL || stderr == NULL)
         panic("proc init: out of memory\n");
 
-    stdin->flags = O_RDONLY;
-    stdin->ref_count = 1;
-    stdin->offset = 0;
-    stdin->vn = in;
-    stdin->mode = 0;
-    stdin->lock = lock_create("stdin");
-
-    stdout->flags = O_WRONLY;
-    stdout->ref_count = 1;
-    stdout->offset = 0;
-    stdout->vn = out;
-    stdout->mode = 0;
-    stdout->lock = lock_create("stdout");
-
-    stderr->flags = O_WRONLY;
-    stderr->ref_count = 1;
-    stderr->offset = 0;
-    stderr->vn = err;
-    stderr->mode = 0;
-    stderr->lock = lock_create("stderr");
-
-    if (stdin->lock == NULL || stdout->lock == NULL || stderr->lock == NULL)
-        panic("proc init: stdin, stdout, or stderr lock couldn't be allocated\n");
-
     proc->fd_table[STDIN_FILENO] = stdin;
     proc->fd_table[STDOUT_FILENO] = stdout;
     proc->fd_table[STDERR_FILENO] = stderr;
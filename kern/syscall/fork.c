@@ -89,8 +89,9 @@ child_fork(void *data1, unsigned long data2) {
 }
 
 pid_t sys_fork(struct trapframe *tf, pid_t *child_pid) {
-    pid_t new_pid = pid_get();
-    if (new_pid == -1) return ENPROC;
+    pid_t new_pid;
+    int result = pid_get(&new_pid);
+    if (result) return result;
 
     struct proc *child = create_child(new_pid);
     if (child == NULL) goto child_out;
@@ -157,10 +157,8 @@ int sys_close(int fd) {
     if (--curproc->fd_table[fd]->ref_count != 0)    
         lock_release(curproc->fd_table[fd]->lock);  
     else {                                          
-        vfs_close(curproc->fd_table[fd]->vn);
         lock_release(curproc->fd_table[fd]->lock);
-        lock_destroy(curproc->fd_table[fd]->lock);
-        kfree(curproc->fd_table[fd]);
+        fd_destroy(curproc->fd_table[fd]);
     }
 
     curproc->fd_table[fd] = NULL;
@@ -89,6 +89,21 @@ bitmaptest(int nargs, char **args)
 		}
 	}
 
+	for (i=0; i<TESTSIZE; i++) {
+		int j;
+
+		for (j=i; j<TESTSIZE && data[j]==0; j++) {
+			/* nothing */
+		}
+		if (j < TESTSIZE) {
+			KASSERT(bitmap_findzero(b, i, &x)==0);
+			KASSERT(x == (uint32_t)j);
+		}
+		else {
+			KASSERT(bitmap_findzero(b, i, &x)!=0);
+		}
+	}
+
 	while (bitmap_alloc(b, &x)==0) {
 		KASSERT(x < TESTSIZE);
 		KASSERT(bitmap_isset(b, x));
@@ -557,3 +557,141 @@ int cv_unittest(int nargs, char **args){
     sem_destroy(testsem);
     return 0;
 }
+
+static struct spinlock rwtest_spinlk = SPINLOCK_INITIALIZER;
+static volatile unsigned rwtest_readers;
+static volatile bool rwtest_writer;
+
+static
+void
+test_rwlock_create(){
+    for (int i = 0; i < 10; i++) {
+        struct rwlock *rw = rwlock_create("testrwlock");
+
+        KASSERT(!strcmp(rw->rw_name, "testrwlock"));
+        KASSERT(rw->rw_writer == NULL);
+        KASSERT(rw->rw_readers == 0);
+        rwlock_acquire_read(rw);
+        rwlock_release_read(rw);
+        rwlock_acquire_write(rw);
+        KASSERT(rwlock_do_i_write(rw));
+        rwlock_release_write(rw);
+        rwlock_destroy(rw);
+    }
+
+    kprintf("test_rwlock_create: Passed\n");
+}
+
+static
+void
+shared_read_helper(void *p, unsigned long i){
+    (void)i;
+    struct rwlock *rw = p;
+    rwlock_acquire_read(rw);
+    V(testsem2);
+    rwlock_release_read(rw);
+}
+
+static
+void
+test_shared_read(){
+    testsem2 = sem_create("testsem2", 0);
+    struct rwlock *rw = rwlock_create("testrwlock");
+
+    // The helper can only get past acquire if readers share the lock
+    rwlock_acquire_read(rw);
+    int err = thread_fork("shared_read_helper", NULL, shared_read_helper, (void *)rw, 0);
+    if (err)
+        panic("test_shared_read: thread_fork failed: %s\n", strerror(err));
+    P(testsem2);
+    rwlock_release_read(rw);
+
+    // Make sure the helper is out before tearing down
+    rwlock_acquire_write(rw);
+    rwlock_release_write(rw);
+    rwlock_destroy(rw);
+    sem_destroy(testsem2);
+
+    kprintf("test_shared_read: Passed\n");
+}
+
+static
+void
+reader_writer_helper(void *p, unsigned long i){
+    struct rwlock *rw = p;
+    volatile int j;
+
+    for (int k = 0; k < NLOCKLOOPS; k++) {
+        if (i % 4 == 0) {
+            rwlock_acquire_write(rw);
+            spinlock_acquire(&rwtest_spinlk);
+            KASSERT(rwtest_readers == 0);
+            KASSERT(!rwtest_writer);
+            rwtest_writer = true;
+            spinlock_release(&rwtest_spinlk);
+
+            for (j = 0; j < 100; j++);
+
+            spinlock_acquire(&rwtest_spinlk);
+            rwtest_writer = false;
+            spinlock_release(&rwtest_spinlk);
+            rwlock_release_write(rw);
+        }
+        else {
+            rwlock_acquire_read(rw);
+            spinlock_acquire(&rwtest_spinlk);
+            KASSERT(!rwtest_writer);
+            rwtest_readers++;
+            spinlock_release(&rwtest_spinlk);
+
+            for (j = 0; j < 100; j++);
+
+            spinlock_acquire(&rwtest_spinlk);
+            rwtest_readers--;
+            spinlock_release(&rwtest_spinlk);
+            rwlock_release_read(rw);
+        }
+    }
+    V(testsem2);
+}
+
+static
+void
+test_readers_writers(int td_num){
+    int i;
+
+    testsem2 = sem_create("testsem2", 0);
+    struct rwlock *rw = rwlock_create("testrwlock");
+
+    // Every fourth thread is a writer; the rest are readers
+    for (i = 0; i < td_num; i++) {
+        int err = thread_fork("helper", NULL, reader_writer_helper, (void *)rw, i);
+        if (err)
+            panic("test_readers_writers: thread_fork failed: %s\n", strerror(err));
+    }
+
+    for (i = 0; i < td_num; i++) P(testsem2);
+    sem_destroy(testsem2);
+    rwlock_destroy(rw);
+
+    kprintf("test_readers_writers: Passed\n");
+}
+
+int
+rwlock_unittest(int nargs, char **args){
+    (void)nargs;
+    (void)args;
+
+    kprintf("Starting RW Locks Unit Tests....\n");
+
+    /* Tests that the lock is properly created and fields are initialized */
+    test_rwlock_create();
+
+    /* Tests that two readers can hold the lock at the same time */
+    test_shared_read();
+
+    /* Tests that writers exclude readers and each other */
+    test_readers_writers(NUM_THREADS);
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <rcu.h>
+
+/*
+ * Grace period tracking.
+ *
+ * Callbacks queued with rcu_call go on rcu_next. When no grace period
+ * is running, the whole of rcu_next becomes rcu_current and a new
+ * grace period (number rcu_gp_seq) starts; it ends when each of the
+ * rcu_ncpus online cpus has noted a quiescent state by setting its
+ * c_rcu_seq to rcu_gp_seq. Then rcu_current moves to rcu_done, to be
+ * freed by the next rcu_reclaim.
+ */
+static struct spinlock rcu_lock = SPINLOCK_INITIALIZER;
+static unsigned rcu_ncpus;
+static volatile unsigned rcu_gp_seq;
+static unsigned rcu_gp_left;
+static volatile bool rcu_gp_active;
+static struct rcu_head *volatile rcu_next;
+static struct rcu_head *rcu_current;
+static struct rcu_head *volatile rcu_done;
+
+/* Append list ADD to the list starting at *LIST. */
+static
+void
+rcu_append(struct rcu_head *volatile *list, struct rcu_head *add)
+{
+	while (*list != NULL) {
+		list = &(*list)->rh_next;
+	}
+	*list = add;
+}
+
+/* Note that curcpu has passed a quiescent state. rcu_lock must be held. */
+static
+void
+rcu_note_qs(void)
+{
+	KASSERT(spinlock_do_i_hold(&rcu_lock));
+
+	if (rcu_gp_active && curcpu->c_rcu_seq != rcu_gp_seq) {
+		curcpu->c_rcu_seq = rcu_gp_seq;
+		KASSERT(rcu_gp_left > 0);
+		rcu_gp_left--;
+		if (rcu_gp_left == 0) {
+			rcu_append(&rcu_done, rcu_current);
+			rcu_current = NULL;
+			rcu_gp_active = false;
+		}
+	}
+}
+
+/*
+ * Read sections. They nest.
+ */
+int
+rcu_read_lock(void)
+{
+	return splhigh();
+}
+
+void
+rcu_read_unlock(int spl)
+{
+	splx(spl);
+}
+
+void
+rcu_call(struct rcu_head *rh, void (*func)(void *), void *arg)
+{
+	rh->rh_func = func;
+	rh->rh_arg = arg;
+
+	/* Callbacks run in no particular order, so just push it. */
+	spinlock_acquire(&rcu_lock);
+	rh->rh_next = rcu_next;
+	rcu_next = rh;
+	spinlock_release(&rcu_lock);
+}
+
+void
+rcu_cpu_online(void)
+{
+	spinlock_acquire(&rcu_lock);
+	/*
+	 * A cpu that wasn't running when the current grace period
+	 * started can't be in a read section that predates it, so it
+	 * doesn't get counted in this one.
+	 */
+	curcpu->c_rcu_seq = rcu_gp_seq;
+	rcu_ncpus++;
+	spinlock_release(&rcu_lock);
+}
+
+void
+rcu_quiescent(void)
+{
+	/*
+	 * Unlocked check first, since this is called on every context
+	 * switch. A stale read at worst delays the grace period by one
+	 * switch on this cpu.
+	 */
+	if (!rcu_gp_active && rcu_next == NULL) {
+		return;
+	}
+	if (rcu_gp_active && curcpu->c_rcu_seq == rcu_gp_seq) {
+		return;
+	}
+
+	spinlock_acquire(&rcu_lock);
+	rcu_note_qs();
+	if (!rcu_gp_active && rcu_next != NULL) {
+		/* Start the next grace period; we're quiescent already. */
+		rcu_current = rcu_next;
+		rcu_next = NULL;
+		rcu_gp_seq++;
+		rcu_gp_left = rcu_ncpus;
+		rcu_gp_active = true;
+		rcu_note_qs();
+	}
+	spinlock_release(&rcu_lock);
+}
+
+void
+rcu_reclaim(void)
+{
+	struct rcu_head *rh, *next;
+
+	if (rcu_done == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&rcu_lock);
+	rh = rcu_done;
+	rcu_done = NULL;
+	spinlock_release(&rcu_lock);
+
+	for (; rh != NULL; rh = next) {
+		next = rh->rh_next;
+		rh->rh_func(rh->rh_arg);
+	}
+}
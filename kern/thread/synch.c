@@ -33,12 +33,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
+#include <objcache.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -134,30 +137,71 @@ V(struct semaphore *sem) {
 //
 // Lock.
 
+/*
+ * List of all locks, for lock_printstats. This is statically
+ * initialized so that locks can be created before thread_bootstrap.
+ */
+static struct spinlock alllocks_lock = SPINLOCK_INITIALIZER;
+static struct lock *alllocks;
+
+/*
+ * Locks come from an object cache. The wait channel and spinlock are
+ * set up once by the constructor and survive lock_destroy, so
+ * creating a lock is just a name copy and a few stores. The wait
+ * channel's name points at lk_name, which is rewritten in place.
+ */
+static
+int
+lock_ctor(void *obj)
+{
+    struct lock *lock = obj;
+
+    lock->lk_name[0] = '\0';
+    lock->lk_wchan = wchan_create(lock->lk_name);
+    if (lock->lk_wchan == NULL) {
+        return ENOMEM;
+    }
+    spinlock_init(&lock->lk_spinlk);
+    lock->lk_holder = NULL;
+    return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+    struct lock *lock = obj;
+
+    spinlock_cleanup(&lock->lk_spinlk);
+    wchan_destroy(lock->lk_wchan);
+}
+
+static struct objcache lock_cache =
+    OBJCACHE_INITIALIZER("lock", sizeof(struct lock), lock_ctor, lock_dtor);
+
 struct lock *
 lock_create(const char *name) {
     struct lock *lock;
 
-    lock = kmalloc(sizeof(struct lock));
-    if (lock == NULL) goto cleanup_kmalloc;
-
-    lock->lk_name = kstrdup(name);
-    if (lock->lk_name == NULL) goto cleanup_kstrdup;
+    lock = objcache_alloc(&lock_cache);
+    if (lock == NULL) {
+        return NULL;
+    }
 
-    lock->lk_wchan = wchan_create(lock->lk_name);
-    if (lock->lk_wchan == NULL) goto cleanup_wchan_create;
+    snprintf(lock->lk_name, sizeof(lock->lk_name), "%s", name);
+    KASSERT(lock->lk_holder == NULL);
+    lock->lk_acquires = 0;
+    lock->lk_contended = 0;
+    lock->lk_sleeps = 0;
 
-    spinlock_init(&lock->lk_spinlk);
-    lock->lk_holder = NULL;
+    spinlock_acquire(&alllocks_lock);
+    lock->lk_prev = NULL;
+    lock->lk_next = alllocks;
+    if (alllocks != NULL) alllocks->lk_prev = lock;
+    alllocks = lock;
+    spinlock_release(&alllocks_lock);
 
     return lock;
-
-cleanup_wchan_create:
-    kfree(lock->lk_name);
-cleanup_kstrdup:
-    kfree(lock);
-cleanup_kmalloc:
-    return NULL;
 }
 
 void
@@ -166,24 +210,67 @@ lock_destroy(struct lock *lock) {
     /* the lock should not have an owner to be destoyed */
     KASSERT(lock->lk_holder == NULL);
 
-    spinlock_cleanup(&lock->lk_spinlk);
-    wchan_destroy(lock->lk_wchan);
-    kfree(lock->lk_name);
-    kfree(lock);
+    spinlock_acquire(&alllocks_lock);
+    if (lock->lk_prev != NULL) lock->lk_prev->lk_next = lock->lk_next;
+    else alllocks = lock->lk_next;
+    if (lock->lk_next != NULL) lock->lk_next->lk_prev = lock->lk_prev;
+    spinlock_release(&alllocks_lock);
+
+    objcache_free(&lock_cache, lock);
+}
+
+/*
+ * True if the holder of LOCK is on a processor right now (and it isn't
+ * ours). Must be called with lk_spinlk held, which keeps the holder
+ * from releasing the lock, and therefore from exiting, while we look
+ * at its thread structure.
+ */
+static
+bool
+lock_holder_running(struct lock *lock) {
+    struct thread *holder = lock->lk_holder;
+
+    KASSERT(spinlock_do_i_hold(&lock->lk_spinlk));
+    return (holder != NULL &&
+            holder->t_state == S_RUN &&
+            holder->t_cpu != curcpu->c_self);
 }
 
 void
 lock_acquire(struct lock *lock) {
+    unsigned spins = 0;
+    bool contended = false;
+
     KASSERT(lock != NULL);
 
     spinlock_acquire(&lock->lk_spinlk);
     //KASSERT(curthread->t_curspl != 0);
     // TODO curthread is broken is at 0x0 during get_pid
     KASSERT(lock->lk_holder != curthread);  /* the thread doesn't hold the lock */
-    while (lock->lk_holder != NULL) 
+    while (lock->lk_holder != NULL) {
+        contended = true;
+        if (spins < LOCK_SPIN_MAX && lock_holder_running(lock)) {
+            /*
+             * The holder is busy on another cpu and will probably
+             * let go shortly; that's cheaper to wait out than a
+             * context switch. Poll the holder word without the
+             * spinlock, and come back every so often to make sure
+             * the holder hasn't gone to sleep in the meantime.
+             */
+            spinlock_release(&lock->lk_spinlk);
+            do {
+                spins++;
+            } while (lock->lk_holder != NULL && spins % 64 != 0);
+            spinlock_acquire(&lock->lk_spinlk);
+            continue;
+        }
+        lock->lk_sleeps++;
         wchan_sleep(lock->lk_wchan, &lock->lk_spinlk);
+    }
     KASSERT(lock->lk_holder == NULL);
     lock->lk_holder = curthread;
+    lock->lk_acquires++;
+    if (contended) lock->lk_contended++;
     spinlock_release(&lock->lk_spinlk);
 }
 
@@ -199,6 +286,21 @@ lock_release(struct lock *lock) {
     spinlock_release(&lock->lk_spinlk);
 }
 
+void
+lock_printstats(void) {
+    struct lock *lock;
+
+    kprintf("%-24s %10s %10s %10s\n",
+            "lock", "acquires", "contended", "sleeps");
+    spinlock_acquire(&alllocks_lock);
+    for (lock = alllocks; lock != NULL; lock = lock->lk_next) {
+        if (lock->lk_contended == 0) continue;
+        kprintf("%-24s %10u %10u %10u\n", lock->lk_name,
+                lock->lk_acquires, lock->lk_contended, lock->lk_sleeps);
+    }
+    spinlock_release(&alllocks_lock);
+}
+
 bool
 lock_do_i_hold(struct lock *lock) {
     return (lock->lk_holder == curthread);
@@ -209,29 +311,45 @@ lock_do_i_hold(struct lock *lock) {
 // CV
 
 
+/* CVs are cached the same way as locks. */
+static
+int
+cv_ctor(void *obj)
+{
+    struct cv *cv = obj;
+
+    cv->cv_name[0] = '\0';
+    cv->cv_wchan = wchan_create(cv->cv_name);
+    if (cv->cv_wchan == NULL) {
+        return ENOMEM;
+    }
+    spinlock_init(&cv->cv_spinlk);
+    return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+    struct cv *cv = obj;
+
+    wchan_destroy(cv->cv_wchan);
+    spinlock_cleanup(&cv->cv_spinlk);
+}
+
+static struct objcache cv_cache =
+    OBJCACHE_INITIALIZER("cv", sizeof(struct cv), cv_ctor, cv_dtor);
+
 struct cv *
 cv_create(const char *name) {
     struct cv *cv;
 
-    cv = kmalloc(sizeof(struct cv));
+    cv = objcache_alloc(&cv_cache);
     if (cv == NULL) {
         return NULL;
     }
 
-    cv->cv_name = kstrdup(name);
-    if (cv->cv_name==NULL) {
-        kfree(cv);
-        return NULL;
-    }
-
-    cv->cv_wchan = wchan_create(cv->cv_name);
-    if (cv->cv_name == NULL) {
-        kfree(cv->cv_name);
-        kfree(cv);
-        return NULL;
-    }
-
-    spinlock_init(&cv->cv_spinlk);
+    snprintf(cv->cv_name, sizeof(cv->cv_name), "%s", name);
     return cv;
 }
 
@@ -239,10 +357,7 @@ void
 cv_destroy(struct cv *cv) {
     KASSERT(cv != NULL);
 
-    wchan_destroy(cv->cv_wchan);
-    spinlock_cleanup(&cv->cv_spinlk);
-    kfree(cv->cv_name);
-    kfree(cv);
+    objcache_free(&cv_cache, cv);
 }
 
 void
@@ -279,3 +394,146 @@ cv_broadcast(struct cv *cv, struct lock *lock) {
     wchan_wakeall(cv->cv_wchan, &cv->cv_spinlk);
     spinlock_release(&cv->cv_spinlk);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name) {
+    struct rwlock *rw;
+
+    rw = kmalloc(sizeof(struct rwlock));
+    if (rw == NULL) goto cleanup_kmalloc;
+
+    rw->rw_name = kstrdup(name);
+    if (rw->rw_name == NULL) goto cleanup_kstrdup;
+
+    rw->rw_rwchan = wchan_create(rw->rw_name);
+    if (rw->rw_rwchan == NULL) goto cleanup_rwchan;
+
+    rw->rw_wwchan = wchan_create(rw->rw_name);
+    if (rw->rw_wwchan == NULL) goto cleanup_wwchan;
+
+    spinlock_init(&rw->rw_spinlk);
+    rw->rw_readers = 0;
+    rw->rw_rwaiting = 0;
+    rw->rw_wwaiting = 0;
+    rw->rw_rgeneration = 0;
+    rw->rw_writer = NULL;
+
+    return rw;
+
+cleanup_wwchan:
+    wchan_destroy(rw->rw_rwchan);
+cleanup_rwchan:
+    kfree(rw->rw_name);
+cleanup_kstrdup:
+    kfree(rw);
+cleanup_kmalloc:
+    return NULL;
+}
+
+void
+rwlock_destroy(struct rwlock *rw) {
+    KASSERT(rw != NULL);
+    KASSERT(rw->rw_writer == NULL);
+    KASSERT(rw->rw_readers == 0);
+    KASSERT(rw->rw_rwaiting == 0 && rw->rw_wwaiting == 0);
+
+    spinlock_cleanup(&rw->rw_spinlk);
+    wchan_destroy(rw->rw_wwchan);
+    wchan_destroy(rw->rw_rwchan);
+    kfree(rw->rw_name);
+    kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw) {
+    unsigned generation;
+
+    KASSERT(rw != NULL);
+    KASSERT(curthread->t_in_interrupt == false);
+
+    spinlock_acquire(&rw->rw_spinlk);
+    KASSERT(rw->rw_writer != curthread);
+    if (rw->rw_writer == NULL && rw->rw_wwaiting == 0) {
+        rw->rw_readers++;
+        spinlock_release(&rw->rw_spinlk);
+        return;
+    }
+
+    /*
+     * Wait to be admitted by rwlock_release_write, which counts us
+     * into rw_readers on our behalf before bumping the generation.
+     */
+    rw->rw_rwaiting++;
+    generation = rw->rw_rgeneration;
+    while (generation == rw->rw_rgeneration) {
+        wchan_sleep(rw->rw_rwchan, &rw->rw_spinlk);
+    }
+    KASSERT(rw->rw_readers > 0);
+    spinlock_release(&rw->rw_spinlk);
+}
+
+void
+rwlock_release_read(struct rwlock *rw) {
+    KASSERT(rw != NULL);
+
+    spinlock_acquire(&rw->rw_spinlk);
+    KASSERT(rw->rw_readers > 0);
+    KASSERT(rw->rw_writer == NULL);
+    rw->rw_readers--;
+    if (rw->rw_readers == 0 && rw->rw_wwaiting > 0) {
+        wchan_wakeone(rw->rw_wwchan, &rw->rw_spinlk);
+    }
+    spinlock_release(&rw->rw_spinlk);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw) {
+    KASSERT(rw != NULL);
+    KASSERT(curthread->t_in_interrupt == false);
+
+    spinlock_acquire(&rw->rw_spinlk);
+    KASSERT(rw->rw_writer != curthread);
+    if (rw->rw_writer != NULL || rw->rw_readers > 0) {
+        rw->rw_wwaiting++;
+        while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+            wchan_sleep(rw->rw_wwchan, &rw->rw_spinlk);
+        }
+        rw->rw_wwaiting--;
+    }
+    rw->rw_writer = curthread;
+    spinlock_release(&rw->rw_spinlk);
+}
+
+void
+rwlock_release_write(struct rwlock *rw) {
+    KASSERT(rw != NULL);
+
+    spinlock_acquire(&rw->rw_spinlk);
+    KASSERT(rw->rw_writer == curthread);
+    KASSERT(rw->rw_readers == 0);
+    rw->rw_writer = NULL;
+    if (rw->rw_rwaiting > 0) {
+        /*
+         * Hand the lock to every reader that queued up while we
+         * held it, so a stream of writers can't starve them. Writers
+         * still waiting get woken when the last of these lets go.
+         */
+        rw->rw_readers = rw->rw_rwaiting;
+        rw->rw_rwaiting = 0;
+        rw->rw_rgeneration++;
+        wchan_wakeall(rw->rw_rwchan, &rw->rw_spinlk);
+    }
+    else if (rw->rw_wwaiting > 0) {
+        wchan_wakeone(rw->rw_wwchan, &rw->rw_spinlk);
+    }
+    spinlock_release(&rw->rw_spinlk);
+}
+
+bool
+rwlock_do_i_write(struct rwlock *rw) {
+    return (rw->rw_writer == curthread);
+}
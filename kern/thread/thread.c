@@ -47,6 +47,8 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <rcu.h>
+#include <objcache.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
@@ -118,6 +120,36 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Thread structures come from an object cache. Only the list node is
+ * set up by the constructor; the stack is allocated per thread and
+ * freed in thread_destroy, so threads sitting free in the cache don't
+ * hold on to their stacks.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_stack = NULL;
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+}
+
+static struct objcache thread_cache =
+	OBJCACHE_INITIALIZER("thread", sizeof(struct thread),
+			     thread_ctor, thread_dtor);
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -130,14 +162,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = objcache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		objcache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -145,8 +177,6 @@ thread_create(const char *name)
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -192,6 +222,7 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_rcu_seq = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -267,15 +298,16 @@ thread_destroy(struct thread *thread)
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
+		thread->t_stack = NULL;
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
+	/* the list node stays with the cached structure */
 	kfree(thread->t_name);
-	kfree(thread);
+	objcache_free(&thread_cache, thread);
 }
 
 /*
@@ -400,6 +432,9 @@ thread_bootstrap(void)
 	spinlock_init(&allwchans_lock);
 	wchanarray_init(&allwchans);
 
+	/* The boot cpu takes part in RCU grace periods from now on */
+	rcu_cpu_online();
+
 	/* Done */
 }
 
@@ -420,6 +455,7 @@ cpu_hatch(unsigned software_number)
 	KASSERT(curthread != NULL);
 	KASSERT(curcpu->c_number == software_number);
 
+	rcu_cpu_online();
 	spl0();
 	cpu_identify(buf, sizeof(buf));
 
@@ -594,6 +630,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/*
+	 * Nobody calls thread_switch from inside an RCU read section
+	 * (those run with interrupts off), so this is a quiescent state.
+	 */
+	rcu_quiescent();
+
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
@@ -655,6 +697,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
 			cpu_idle();
+			/* Idle cpus mustn't hold up grace periods */
+			rcu_quiescent();
+			rcu_reclaim();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -733,6 +778,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Clean up dead threads. */
 	exorcise();
 
+	/* Free anything whose RCU grace period has ended. */
+	rcu_reclaim();
+
 	/* Turn interrupts back on. */
 	splx(spl);
 }
@@ -766,6 +814,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Clean up dead threads. */
 	exorcise();
 
+	/* Free anything whose RCU grace period has ended. */
+	rcu_reclaim();
+
 	/* Enable interrupts. */
 	spl0();
 
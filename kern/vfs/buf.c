@@ -33,47 +33,106 @@
 #include <array.h>
 #include <thread.h>
 #include <current.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <fs.h>
 #include <buf.h>
 
-DECLARRAY(buf);
-DEFARRAY(buf, /*noinline*/);
+DECLARRAY(bufcluster);
+DEFARRAY(bufcluster, /*noinline*/);
 
 /*
- * The required size for all buffers.
+ * Sizes. Buffers may be any size from BUFFER_MINSIZE up to
+ * BUFFER_CLUSTER_SIZE that divides BUFFER_CLUSTER_SIZE; the cache
+ * itself works in clusters of BUFFER_CLUSTER_SIZE bytes.
  */
-#define ONE_TRUE_BUFFER_SIZE		512
+#define BUFFER_MINSIZE			512
+#define BUFFER_CLUSTER_SIZE		4096
+#define BUFFER_MAXBLOCKS		(BUFFER_CLUSTER_SIZE / BUFFER_MINSIZE)
+
+/*
+ * Number of shards the cache is split into. Should be a power of 2.
+ */
+#define BUFFER_NSHARDS			16
+
+/*
+ * The two queues of an attached cluster (see below).
+ */
+#define BQ_A1	0	/* probationary: no block used again since loaded */
+#define BQ_AM	1	/* main: used again while cached */
+#define BQ_NUM	2
+
+/*
+ * Block masks.
+ */
+#define BLKBIT(i)		(1U << (i))
+#define BLKRUN(start, n)	(((1U << (n)) - 1) << (start))
 
 /*
  * Illegal array index.
  */
 #define INVALID_INDEX ((unsigned)-1)
 
+struct bufshard;
+struct bufcluster;
+
 /*
- * One buffer.
+ * One buffer: a block within a cluster. This is what buffer_get and
+ * buffer_read hand out; the state lives in the cluster.
  */
 struct buf {
+	struct bufcluster *b_cluster;
+	unsigned b_index;	/* which block of the cluster */
+	struct thread *b_holder; /* who has it busy */
+};
+
+/*
+ * One cluster: BUFFER_CLUSTER_SIZE bytes of contiguous disk, split
+ * into bc_nblocks blocks of bc_blocksize bytes each. Per-block state
+ * is kept in bitmasks so that different blocks of one cluster can be
+ * used by different threads at once; I/O is done in runs of adjacent
+ * blocks, so that reading one block of a cluster that isn't cached
+ * reads the whole cluster in one transfer.
+ */
+struct bufcluster {
 	/* maintenance */
-	unsigned b_tableindex;	/* index into {{de,at}tached,busy}_buffers */
-	unsigned b_bucketindex;	/* index into buffer_hash bucket */
+	struct bufshard *bc_shard; /* shard we're attached in, or NULL */
+	struct bufcluster *bc_next; /* links for detached or LRU list */
+	struct bufcluster *bc_prev;
+	unsigned bc_bucketindex; /* index into buffer hash bucket */
 
 	/* status flags */
-	unsigned b_attached:1;	/* key fields are valid */
-	unsigned b_busy:1;	/* currently in use */
-	unsigned b_valid:1;	/* contains real data */
-	unsigned b_dirty:1;	/* data needs to be written to disk */
-	struct thread *b_holder; /* who did buffer_mark_busy() */
+	unsigned bc_onlist:1;	/* on a buflist */
+	unsigned bc_queue:1;	/* BQ_A1 or BQ_AM */
+	unsigned bc_attached:1;	/* key fields are valid */
+
+	/* per-block status */
+	unsigned bc_busy;	/* currently in use */
+	unsigned bc_valid;	/* contains real data */
+	unsigned bc_dirty;	/* data needs to be written to disk */
+	unsigned bc_used;	/* asked for since the cluster was loaded */
+	unsigned bc_dirtyepoch;	/* buffer_epoch when it last became dirty */
 
 	/* key */
-	struct fs *b_fs;	/* file system buffer belongs to */
-	daddr_t b_physblock;	/* physical block number */
+	struct fs *bc_fs;	/* file system cluster belongs to */
+	daddr_t bc_clusterno;	/* physical block number / bc_nblocks */
+	size_t bc_blocksize;
+	unsigned bc_nblocks;
 
 	/* value */
-	void *b_data;
-	size_t b_size;
+	void *bc_data;		/* BUFFER_CLUSTER_SIZE bytes */
+	struct buf bc_bufs[BUFFER_MAXBLOCKS];
+};
+
+/*
+ * List of clusters, linked through bc_next/bc_prev.
+ */
+struct buflist {
+	struct bufcluster *bl_head;
+	struct bufcluster *bl_tail;
+	unsigned bl_count;
 };
 
 /*
@@ -81,80 +140,117 @@ struct buf {
  */
 struct bufhash {
 	unsigned bh_numbuckets;
-	struct bufarray *bh_buckets;
+	struct bufclusterarray *bh_buckets;
 };
 
 /*
- * Global state.
+ * Shards.
  *
- * Each buffer should be in one of three arrays: detached_buffers,
- * attached_buffers, or inuse_buffers.
+ * The cache is split into BUFFER_NSHARDS shards by the hash of the
+ * key. Each shard has its own lock, its own piece of the hash table,
+ * and its own LRU lists, so operations on blocks that land in
+ * different shards don't contend with each other. A cluster belongs
+ * to the shard its key hashes to for as long as it's attached;
+ * detached clusters belong to no shard and sit in the global detached
+ * pool.
  *
- * attached_buffers is maintained in LRU order. The other arrays are
- * unordered.
+ * Attached clusters none of whose blocks are busy are kept on LRU
+ * lists (oldest first), split two ways so that finding an eviction
+ * target never means scanning:
  *
- * Space in all three arrays is preallocated when buffers are created
- * so insert/remove ops won't fail on the fly.
+ *   - by queue, 2Q-style: a newly loaded cluster goes on the A1
+ *     (probationary) queue and moves to the AM (main) queue only if
+ *     one of its blocks is asked for again while cached. A1 is
+ *     evicted from first once it holds more than its share of the
+ *     shard, so a long sequential read churns through A1 without
+ *     pushing hot metadata out of AM.
  *
- * To avoid spending a lot of time reshuffling attached_buffers, we
- * preallocate it with extra space and compact it only when the extra
- * space runs out.
+ *   - by state, clean or dirty, so the head of a clean list is always
+ *     a cluster that can be reused without I/O.
  *
- * Attached and busy buffers are also referenced by buffer_hash; this
- * is an index (in the database sense) that allows lookup by fs
- * pointer and disk address.
+ * Clusters with any busy block, whether returned by buffer_get or
+ * buffer_read (counted in bs_inuse) or being read or written, are on
+ * no list. A cluster that was written out goes back at the head of
+ * its clean list: writeback goes oldest first, so that's about where
+ * it belongs.
  *
- * Buffers busy because of file system activity (that is, returned by
- * buffer_get or buffer_read) should be in the inuse_buffers array.
- * Buffers busy because they're being written out by the syncer or
- * someone evicting them are *not* moved to the inuse_buffers array but
- * are left on the attached_buffers array, to maintain their LRU
- * position.
+ * A thread holds at most one shard lock at a time. buffer_pool_lock
+ * may be taken while holding a shard lock.
  */
+struct bufshard {
+	struct lock *bs_lock;
+	struct cv *bs_busycv;
+	struct bufhash bs_hash;
+	struct buflist bs_clean[BQ_NUM];
+	struct buflist bs_dirty[BQ_NUM];
+	unsigned bs_nclusters;	/* attached clusters */
+	unsigned bs_inuse;	/* busy blocks handed out */
+
+	/* statistics */
+	unsigned bs_gets;
+	unsigned bs_valid_gets;
+	unsigned bs_reads;
+	unsigned bs_read_blocks;
+	unsigned bs_writeouts;
+	unsigned bs_write_blocks;
+	unsigned bs_evictions;
+	unsigned bs_dirty_evictions;
+	unsigned bs_promotions;
+};
 
-static struct bufarray detached_buffers;
-
-static struct bufarray attached_buffers;
-static unsigned attached_buffers_first;	  /* hint for first empty element */
-static unsigned attached_buffers_thresh;  /* size limit before compacting */
-
-static struct bufarray inuse_buffers;
+static struct bufshard buffer_shards[BUFFER_NSHARDS];
 
-static struct bufhash buffer_hash;
+/*
+ * Global state, protected by buffer_pool_lock: the pool of detached
+ * clusters and the counts that can't be kept per shard.
+ */
+static struct spinlock buffer_pool_lock;
+static struct buflist detached_clusters;
+static unsigned num_dirty_clusters;
+static unsigned num_total_clusters;
+static unsigned max_total_clusters;
+static unsigned buffer_steal_next;	/* rotor for buffer_steal */
+static unsigned num_reading;		/* reads waiting on the disk */
+static unsigned buffer_epoch;		/* see buffer_epoch_advance */
+static unsigned syncer_runs, syncer_clusters, syncer_yields;
 
 /*
- * Counters.
+ * Reservations, in buffers. Each reserved buffer may pin a cluster,
+ * so these are limited by max_total_clusters.
  */
-static unsigned num_detached_buffers;
-static unsigned num_attached_buffers;
-static unsigned num_inuse_buffers;
-static unsigned num_dirty_buffers;
+static struct lock *buffer_reserve_lock;
+static struct cv *buffer_reserve_cv;
 static unsigned num_reserved_buffers;
-static unsigned num_total_buffers;
-static unsigned max_total_buffers;
-
-static unsigned num_total_gets;
-static unsigned num_valid_gets;
-static unsigned num_read_gets;
-static unsigned num_total_writeouts;
-static unsigned num_total_evictions;
-static unsigned num_dirty_evictions;
 
 /*
- * Lock
+ * Syncer wakeups.
  */
-
-static struct lock *buffer_lock;
+static struct lock *syncer_lock;
+static struct cv *syncer_cv;
 
 /*
- * CVs
+ * Read-ahead requests, queued by buffer_readahead for the read-ahead
+ * thread. readahead_busyfs is the fs of the request being worked on,
+ * if any, so buffer_readahead_cancel can wait for it.
  */
-static struct cv *buffer_busy_cv;
-static struct cv *buffer_reserve_cv;
-static struct cv *syncer_cv;
+struct readahead {
+	struct fs *ra_fs;
+	daddr_t ra_block;
+	size_t ra_size;
+};
+
+#define READAHEAD_QUEUE_SIZE	128
+
+static struct lock *readahead_lock;
+static struct cv *readahead_cv;		/* request posted */
+static struct cv *readahead_idle_cv;	/* request finished */
+static struct readahead readahead_queue[READAHEAD_QUEUE_SIZE];
+static unsigned readahead_head, readahead_count;
+static struct fs *readahead_busyfs;
+static unsigned readahead_queued, readahead_cached, readahead_dropped;
 
 /*
- * Magic numbers (also search the code for "voodoo:")
+ * Magic numbers
  *
  * Note that these are put here like this so they're easy to find and
  * tune. There's no particular reason one shouldn't or couldn't
@@ -162,121 +258,206 @@ static struct cv *syncer_cv;
  * factor buffer reservation calls into some of these decisions somehow.
  */
 
-/* Factor for choosing attached_buffers_thresh. */
-#define ATTACHED_THRESH_NUM	3
-#define ATTACHED_THRESH_DENOM	2
-
-/* Threshold proportion (of bufs dirty) for starting the syncer */
+/* Threshold proportion (of clusters dirty) for starting the syncer */
 #define SYNCER_DIRTY_NUM	1
 #define SYNCER_DIRTY_DENOM	2
 
-/* Target proportion (of total bufs) for syncer to clean in one run */
+/* Target proportion (of total clusters) for syncer to clean in one run */
 #define SYNCER_TARGET_NUM	1
 #define SYNCER_TARGET_DENOM	4
 
-/* Limit on the previous proportion, as proportion of dirty buffers */
+/* Limit on the previous proportion, as proportion of dirty clusters */
 #define SYNCER_LIMIT_NUM	1
 #define SYNCER_LIMIT_DENOM	2
 
+/* Most clusters the syncer looks at per run, and writes per transfer */
+#define SYNCER_BATCH		64
+#define SYNCER_MAXRUN		8
+
 /* Overall limit on fraction of main memory to use for buffers */
 #define BUFFER_MAXMEM_NUM	1
 #define BUFFER_MAXMEM_DENOM	4
 
+/* Proportion of a shard's clusters A1 holds before evicting from it first */
+#define A1_SHARE_NUM		1
+#define A1_SHARE_DENOM		4
+
+/* Shard size (vs. an even share of all clusters) below which we steal */
+#define STEAL_SHARE_NUM		1
+#define STEAL_SHARE_DENOM	2
+
 ////////////////////////////////////////////////////////////
 // state invariants
 
 /*
- * Check consistency of the global state.
+ * Check consistency of a shard and the global state.
  */
 static
 void
-bufcheck(void)
+bufcheck(struct bufshard *bs)
 {
-	KASSERT(num_detached_buffers == bufarray_num(&detached_buffers));
-	KASSERT(num_attached_buffers <= bufarray_num(&attached_buffers));
-	KASSERT(num_inuse_buffers == bufarray_num(&inuse_buffers));
-
-	KASSERT(attached_buffers_first <= bufarray_num(&attached_buffers));
-	KASSERT(bufarray_num(&attached_buffers) <= attached_buffers_thresh);
-
-	KASSERT(num_detached_buffers + num_attached_buffers + num_inuse_buffers
-		== num_total_buffers);
-	KASSERT(num_inuse_buffers <= num_reserved_buffers);
-	KASSERT(num_reserved_buffers <= max_total_buffers);
-	KASSERT(num_total_buffers <= max_total_buffers);
+	unsigned q, listed;
+
+	KASSERT(lock_do_i_hold(bs->bs_lock));
+	listed = 0;
+	for (q=0; q<BQ_NUM; q++) {
+		KASSERT((bs->bs_clean[q].bl_count == 0) ==
+			(bs->bs_clean[q].bl_head == NULL));
+		KASSERT((bs->bs_dirty[q].bl_count == 0) ==
+			(bs->bs_dirty[q].bl_head == NULL));
+		listed += bs->bs_clean[q].bl_count + bs->bs_dirty[q].bl_count;
+	}
+	KASSERT(listed <= bs->bs_nclusters);
+
+	spinlock_acquire(&buffer_pool_lock);
+	KASSERT(bs->bs_nclusters <= num_total_clusters);
+	KASSERT(detached_clusters.bl_count <= num_total_clusters);
+	KASSERT(num_dirty_clusters <= num_total_clusters);
+	KASSERT(num_total_clusters <= max_total_clusters);
+	spinlock_release(&buffer_pool_lock);
 }
 
-////////////////////////////////////////////////////////////
-// supplemental array ops
-
 /*
- * This knows how the array implementation works, and should probably
- * be moved to array.c.
+ * Check a buffer size.
  */
 static
-int
-bufarray_preallocate(struct bufarray *a, unsigned maxnum)
+bool
+buffer_size_ok(size_t size)
 {
-	int result;
-	unsigned num;
-
-	num = bufarray_num(a);
-	/* grow it temporarily */
-	result = bufarray_setsize(a, maxnum);
-	if (result) {
-		return result;
-	}
-	/* and set the size back */
-	result = bufarray_setsize(a, num);
-	KASSERT(result == 0);
-	return 0;
+	return size >= BUFFER_MINSIZE && size <= BUFFER_CLUSTER_SIZE &&
+		size % BUFFER_MINSIZE == 0 && BUFFER_CLUSTER_SIZE % size == 0;
 }
 
+////////////////////////////////////////////////////////////
+// supplemental array ops
+
 /*
- * Remove an entry from a bufarray, and (unlike bufarray_remove) don't
- * preserve order.
+ * Remove an entry from a bufclusterarray, and (unlike
+ * bufclusterarray_remove) don't preserve order.
  *
  * Use fixup() to correct the index stored in the object that gets
  * moved. Sigh.
  */
 static
 void
-bufarray_remove_unordered(struct bufarray *a, unsigned index,
-			  void (*fixup)(struct buf *,
-					unsigned oldix, unsigned newix))
+bufclusterarray_remove_unordered(struct bufclusterarray *a, unsigned index,
+				 void (*fixup)(struct bufcluster *,
+					       unsigned oldix, unsigned newix))
 {
 	unsigned num;
-	struct buf *b;
+	struct bufcluster *bc;
 	int result;
 
-	num = bufarray_num(a);
+	num = bufclusterarray_num(a);
 	if (index < num-1) {
-		b = bufarray_get(a, num-1);
-		fixup(b, num-1, index);
-		bufarray_set(a, index, b);
+		bc = bufclusterarray_get(a, num-1);
+		fixup(bc, num-1, index);
+		bufclusterarray_set(a, index, bc);
 	}
-	result = bufarray_setsize(a, num-1);
+	result = bufclusterarray_setsize(a, num-1);
 	/* shrinking, should not fail */
 	KASSERT(result == 0);
 }
 
 /*
- * Routines for that fixup()...
+ * Routine for that fixup()...
  */
 static
 void
-buf_fixup_bucketindex(struct buf *b, unsigned oldix, unsigned newix)
+bufcluster_fixup_bucketindex(struct bufcluster *bc, unsigned oldix,
+			     unsigned newix)
+{
+	KASSERT(bc->bc_bucketindex == oldix);
+	bc->bc_bucketindex = newix;
+}
+
+////////////////////////////////////////////////////////////
+// buflist
+
+static
+void
+buflist_init(struct buflist *bl)
+{
+	bl->bl_head = NULL;
+	bl->bl_tail = NULL;
+	bl->bl_count = 0;
+}
+
+static
+void
+buflist_addtail(struct buflist *bl, struct bufcluster *bc)
+{
+	KASSERT(bc->bc_onlist == 0);
+
+	bc->bc_next = NULL;
+	bc->bc_prev = bl->bl_tail;
+	if (bl->bl_tail != NULL) {
+		bl->bl_tail->bc_next = bc;
+	}
+	else {
+		bl->bl_head = bc;
+	}
+	bl->bl_tail = bc;
+	bl->bl_count++;
+	bc->bc_onlist = 1;
+}
+
+static
+void
+buflist_addhead(struct buflist *bl, struct bufcluster *bc)
 {
-	KASSERT(b->b_bucketindex == oldix);
-	b->b_bucketindex = newix;
+	KASSERT(bc->bc_onlist == 0);
+
+	bc->bc_prev = NULL;
+	bc->bc_next = bl->bl_head;
+	if (bl->bl_head != NULL) {
+		bl->bl_head->bc_prev = bc;
+	}
+	else {
+		bl->bl_tail = bc;
+	}
+	bl->bl_head = bc;
+	bl->bl_count++;
+	bc->bc_onlist = 1;
 }
 
 static
 void
-buf_fixup_tableindex(struct buf *b, unsigned oldix, unsigned newix)
+buflist_remove(struct buflist *bl, struct bufcluster *bc)
+{
+	KASSERT(bc->bc_onlist == 1);
+	KASSERT(bl->bl_count > 0);
+
+	if (bc->bc_prev != NULL) {
+		bc->bc_prev->bc_next = bc->bc_next;
+	}
+	else {
+		KASSERT(bl->bl_head == bc);
+		bl->bl_head = bc->bc_next;
+	}
+	if (bc->bc_next != NULL) {
+		bc->bc_next->bc_prev = bc->bc_prev;
+	}
+	else {
+		KASSERT(bl->bl_tail == bc);
+		bl->bl_tail = bc->bc_prev;
+	}
+	bc->bc_next = bc->bc_prev = NULL;
+	bl->bl_count--;
+	bc->bc_onlist = 0;
+}
+
+static
+struct bufcluster *
+buflist_remhead(struct buflist *bl)
 {
-	KASSERT(b->b_tableindex == oldix);
-	b->b_tableindex = newix;
+	struct bufcluster *bc;
+
+	bc = bl->bl_head;
+	if (bc != NULL) {
+		buflist_remove(bl, bc);
+	}
+	return bc;
 }
 
 ////////////////////////////////////////////////////////////
@@ -296,7 +477,7 @@ bufhash_init(struct bufhash *bh, unsigned numbuckets)
 		return ENOMEM;
 	}
 	for (i=0; i<numbuckets; i++) {
-		bufarray_init(&bh->bh_buckets[i]);
+		bufclusterarray_init(&bh->bh_buckets[i]);
 	}
 	bh->bh_numbuckets = numbuckets;
 	return 0;
@@ -319,310 +500,525 @@ bufhash_cleanup(struct bufhash *bh)
  */
 static
 unsigned
-buffer_hashfunc(struct fs *fs, daddr_t physblock)
+buffer_hashfunc(struct fs *fs, daddr_t clusterno)
 {
 	unsigned val = 0;
 
 	/* there is nothing particularly special or good about this */
 	val = 0xfeeb1e;
 	val ^= ((uintptr_t)fs) >> 6;
-	val ^= physblock;
+	val ^= clusterno;
 	return val;
 }
 
 /*
- * Add a buffer to a bufhash.
+ * The low bits of the hash pick the shard; the rest pick the bucket
+ * within the shard's table.
+ */
+static
+struct bufshard *
+buffer_shard(struct fs *fs, daddr_t clusterno)
+{
+	return &buffer_shards[buffer_hashfunc(fs, clusterno) % BUFFER_NSHARDS];
+}
+
+static
+unsigned
+bufhash_bucket(struct bufhash *bh, struct fs *fs, daddr_t clusterno)
+{
+	unsigned hash;
+
+	hash = buffer_hashfunc(fs, clusterno) / BUFFER_NSHARDS;
+	return hash % bh->bh_numbuckets;
+}
+
+/*
+ * Add a cluster to a bufhash.
  */
 static
 int
-bufhash_add(struct bufhash *bh, struct buf *b)
+bufhash_add(struct bufhash *bh, struct bufcluster *bc)
 {
-	unsigned hash, bn;
+	unsigned bn;
 
-	KASSERT(b->b_bucketindex == INVALID_INDEX);
+	KASSERT(bc->bc_bucketindex == INVALID_INDEX);
 
-	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
-	return bufarray_add(&bh->bh_buckets[bn], b, &b->b_bucketindex);
+	bn = bufhash_bucket(bh, bc->bc_fs, bc->bc_clusterno);
+	return bufclusterarray_add(&bh->bh_buckets[bn], bc,
+				   &bc->bc_bucketindex);
 }
 
 /*
- * Remove a buffer from a bufhash.
+ * Remove a cluster from a bufhash.
  */
 static
 void
-bufhash_remove(struct bufhash *bh, struct buf *b)
+bufhash_remove(struct bufhash *bh, struct bufcluster *bc)
 {
-	unsigned hash, bn;
+	unsigned bn;
 
-	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, bc->bc_fs, bc->bc_clusterno);
 
-	KASSERT(bufarray_get(&bh->bh_buckets[bn], b->b_bucketindex) == b);
-	bufarray_set(&bh->bh_buckets[bn], b->b_bucketindex, NULL);
-	bufarray_remove_unordered(&bh->bh_buckets[bn], b->b_bucketindex,
-				  buf_fixup_bucketindex);
-	b->b_bucketindex = INVALID_INDEX;
+	KASSERT(bufclusterarray_get(&bh->bh_buckets[bn],
+				    bc->bc_bucketindex) == bc);
+	bufclusterarray_set(&bh->bh_buckets[bn], bc->bc_bucketindex, NULL);
+	bufclusterarray_remove_unordered(&bh->bh_buckets[bn],
+					 bc->bc_bucketindex,
+					 bufcluster_fixup_bucketindex);
+	bc->bc_bucketindex = INVALID_INDEX;
 }
 
 /*
- * Find a buffer in a bufhash.
+ * Find a cluster in a bufhash.
  */
 static
-struct buf *
-bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t physblock)
+struct bufcluster *
+bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t clusterno)
 {
-	unsigned hash, bn;
+	unsigned bn;
 	unsigned num, i;
-	struct buf *b;
+	struct bufcluster *bc;
 
-	hash = buffer_hashfunc(fs, physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, fs, clusterno);
 
-	num = bufarray_num(&bh->bh_buckets[bn]);
+	num = bufclusterarray_num(&bh->bh_buckets[bn]);
 	for (i=0; i<num; i++) {
-		b = bufarray_get(&bh->bh_buckets[bn], i);
-		KASSERT(b->b_bucketindex == i);
-		if (b->b_fs == fs && b->b_physblock == physblock) {
+		bc = bufclusterarray_get(&bh->bh_buckets[bn], i);
+		KASSERT(bc->bc_bucketindex == i);
+		if (bc->bc_fs == fs && bc->bc_clusterno == clusterno) {
 			/* found */
-			return b;
+			return bc;
 		}
 	}
 	return NULL;
 }
 
 ////////////////////////////////////////////////////////////
-// buffer tables
+// ops on clusters
 
 /*
- * Preallocate the buffer lists so adding things to them on the fly
- * can't blow up.
+ * Create a fresh cluster, if we're still under the limit.
  */
 static
-int
-preallocate_buffer_arrays(unsigned newtotal)
+struct bufcluster *
+buffer_create(void)
 {
-	int result;
-	unsigned newthresh;
+	struct bufcluster *bc;
+	unsigned i;
 
-	newthresh = (newtotal*ATTACHED_THRESH_NUM)/ATTACHED_THRESH_DENOM;
+	spinlock_acquire(&buffer_pool_lock);
+	if (num_total_clusters >= max_total_clusters) {
+		spinlock_release(&buffer_pool_lock);
+		return NULL;
+	}
+	/* claim the slot now; give it back below if kmalloc fails */
+	num_total_clusters++;
+	spinlock_release(&buffer_pool_lock);
 
-	result = bufarray_preallocate(&detached_buffers, newtotal);
-	if (result) {
-		return result;
+	bc = kmalloc(sizeof(*bc));
+	if (bc == NULL) {
+		goto fail;
 	}
 
-	result = bufarray_preallocate(&attached_buffers, newthresh);
-	if (result) {
-		return result;
+	bc->bc_data = kmalloc(BUFFER_CLUSTER_SIZE);
+	if (bc->bc_data == NULL) {
+		kfree(bc);
+		goto fail;
+	}
+	bc->bc_shard = NULL;
+	bc->bc_next = bc->bc_prev = NULL;
+	bc->bc_bucketindex = INVALID_INDEX;
+	bc->bc_onlist = 0;
+	bc->bc_queue = BQ_A1;
+	bc->bc_attached = 0;
+	bc->bc_busy = 0;
+	bc->bc_valid = 0;
+	bc->bc_dirty = 0;
+	bc->bc_used = 0;
+	bc->bc_dirtyepoch = 0;
+	bc->bc_fs = NULL;
+	bc->bc_clusterno = 0;
+	bc->bc_blocksize = 0;
+	bc->bc_nblocks = 0;
+	for (i=0; i<BUFFER_MAXBLOCKS; i++) {
+		bc->bc_bufs[i].b_cluster = bc;
+		bc->bc_bufs[i].b_index = i;
+		bc->bc_bufs[i].b_holder = NULL;
 	}
-	attached_buffers_thresh = newthresh;
+	return bc;
+
+ fail:
+	spinlock_acquire(&buffer_pool_lock);
+	num_total_clusters--;
+	spinlock_release(&buffer_pool_lock);
+	return NULL;
+}
+
+/*
+ * Attach a cluster to a given key (fs, cluster number, and block
+ * size) in shard BS.
+ */
+static
+int
+buffer_attach(struct bufshard *bs, struct bufcluster *bc, struct fs *fs,
+	      daddr_t clusterno, size_t blocksize)
+{
+	int result;
 
-	result = bufarray_preallocate(&inuse_buffers, newtotal);
+	KASSERT(lock_do_i_hold(bs->bs_lock));
+	KASSERT(bc->bc_attached == 0);
+	KASSERT(bc->bc_busy == 0);
+	KASSERT(bc->bc_valid == 0);
+	KASSERT(bc->bc_dirty == 0);
+	bc->bc_attached = 1;
+	bc->bc_fs = fs;
+	bc->bc_clusterno = clusterno;
+	result = bufhash_add(&bs->bs_hash, bc);
 	if (result) {
+		bc->bc_attached = 0;
+		bc->bc_fs = NULL;
+		bc->bc_clusterno = 0;
 		return result;
 	}
-	
+	bc->bc_shard = bs;
+	bc->bc_queue = BQ_A1;
+	bc->bc_used = 0;
+	bc->bc_blocksize = blocksize;
+	bc->bc_nblocks = BUFFER_CLUSTER_SIZE / blocksize;
+	bs->bs_nclusters++;
 	return 0;
 }
 
 /*
- * Go through the attached_buffers array and close up gaps.
+ * Detach a cluster from a particular key.
  */
 static
 void
-compact_attached_buffers(void)
+buffer_detach(struct bufcluster *bc)
 {
-	unsigned num, i, j;
-	struct buf *b;
-	int result;
+	struct bufshard *bs = bc->bc_shard;
+
+	KASSERT(bc->bc_attached == 1);
+	KASSERT(lock_do_i_hold(bs->bs_lock));
+	KASSERT(bc->bc_busy == 0);
+	KASSERT(bc->bc_dirty == 0);
+	bufhash_remove(&bs->bs_hash, bc);
+	bs->bs_nclusters--;
+	bc->bc_attached = 0;
+	bc->bc_shard = NULL;
+	bc->bc_fs = NULL;
+	bc->bc_clusterno = 0;
+	bc->bc_valid = 0;
+	bc->bc_used = 0;
+}
 
-	num = bufarray_num(&attached_buffers);
-	for (i=j=attached_buffers_first; i<num; i++) {
-		b = bufarray_get(&attached_buffers, i);
-		if (b != NULL) {
-			KASSERT(b->b_tableindex == i);
-			if (j < i) {
-				b->b_tableindex = j;
-				bufarray_set(&attached_buffers, j++, b);
-			}
-			else {
-				j++;
-			}
-		}
+/*
+ * Set and clear dirty bits, keeping the dirty cluster count. Returns
+ * true (from set) if the syncer should be kicked.
+ */
+static
+bool
+cluster_set_dirty(struct bufcluster *bc, unsigned mask)
+{
+	unsigned enough_clusters;
+	bool kick = false;
+
+	KASSERT(bc->bc_onlist == 0);
+	if (bc->bc_dirty == 0) {
+		spinlock_acquire(&buffer_pool_lock);
+		num_dirty_clusters++;
+		bc->bc_dirtyepoch = buffer_epoch;
+
+		/* Kick the syncer if enough clusters are dirty */
+		enough_clusters = (num_total_clusters * SYNCER_DIRTY_NUM) /
+			SYNCER_DIRTY_DENOM;
+		kick = num_dirty_clusters > enough_clusters;
+		spinlock_release(&buffer_pool_lock);
 	}
-	KASSERT(j <= num);
-	result = bufarray_setsize(&attached_buffers, j);
-	/* shrinking, shouldn't fail */
-	KASSERT(result == 0);
-	attached_buffers_first = j;
-	KASSERT(num_attached_buffers == j);
+	bc->bc_dirty |= mask;
+	return kick;
 }
 
-////////////////////////////////////////////////////////////
-// ops on buffers
+static
+void
+cluster_clear_dirty(struct bufcluster *bc, unsigned mask)
+{
+	KASSERT(bc->bc_onlist == 0);
+	if (bc->bc_dirty == 0) {
+		return;
+	}
+	bc->bc_dirty &= ~mask;
+	if (bc->bc_dirty == 0) {
+		spinlock_acquire(&buffer_pool_lock);
+		num_dirty_clusters--;
+		spinlock_release(&buffer_pool_lock);
+	}
+}
 
 /*
- * Create a fresh buffer.
+ * Data pointer for block I of a cluster.
  */
 static
-struct buf *
-buffer_create(void)
+void *
+cluster_blockdata(struct bufcluster *bc, unsigned i)
 {
-	struct buf *b;
-	int result;
+	return (char *)bc->bc_data + i * bc->bc_blocksize;
+}
 
-	result = preallocate_buffer_arrays(num_total_buffers+1);
-	if (result) {
-		return NULL;
-	}
+////////////////////////////////////////////////////////////
+// cluster list management
 
-	b = kmalloc(sizeof(*b));
-	if (b == NULL) {
-		return NULL;
-	}
+/*
+ * Get a cluster from the pool of detached clusters.
+ */
+static
+struct bufcluster *
+buffer_get_detached(void)
+{
+	struct bufcluster *bc;
 
-	b->b_data = kmalloc(ONE_TRUE_BUFFER_SIZE);
-	if (b->b_data == NULL) {
-		kfree(b);
-		return NULL;
-	}
-	b->b_tableindex = INVALID_INDEX;
-	b->b_bucketindex = INVALID_INDEX;
-	b->b_attached = 0;
-	b->b_busy = 0;
-	b->b_valid = 0;
-	b->b_dirty = 0;
-	b->b_fs = NULL;
-	b->b_physblock = 0;
-	b->b_size = ONE_TRUE_BUFFER_SIZE;
-	num_total_buffers++;
-	return b;
+	spinlock_acquire(&buffer_pool_lock);
+	bc = buflist_remhead(&detached_clusters);
+	spinlock_release(&buffer_pool_lock);
+
+	return bc;
 }
 
 /*
- * Attach a buffer to a given key (fs and block number)
+ * Put a cluster into the pool of detached clusters.
  */
 static
-int
-buffer_attach(struct buf *b, struct fs *fs, daddr_t block)
+void
+buffer_put_detached(struct bufcluster *bc)
 {
-	int result;
+	KASSERT(bc->bc_attached == 0);
+	KASSERT(bc->bc_busy == 0);
 
-	KASSERT(b->b_attached == 0);
-	KASSERT(b->b_valid == 0);
-	b->b_attached = 1;
-	b->b_fs = fs;
-	b->b_physblock = block;
-	result = bufhash_add(&buffer_hash, b);
-	if (result) {
-		b->b_attached = 0;
-		b->b_fs = NULL;
-		b->b_physblock = 0;
-		return result;
-	}
-	return 0;
+	spinlock_acquire(&buffer_pool_lock);
+	buflist_addtail(&detached_clusters, bc);
+	spinlock_release(&buffer_pool_lock);
 }
 
 /*
- * Detach a buffer from a particular key.
+ * The LRU list an idle attached cluster belongs on.
  */
 static
-void
-buffer_detach(struct buf *b)
+struct buflist *
+buffer_list(struct bufcluster *bc)
 {
-	KASSERT(b->b_attached == 1);
-	bufhash_remove(&buffer_hash, b);
-	b->b_attached = 0;
-	b->b_fs = NULL;
-	b->b_physblock = 0;
+	struct bufshard *bs = bc->bc_shard;
+
+	return bc->bc_dirty ?
+		&bs->bs_dirty[bc->bc_queue] : &bs->bs_clean[bc->bc_queue];
 }
 
 /*
- * Mark a buffer busy, waiting if necessary. 
+ * Remove a cluster from its shard's LRU lists.
  */
 static
 void
-buffer_mark_busy(struct buf *b)
+buffer_get_attached(struct bufcluster *bc)
 {
-	KASSERT(b->b_holder != curthread);
-	while (b->b_busy) {
-		cv_wait(buffer_busy_cv, buffer_lock);
-	}
-	b->b_busy = 1;
-	b->b_holder = curthread;
+	KASSERT(bc->bc_attached == 1);
+	KASSERT(bc->bc_busy == 0);
+
+	buflist_remove(buffer_list(bc), bc);
 }
 
 /*
- * Unmark a buffer busy, awakening waiters.
+ * Put a cluster into its shard's LRU lists, always at the end.
  */
 static
 void
-buffer_unmark_busy(struct buf *b)
+buffer_put_attached(struct bufcluster *bc)
 {
-	KASSERT(b->b_busy != 0);
-	b->b_busy = 0;
-	b->b_holder = NULL;
-	cv_broadcast(buffer_busy_cv, buffer_lock);
+	KASSERT(bc->bc_attached == 1);
+	KASSERT(bc->bc_busy == 0);
+
+	buflist_addtail(buffer_list(bc), bc);
 }
 
+////////////////////////////////////////////////////////////
+// I/O
+
 /*
  * I/O: disk to buffer
+ *
+ * Reads the block along with the run of blocks around it that are
+ * neither valid nor busy, in one transfer. The first read of a
+ * cluster thus brings in all of it. The extra blocks are marked busy
+ * while the lock is released.
  */
 static
 int
 buffer_readin(struct buf *b)
 {
+	struct bufcluster *bc = b->b_cluster;
+	struct bufshard *bs = bc->bc_shard;
+	unsigned start, end, mask, extra, avoid;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	KASSERT(b->b_attached);
-	KASSERT(b->b_busy);
-	KASSERT(b->b_fs != NULL);
+	KASSERT(bc->bc_attached);
+	KASSERT(lock_do_i_hold(bs->bs_lock));
+	KASSERT(bc->bc_busy & BLKBIT(b->b_index));
+	KASSERT(bc->bc_fs != NULL);
 
-	if (b->b_valid) {
+	if (bc->bc_valid & BLKBIT(b->b_index)) {
 		return 0;
 	}
 
-	lock_release(buffer_lock);
-	result = FSOP_READBLOCK(b->b_fs, b->b_physblock, b->b_data, b->b_size);
-	lock_acquire(buffer_lock);
+	avoid = bc->bc_valid | bc->bc_busy;
+	start = end = b->b_index;
+	while (start > 0 && !(avoid & BLKBIT(start-1))) {
+		start--;
+	}
+	while (end+1 < bc->bc_nblocks && !(avoid & BLKBIT(end+1))) {
+		end++;
+	}
+	mask = BLKRUN(start, end-start+1);
+	extra = mask & ~BLKBIT(b->b_index);
+	bc->bc_busy |= extra;
+
+	bs->bs_reads++;
+	bs->bs_read_blocks += end-start+1;
+
+	lock_release(bs->bs_lock);
+
+	spinlock_acquire(&buffer_pool_lock);
+	num_reading++;
+	spinlock_release(&buffer_pool_lock);
+
+	result = FSOP_READBLOCK(bc->bc_fs,
+				bc->bc_clusterno * bc->bc_nblocks + start,
+				cluster_blockdata(bc, start),
+				(end-start+1) * bc->bc_blocksize);
+
+	spinlock_acquire(&buffer_pool_lock);
+	num_reading--;
+	spinlock_release(&buffer_pool_lock);
+
+	lock_acquire(bs->bs_lock);
 	if (result == 0) {
-		b->b_valid = 1;
+		bc->bc_valid |= mask;
+	}
+	if (extra != 0) {
+		bc->bc_busy &= ~extra;
+		cv_broadcast(bs->bs_busycv, bs->bs_lock);
 	}
 	return result;
 }
 
 /*
- * I/O: buffer to disk
+ * I/O: cluster to disk
  *
- * Note: releases lock to do I/O; busy bit should be set to protect
+ * Writes every dirty block that isn't busy. Each stretch of adjacent
+ * such blocks goes in a single transfer. Clean blocks are never
+ * written: the file system may have written them to disk itself
+ * since they were read, so the cached copy can be stale. The blocks
+ * being written are marked busy while the lock is released. The
+ * cluster must not be on an LRU list.
+ */
+static
+int
+cluster_writeout(struct bufcluster *bc)
+{
+	struct bufshard *bs = bc->bc_shard;
+	unsigned runstart[BUFFER_MAXBLOCKS], runlen[BUFFER_MAXBLOCKS];
+	unsigned nruns, todo, mask, written, i, j;
+	daddr_t firstblock;
+	int result, err;
+
+	KASSERT(bc->bc_attached);
+	KASSERT(bc->bc_onlist == 0);
+	bufcheck(bs);
+
+	todo = bc->bc_dirty & ~bc->bc_busy;
+	KASSERT((todo & ~bc->bc_valid) == 0);
+
+	nruns = 0;
+	mask = 0;
+	for (i=0; i<bc->bc_nblocks; i=j) {
+		j = i+1;
+		if (!(todo & BLKBIT(i))) {
+			continue;
+		}
+		while (j<bc->bc_nblocks && (todo & BLKBIT(j))) {
+			j++;
+		}
+		runstart[nruns] = i;
+		runlen[nruns] = j-i;
+		mask |= BLKRUN(i, j-i);
+		nruns++;
+	}
+	if (nruns == 0) {
+		return 0;
+	}
+
+	bc->bc_busy |= mask;
+	firstblock = bc->bc_clusterno * bc->bc_nblocks;
+
+	lock_release(bs->bs_lock);
+	result = 0;
+	written = 0;
+	for (i=0; i<nruns; i++) {
+		err = FSOP_WRITEBLOCK(bc->bc_fs, firstblock + runstart[i],
+				      cluster_blockdata(bc, runstart[i]),
+				      runlen[i] * bc->bc_blocksize);
+		if (err) {
+			result = err;
+			continue;
+		}
+		written |= BLKRUN(runstart[i], runlen[i]);
+	}
+	lock_acquire(bs->bs_lock);
+
+	bs->bs_writeouts += nruns;
+	for (i=0; i<nruns; i++) {
+		bs->bs_write_blocks += runlen[i];
+	}
+
+	cluster_clear_dirty(bc, written);
+	bc->bc_busy &= ~mask;
+	cv_broadcast(bs->bs_busycv, bs->bs_lock);
+	return result;
+}
+
+/*
+ * I/O: buffer to disk (external op)
+ *
+ * Writes just this block if it's dirty. The buffer must be busy.
  */
 int
 buffer_writeout(struct buf *b)
 {
+	struct bufcluster *bc = b->b_cluster;
+	struct bufshard *bs = bc->bc_shard;
+	unsigned bit = BLKBIT(b->b_index);
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(b->b_holder == curthread);
 
-	KASSERT(b->b_attached);
-	KASSERT(b->b_valid);
-	KASSERT(b->b_busy);
-	KASSERT(b->b_fs != NULL);
+	lock_acquire(bs->bs_lock);
+	KASSERT(bc->bc_busy & bit);
+	KASSERT(bc->bc_valid & bit);
 
-	if (!b->b_dirty) {
+	if (!(bc->bc_dirty & bit)) {
+		lock_release(bs->bs_lock);
 		return 0;
 	}
 
-	num_total_writeouts++;
-	lock_release(buffer_lock);
-	result = FSOP_WRITEBLOCK(b->b_fs, b->b_physblock, b->b_data,b->b_size);
-	lock_acquire(buffer_lock);
+	bs->bs_writeouts++;
+	bs->bs_write_blocks++;
+	lock_release(bs->bs_lock);
+	result = FSOP_WRITEBLOCK(bc->bc_fs,
+				 bc->bc_clusterno * bc->bc_nblocks + b->b_index,
+				 cluster_blockdata(bc, b->b_index),
+				 bc->bc_blocksize);
+	lock_acquire(bs->bs_lock);
 	if (result == 0) {
-		num_dirty_buffers--;
-		b->b_dirty = 0;
+		cluster_clear_dirty(bc, bit);
 	}
+	lock_release(bs->bs_lock);
 	return result;
 }
 
@@ -634,8 +1030,8 @@ buffer_writeout(struct buf *b)
 void *
 buffer_map(struct buf *b)
 {
-	KASSERT(b->b_busy);
-	return b->b_data;
+	KASSERT(b->b_holder == curthread);
+	return cluster_blockdata(b->b_cluster, b->b_index);
 }
 
 /*
@@ -644,29 +1040,27 @@ buffer_map(struct buf *b)
 void
 buffer_mark_dirty(struct buf *b)
 {
-	unsigned enough_buffers;
-
-	KASSERT(b->b_busy);
-	KASSERT(b->b_valid);
-
-	if (b->b_dirty) {
-		/* nothing to do */
-		return;
+	struct bufcluster *bc = b->b_cluster;
+	struct bufshard *bs = bc->bc_shard;
+	unsigned bit = BLKBIT(b->b_index);
+	bool kick;
+
+	KASSERT(b->b_holder == curthread);
+
+	lock_acquire(bs->bs_lock);
+	KASSERT(bc->bc_busy & bit);
+	KASSERT(bc->bc_valid & bit);
+	kick = false;
+	if (!(bc->bc_dirty & bit)) {
+		kick = cluster_set_dirty(bc, bit);
 	}
+	lock_release(bs->bs_lock);
 
-	b->b_dirty = 1;
-
-	lock_acquire(buffer_lock);
-	num_dirty_buffers++;
-
-	/* Kick the syncer if enough buffers are dirty */
-	enough_buffers =
-		(num_total_buffers * SYNCER_DIRTY_NUM) / SYNCER_DIRTY_DENOM;
-
-	if (num_dirty_buffers > enough_buffers) {
-		cv_signal(syncer_cv, buffer_lock);
+	if (kick) {
+		lock_acquire(syncer_lock);
+		cv_signal(syncer_cv, syncer_lock);
+		lock_release(syncer_lock);
 	}
-	lock_release(buffer_lock);
 }
 
 /*
@@ -675,331 +1069,328 @@ buffer_mark_dirty(struct buf *b)
 void
 buffer_mark_valid(struct buf *b)
 {
-	KASSERT(b->b_busy);
-	b->b_valid = 1;
+	struct bufcluster *bc = b->b_cluster;
+	struct bufshard *bs = bc->bc_shard;
+
+	KASSERT(b->b_holder == curthread);
+
+	lock_acquire(bs->bs_lock);
+	KASSERT(bc->bc_busy & BLKBIT(b->b_index));
+	bc->bc_valid |= BLKBIT(b->b_index);
+	lock_release(bs->bs_lock);
+}
+
+/*
+ * Check whether a block is in the cache (external op). Blocks on their
+ * way in count. The answer can be stale by the time it's used, so it's
+ * a hint unless the caller's locking keeps the block from being loaded.
+ */
+bool
+buffer_incore(struct fs *fs, daddr_t block, size_t size)
+{
+	struct bufshard *bs;
+	struct bufcluster *bc;
+	daddr_t clusterno;
+	unsigned bit;
+	bool cached;
+
+	KASSERT(buffer_size_ok(size));
+	clusterno = block / (BUFFER_CLUSTER_SIZE / size);
+	bit = BLKBIT(block % (BUFFER_CLUSTER_SIZE / size));
+
+	bs = buffer_shard(fs, clusterno);
+	lock_acquire(bs->bs_lock);
+	bc = bufhash_get(&bs->bs_hash, fs, clusterno);
+	cached = bc != NULL && ((bc->bc_valid | bc->bc_busy) & bit);
+	lock_release(bs->bs_lock);
+
+	return cached;
 }
 
 ////////////////////////////////////////////////////////////
-// buffer array management
+// buffer get/release
 
 /*
- * Get a buffer from the pool of detached buffers.
+ * Write a cluster (found on a dirty list) out. Afterwards, unless
+ * someone started using it meanwhile, it's at the head of its clean
+ * list, or if not all of it could be written at the tail of its dirty
+ * list.
  */
 static
-struct buf *
-buffer_get_detached(void)
+int
+cluster_sync(struct bufcluster *bc)
 {
-	struct buf *b;
-	unsigned num;
 	int result;
 
-	num = bufarray_num(&detached_buffers);
-	KASSERT(num == num_detached_buffers);
-	if (num > 0) {
-		b = bufarray_get(&detached_buffers, num-1);
-		KASSERT(b->b_tableindex == num-1);
-		b->b_tableindex = INVALID_INDEX;
+	KASSERT(bc->bc_dirty != 0);
 
-		/* shrink array (should not fail) */
-		result = bufarray_setsize(&detached_buffers, num-1);
-		KASSERT(result == 0);
+	buffer_get_attached(bc);
+	result = cluster_writeout(bc);
 
-		num_detached_buffers--;
-		return b;
+	if (bc->bc_busy == 0) {
+		if (bc->bc_dirty == 0) {
+			buflist_addhead(buffer_list(bc), bc);
+		}
+		else {
+			buffer_put_attached(bc);
+		}
 	}
-
-	return NULL;
+	return result;
 }
 
 /*
- * Put a buffer into the pool of detached buffers.
+ * Pick the cluster to evict from shard BS: the least recently used
+ * clean one, from A1 first if A1 is over its share, or failing that
+ * the least recently used dirty one. O(1).
  */
 static
-void
-buffer_put_detached(struct buf *b)
+struct bufcluster *
+buffer_evict_target(struct bufshard *bs)
 {
-	int result;
-
-	KASSERT(b->b_attached == 0);
-	KASSERT(b->b_busy == 0);
-	KASSERT(b->b_tableindex == INVALID_INDEX);
+	unsigned first, second, a1;
 
-	result = bufarray_add(&detached_buffers, b, &b->b_tableindex);
-	/* arrays are preallocated to avoid failure here */
-	KASSERT(result == 0);
+	a1 = bs->bs_clean[BQ_A1].bl_count + bs->bs_dirty[BQ_A1].bl_count;
+	if (a1 > (bs->bs_nclusters * A1_SHARE_NUM) / A1_SHARE_DENOM) {
+		first = BQ_A1;
+		second = BQ_AM;
+	}
+	else {
+		first = BQ_AM;
+		second = BQ_A1;
+	}
 
-	num_detached_buffers++;
+	if (bs->bs_clean[first].bl_head != NULL) {
+		return bs->bs_clean[first].bl_head;
+	}
+	if (bs->bs_clean[second].bl_head != NULL) {
+		return bs->bs_clean[second].bl_head;
+	}
+	if (bs->bs_dirty[first].bl_head != NULL) {
+		return bs->bs_dirty[first].bl_head;
+	}
+	return bs->bs_dirty[second].bl_head;
 }
 
 /*
- * Remove a buffer from the attached (LRU) list.
+ * Evict a cluster from shard BS. Returns EAGAIN if the shard has
+ * nothing that can be evicted.
  */
 static
-void
-buffer_get_attached(struct buf *b, unsigned expected_busy)
+int
+buffer_evict(struct bufshard *bs, struct bufcluster **ret)
 {
-	unsigned ix;
-
-	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_busy == expected_busy);
-
-	ix = b->b_tableindex;
-
-	KASSERT(bufarray_get(&attached_buffers, ix) == b);
+	struct bufcluster *bc;
+	int result;
 
-	/* Remove from table, leave NULL behind (compact lazily, later) */
-	bufarray_set(&attached_buffers, ix, NULL);
-	b->b_tableindex = INVALID_INDEX;
+	KASSERT(lock_do_i_hold(bs->bs_lock));
 
-	/* cache the first empty slot  */
-	if (ix < attached_buffers_first) {
-		attached_buffers_first = ix;
+ again:
+	bc = buffer_evict_target(bs);
+	if (bc == NULL) {
+		return EAGAIN;
 	}
+	KASSERT(bc->bc_busy == 0);
 
-	num_attached_buffers--;
-}
-
-/*
- * Put a buffer into the attached (LRU) list, always at the end.
- */
-static
-void
-buffer_put_attached(struct buf *b)
-{
-	unsigned num;
-	int result;
-
-	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_busy == 0);
-	KASSERT(b->b_tableindex == INVALID_INDEX);
-
-	num = bufarray_num(&attached_buffers);
-	if (num >= attached_buffers_thresh) {
-		compact_attached_buffers();
+	/*
+	 * Flush the cluster out if necessary.
+	 */
+	bs->bs_evictions++;
+	if (bc->bc_dirty) {
+		bs->bs_dirty_evictions++;
+		/* lock may be released here */
+		result = cluster_sync(bc);
+		if (result) {
+			/* urgh... */
+			kprintf("buffer_evict: warning: %s\n",
+				strerror(result));
+			/* should we try another cluster? */
+			return result;
+		}
+		if (bc->bc_busy != 0 || bc->bc_dirty != 0) {
+			/* someone picked it up while we were writing */
+			goto again;
+		}
 	}
 
-	result = bufarray_add(&attached_buffers, b, &b->b_tableindex);
-	/* arrays are preallocated to avoid failure here */
-	KASSERT(result == 0);
-	num_attached_buffers++;
-}
-
-/*
- * Get a buffer out of the inuse list.
- */
-static
-void
-buffer_get_inuse(struct buf *b)
-{
-	unsigned ix;
-
-	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_busy == 1);
-
-	ix = b->b_tableindex;
-
-	KASSERT(bufarray_get(&inuse_buffers, ix) == b);
-	bufarray_remove_unordered(&inuse_buffers, ix, buf_fixup_tableindex);
-	b->b_tableindex = INVALID_INDEX;
-	num_inuse_buffers--;
-}
-
-/*
- * Put a buffer into the inuse list.
- */
-static
-void
-buffer_put_inuse(struct buf *b)
-{
-	int result;
-
-	KASSERT(b->b_attached == 1);
-	KASSERT(b->b_busy == 1);
-	KASSERT(b->b_tableindex == INVALID_INDEX);
-
-	result = bufarray_add(&inuse_buffers, b, &b->b_tableindex);
-	/* arrays are preallocated to avoid failure here */
-	KASSERT(result == 0);
-	num_inuse_buffers++;
-}
-
-////////////////////////////////////////////////////////////
-// buffer get/release
-
-/*
- * Write a buffer (found on attached_buffers[]) out.
- */
-static
-int
-buffer_sync(struct buf *b)
-{
-	int result;
-
-	KASSERT(b->b_dirty == 1);
+	KASSERT(bc->bc_dirty == 0);
 
 	/*
-	 * Mark it busy while we do I/O, but do *not* move it to the
-	 * busy list; this preserves its LRU ordering.
+	 * Detach it from its old key, and return it in a state where
+	 * it can be reattached properly.
 	 */
-	buffer_mark_busy(b);
-	curthread->t_inuse_buffers++;
-
-	result = buffer_writeout(b);
-
-	buffer_unmark_busy(b);
-	curthread->t_inuse_buffers--;
+	buffer_get_attached(bc);
+	buffer_detach(bc);
 
-	return result;
+	*ret = bc;
+	return 0;
 }
 
 /*
- * Evict a buffer.
+ * Rebalancing: evict a cluster from some shard other than EXCEPT into
+ * the detached pool. Called with no shard lock held. The rotor spreads
+ * the victims over the shards.
  */
 static
 int
-buffer_evict(struct buf **ret)
+buffer_steal(struct bufshard *except)
 {
-	unsigned num, i;
-	struct buf *b, *db;
+	struct bufshard *bs;
+	struct bufcluster *bc;
+	unsigned i, n;
 	int result;
 
-	/*
-	 * Find a target buffer.
-	 */
+	for (i=0; i<BUFFER_NSHARDS; i++) {
+		spinlock_acquire(&buffer_pool_lock);
+		n = buffer_steal_next++ % BUFFER_NSHARDS;
+		spinlock_release(&buffer_pool_lock);
 
-	num = bufarray_num(&attached_buffers);
-	b = db = NULL;
-	for (i=0; i<num; i++) {
-		if (i >= num/2 && db != NULL) {
-			/*
-			 * voodoo: avoid preferring very recent clean
-			 * buffers to older dirty buffers.
-			 */
-			break;
-		}
-		b = bufarray_get(&attached_buffers, i);
-		if (b == NULL) {
-			continue;
-		}
-		if (b->b_busy == 1) {
-			b = NULL;
+		bs = &buffer_shards[n];
+		if (bs == except) {
 			continue;
 		}
-		if (b->b_dirty == 1) {
-			if (db == NULL) {
-				/* remember first dirty buffer we saw */
-				db = b;
-			}
-			b = NULL;
-			continue;
-		}
-		break;
-	}
-	if (b == NULL && db != NULL) {
-		b = db;
-	}
-	if (b == NULL) {
-		/* No buffers at all...? */
-		kprintf("buffer_evict: no targets!?\n");
-		return EAGAIN;
-	}
-
-	/*
-	 * Flush the buffer out if necessary.
-	 */
-	num_total_evictions++;
-	if (b->b_dirty) {
-		num_dirty_evictions++;
-		KASSERT(b->b_busy == 0);
-		/* lock may be released here */
-		result = buffer_sync(b);
-		if (result) {
-			/* urgh... */
-			kprintf("buffer_evict: warning: %s\n",
-				strerror(result));
-			/* should we try another buffer? */
-			return result;
+		lock_acquire(bs->bs_lock);
+		result = buffer_evict(bs, &bc);
+		lock_release(bs->bs_lock);
+		if (result == 0) {
+			buffer_put_detached(bc);
+			return 0;
 		}
 	}
-
-	KASSERT(b->b_dirty == 0);
-
-	/*
-	 * Detach it from its old key, and return it in a state where
-	 * it can be reattached properly.
-	 */
-	buffer_get_attached(b, 0);
-	b->b_valid = 0;
-	buffer_detach(b);
-
-	*ret = b;
-	return 0;
+	return EAGAIN;
 }
 
+/*
+ * Whether shard BS holds less than its share of the clusters, in
+ * which case it should take one from another shard instead of
+ * evicting one of its own.
+ */
 static
-struct buf *
-buffer_find(struct fs *fs, daddr_t physblock)
+bool
+buffer_shard_is_small(struct bufshard *bs)
 {
-	return bufhash_get(&buffer_hash, fs, physblock);
+	unsigned share;
+
+	spinlock_acquire(&buffer_pool_lock);
+	share = num_total_clusters / BUFFER_NSHARDS;
+	spinlock_release(&buffer_pool_lock);
+
+	share = (share * STEAL_SHARE_NUM) / STEAL_SHARE_DENOM;
+	return bs->bs_nclusters < share;
 }
 
 /*
  * Find a buffer for the given block, if one already exists; otherwise
- * attach one but don't bother to read it in.
+ * attach one but don't bother to read it in. BS is the shard of the
+ * block's cluster, and must be locked.
  */
 static
 int
-buffer_get_internal(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
+buffer_get_internal(struct bufshard *bs, struct fs *fs, daddr_t block,
+		    size_t size, struct buf **ret)
 {
-	struct buf *b;
+	struct bufcluster *bc;
+	daddr_t clusterno;
+	unsigned nblocks, ix;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(buffer_size_ok(size));
+	nblocks = BUFFER_CLUSTER_SIZE / size;
+	clusterno = block / nblocks;
+	ix = block % nblocks;
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(bs == buffer_shard(fs, clusterno));
+	bufcheck(bs);
 
 	if (curthread->t_inuse_buffers >= curthread->t_reserved_buffers) {
 		panic("buffer_get: too many buffers at once\n");
 	}
 
-	num_total_gets++;
+	bs->bs_gets++;
 
-	b = buffer_find(fs, block);
-	if (b != NULL) {
-		num_valid_gets++;
-		buffer_mark_busy(b);
-		buffer_get_attached(b, 1);
+ again:
+	bc = bufhash_get(&bs->bs_hash, fs, clusterno);
+	if (bc != NULL) {
+		/* each disk offset must always be used with one size */
+		KASSERT(bc->bc_blocksize == size);
+		if (bc->bc_busy & BLKBIT(ix)) {
+			/*
+			 * Wait for it and look again; it might get
+			 * evicted or invalidated in the meantime.
+			 */
+			cv_wait(bs->bs_busycv, bs->bs_lock);
+			goto again;
+		}
+		if (bc->bc_valid & BLKBIT(ix)) {
+			bs->bs_valid_gets++;
+		}
+		if (bc->bc_busy == 0) {
+			buffer_get_attached(bc);
+		}
+		if (bc->bc_queue == BQ_A1 && (bc->bc_used & BLKBIT(ix))) {
+			/* second use: promote it */
+			bc->bc_queue = BQ_AM;
+			bs->bs_promotions++;
+		}
 	}
 	else {
-		b = buffer_get_detached();
-		if (b == NULL && num_total_buffers < max_total_buffers) {
-			/* Can create a new buffer... */
-			b = buffer_create();
+		bc = buffer_get_detached();
+		if (bc == NULL) {
+			/* Can create a new cluster if under the limit... */
+			bc = buffer_create();
+		}
+		if (bc == NULL && buffer_shard_is_small(bs)) {
+			lock_release(bs->bs_lock);
+			result = buffer_steal(bs);
+			lock_acquire(bs->bs_lock);
+			if (result == 0) {
+				goto again;
+			}
 		}
-		if (b == NULL) {
-			result = buffer_evict(&b);
+		if (bc == NULL) {
+			result = buffer_evict(bs, &bc);
+			if (result == EAGAIN) {
+				/* nothing evictable here; try elsewhere */
+				lock_release(bs->bs_lock);
+				result = buffer_steal(bs);
+				lock_acquire(bs->bs_lock);
+				if (result == 0) {
+					goto again;
+				}
+				/* No buffers at all...? */
+				kprintf("buffer_get: no eviction targets!?\n");
+			}
 			if (result) {
 				return result;
 			}
-			KASSERT(b != NULL);
+			KASSERT(bc != NULL);
+		}
+
+		/*
+		 * Eviction may have released the lock; if someone else
+		 * attached this cluster meanwhile, use theirs.
+		 */
+		if (bufhash_get(&bs->bs_hash, fs, clusterno) != NULL) {
+			buffer_put_detached(bc);
+			goto again;
 		}
 
-		KASSERT(b->b_size == ONE_TRUE_BUFFER_SIZE);
-		result = buffer_attach(b, fs, block);
+		result = buffer_attach(bs, bc, fs, clusterno, size);
 		if (result) {
-			buffer_put_detached(b);
+			buffer_put_detached(bc);
 			return result;
 		}
-		buffer_mark_busy(b);
 	}
 
+	bc->bc_busy |= BLKBIT(ix);
+	bc->bc_used |= BLKBIT(ix);
+	bc->bc_bufs[ix].b_holder = curthread;
+
 	curthread->t_inuse_buffers++;
 	KASSERT(curthread->t_inuse_buffers <= curthread->t_reserved_buffers);
 
-	buffer_put_inuse(b);
+	bs->bs_inuse++;
 
-	*ret = b;
+	*ret = &bc->bc_bufs[ix];
 	return 0;
 }
 
@@ -1010,14 +1401,20 @@ buffer_get_internal(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 int
 buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 {
+	struct bufshard *bs;
 	int result;
-	lock_acquire(buffer_lock);
-	result = buffer_get_internal(fs, block, size, ret);
-	lock_release(buffer_lock);
+
+	KASSERT(buffer_size_ok(size));
+	bs = buffer_shard(fs, block / (BUFFER_CLUSTER_SIZE / size));
+	lock_acquire(bs->bs_lock);
+	result = buffer_get_internal(bs, fs, block, size, ret);
+	lock_release(bs->bs_lock);
 
 	return result;
 }
 
+static void buffer_release_internal(struct buf *b);
+
 /*
  * Same as buffer_get but does a read so the resulting buffer always
  * contains valid data.
@@ -1025,31 +1422,34 @@ buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 int
 buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 {
+	struct bufshard *bs;
+	struct bufcluster *bc;
 	int result;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	KASSERT(buffer_size_ok(size));
+	bs = buffer_shard(fs, block / (BUFFER_CLUSTER_SIZE / size));
+	lock_acquire(bs->bs_lock);
 
-	result = buffer_get_internal(fs, block, size, ret);
+	result = buffer_get_internal(bs, fs, block, size, ret);
 	if (result) {
-		lock_release(buffer_lock);
+		lock_release(bs->bs_lock);
 		*ret = NULL;
 		return result;
 	}
 
-	if (!(*ret)->b_valid) {
-		num_read_gets++;
+	bc = (*ret)->b_cluster;
+	if (!(bc->bc_valid & BLKBIT((*ret)->b_index))) {
 		/* may lose (and then re-acquire) lock here */
 		result = buffer_readin(*ret);
 		if (result) {
-			buffer_release(*ret);
-			lock_release(buffer_lock);
+			buffer_release_internal(*ret);
+			lock_release(bs->bs_lock);
 			*ret = NULL;
 			return result;
 		}
 	}
 
-	lock_release(buffer_lock);
+	lock_release(bs->bs_lock);
 	return 0;
 }
 
@@ -1060,52 +1460,136 @@ buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 void
 buffer_drop(struct fs *fs, daddr_t block, size_t size)
 {
-	struct buf *b;
-
-	lock_acquire(buffer_lock);
-	bufcheck();
-
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	struct bufshard *bs;
+	struct bufcluster *bc;
+	daddr_t clusterno;
+	unsigned ix, bit;
+
+	KASSERT(buffer_size_ok(size));
+	clusterno = block / (BUFFER_CLUSTER_SIZE / size);
+	ix = block % (BUFFER_CLUSTER_SIZE / size);
+	bit = BLKBIT(ix);
+
+	bs = buffer_shard(fs, clusterno);
+	lock_acquire(bs->bs_lock);
+	bufcheck(bs);
+
+ again:
+	bc = bufhash_get(&bs->bs_hash, fs, clusterno);
+	if (bc != NULL && (bc->bc_busy & bit)) {
+		/*
+		 * Dropping a buffer you're using is a big mistake, but
+		 * it may be busy because read-ahead (or a read of a
+		 * neighboring block) is loading it. Wait for that.
+		 */
+		KASSERT(bc->bc_bufs[ix].b_holder != curthread);
+		cv_wait(bs->bs_busycv, bs->bs_lock);
+		goto again;
+	}
+	if (bc != NULL && ((bc->bc_valid | bc->bc_dirty) & bit)) {
+		if (bc->bc_busy == 0) {
+			buffer_get_attached(bc);
+		}
+		bc->bc_valid &= ~bit;
+		bc->bc_used &= ~bit;
+		cluster_clear_dirty(bc, bit);
+		if (bc->bc_busy == 0) {
+			if (bc->bc_valid == 0) {
+				buffer_detach(bc);
+				buffer_put_detached(bc);
+			}
+			else {
+				buffer_put_attached(bc);
+			}
+		}
+	}
+	lock_release(bs->bs_lock);
+}
 
-	b = buffer_find(fs, block);
-	if (b != NULL) {
-		/* dropping a buffer someone else is using is a big mistake */
-		KASSERT(b->b_busy == 0);
+/*
+ * Write a block out now if it's in the cache and dirty (external op).
+ * This is for getting data to disk ahead of metadata that refers to
+ * it. Other dirty blocks of the cluster go along in the same write.
+ * The caller may hold the block itself (e.g. an inode it has loaded),
+ * in which case just that block is written.
+ */
+int
+buffer_sync_block(struct fs *fs, daddr_t block, size_t size)
+{
+	struct bufshard *bs;
+	struct bufcluster *bc;
+	daddr_t clusterno;
+	unsigned ix, bit;
+	int result;
 
-		buffer_get_attached(b, 0);
-		b->b_valid = 0;
-		if (b->b_dirty) {
-			b->b_dirty = 0;
-			num_dirty_buffers--;
+	KASSERT(buffer_size_ok(size));
+	clusterno = block / (BUFFER_CLUSTER_SIZE / size);
+	ix = block % (BUFFER_CLUSTER_SIZE / size);
+	bit = BLKBIT(ix);
+
+	bs = buffer_shard(fs, clusterno);
+	lock_acquire(bs->bs_lock);
+	bufcheck(bs);
+
+ again:
+	bc = bufhash_get(&bs->bs_hash, fs, clusterno);
+	if (bc != NULL && (bc->bc_busy & bit)) {
+		if (bc->bc_bufs[ix].b_holder == curthread) {
+			lock_release(bs->bs_lock);
+			return buffer_writeout(&bc->bc_bufs[ix]);
 		}
-		buffer_detach(b);
-		buffer_put_detached(b);
+		cv_wait(bs->bs_busycv, bs->bs_lock);
+		goto again;
 	}
-	lock_release(buffer_lock);
+	result = 0;
+	if (bc != NULL && (bc->bc_dirty & bit)) {
+		if (bc->bc_busy == 0) {
+			/* idle, so it's on a dirty list */
+			result = cluster_sync(bc);
+		}
+		else {
+			/* someone's using other blocks; write the rest */
+			result = cluster_writeout(bc);
+		}
+	}
+	lock_release(bs->bs_lock);
+	return result;
 }
 
 static
 void
 buffer_release_internal(struct buf *b)
 {
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	struct bufcluster *bc = b->b_cluster;
+	struct bufshard *bs = bc->bc_shard;
+	unsigned bit = BLKBIT(b->b_index);
+
+	bufcheck(bs);
+	KASSERT(bc->bc_busy & bit);
+	KASSERT(b->b_holder == curthread);
 
-	buffer_get_inuse(b);
-	buffer_unmark_busy(b);
+	KASSERT(bs->bs_inuse > 0);
+	bs->bs_inuse--;
 	curthread->t_inuse_buffers--;
 
-	if (!b->b_valid) {
-		/* detach it */
-		if (b->b_dirty) {
-			b->b_dirty = 0;
-			num_dirty_buffers--;
-		}
-		buffer_detach(b);
-		buffer_put_detached(b);
+	if (!(bc->bc_valid & bit)) {
+		/* contents are garbage; don't write them */
+		cluster_clear_dirty(bc, bit);
 	}
-	else {
-		buffer_put_attached(b);
+
+	b->b_holder = NULL;
+	bc->bc_busy &= ~bit;
+	cv_broadcast(bs->bs_busycv, bs->bs_lock);
+
+	if (bc->bc_busy == 0) {
+		if (bc->bc_valid == 0) {
+			/* detach it */
+			buffer_detach(bc);
+			buffer_put_detached(bc);
+		}
+		else {
+			buffer_put_attached(bc);
+		}
 	}
 }
 
@@ -1115,9 +1599,11 @@ buffer_release_internal(struct buf *b)
 void
 buffer_release(struct buf *b)
 {
-	lock_acquire(buffer_lock);
+	struct bufshard *bs = b->b_cluster->bc_shard;
+
+	lock_acquire(bs->bs_lock);
 	buffer_release_internal(b);
-	lock_release(buffer_lock);
+	lock_release(bs->bs_lock);
 }
 
 /*
@@ -1126,90 +1612,421 @@ buffer_release(struct buf *b)
 void
 buffer_release_and_invalidate(struct buf *b)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
+	struct bufcluster *bc = b->b_cluster;
+	struct bufshard *bs = bc->bc_shard;
+
+	lock_acquire(bs->bs_lock);
 
-	b->b_valid = 0;
+	bc->bc_valid &= ~BLKBIT(b->b_index);
 	buffer_release_internal(b);
-	lock_release(buffer_lock);
+	lock_release(bs->bs_lock);
 }
 
 ////////////////////////////////////////////////////////////
 // explicit sync
 
+/*
+ * Find a cluster of FS in shard BS that became dirty before EPOCH and
+ * is in use, so isn't on a dirty list. Clusters in use aren't listed
+ * anywhere but the hash table, so this scans it.
+ */
+static
+struct bufcluster *
+sync_find_busy(struct bufshard *bs, struct fs *fs, unsigned epoch)
+{
+	struct bufcluster *bc;
+	unsigned bn, num, i;
+
+	KASSERT(lock_do_i_hold(bs->bs_lock));
+
+	for (bn=0; bn<bs->bs_hash.bh_numbuckets; bn++) {
+		num = bufclusterarray_num(&bs->bs_hash.bh_buckets[bn]);
+		for (i=0; i<num; i++) {
+			bc = bufclusterarray_get(&bs->bs_hash.bh_buckets[bn], i);
+			if (bc->bc_fs == fs && bc->bc_busy != 0 &&
+			    bc->bc_dirty != 0 &&
+			    (int)(bc->bc_dirtyepoch - epoch) < 0) {
+				return bc;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write out the dirty clusters in shard BS, only those belonging to
+ * FS if FS isn't NULL, and if OLDONLY only those that became dirty
+ * before EPOCH. In the latter case the idle dirty blocks of clusters
+ * that are in use are written too, and only blocks that are both
+ * dirty and in use are waited for, so that when this returns all of
+ * them are on disk.
+ */
+static
 int
-sync_fs_buffers(struct fs *fs)
+sync_shard_buffers(struct bufshard *bs, struct fs *fs,
+		   bool oldonly, unsigned epoch)
 {
-	unsigned i, j;
-	struct buf *b;
+	struct bufcluster *bc;
+	unsigned q;
 	int result;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	KASSERT(!oldonly || fs != NULL);
 
-	/* Don't cache the array size; it might change as we work. */
-	for (i=0; i<bufarray_num(&attached_buffers); i++) {
-		b = bufarray_get(&attached_buffers, i);
-		if (b == NULL || b->b_fs != fs) {
-			continue;
-		}
+	lock_acquire(bs->bs_lock);
+	bufcheck(bs);
+
+ restart:
+	for (q=0; q<BQ_NUM; q++) {
+ again:
+		for (bc = bs->bs_dirty[q].bl_head; bc != NULL;
+		     bc = bc->bc_next) {
+			if (fs != NULL && bc->bc_fs != fs) {
+				continue;
+			}
+			if (oldonly && (int)(bc->bc_dirtyepoch - epoch) >= 0) {
+				continue;
+			}
 
-		if (b->b_dirty) {
 			/* lock may be released (and then re-acquired) here */
-			result = buffer_sync(b);
+			result = cluster_sync(bc);
 			if (result) {
-				lock_release(buffer_lock);
+				lock_release(bs->bs_lock);
 				return result;
 			}
-			j = b->b_tableindex;
-			if (i != j) {
-				/* compact_attached_buffers ran */
-				KASSERT(j<i);
-				i = j;
+			/* the list may have changed under us; rescan */
+			goto again;
+		}
+	}
+
+	if (oldonly && (bc = sync_find_busy(bs, fs, epoch)) != NULL) {
+		if ((bc->bc_dirty & ~bc->bc_busy) != 0) {
+			/* someone's using other blocks; write the rest */
+			result = cluster_writeout(bc);
+			if (result) {
+				lock_release(bs->bs_lock);
+				return result;
 			}
 		}
+		else {
+			/* when it's let go it goes on a dirty list */
+			cv_wait(bs->bs_busycv, bs->bs_lock);
+		}
+		goto restart;
 	}
 
-	lock_release(buffer_lock);
+	lock_release(bs->bs_lock);
+	return 0;
+}
+
+int
+sync_fs_buffers(struct fs *fs)
+{
+	unsigned i;
+	int result;
+
+	for (i=0; i<BUFFER_NSHARDS; i++) {
+		result = sync_shard_buffers(&buffer_shards[i], fs, false, 0);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Start a new dirty epoch. Returns its number; every cluster that is
+ * dirty now belongs to an earlier one.
+ */
+unsigned
+buffer_epoch_advance(void)
+{
+	unsigned epoch;
+
+	spinlock_acquire(&buffer_pool_lock);
+	epoch = ++buffer_epoch;
+	spinlock_release(&buffer_pool_lock);
+	return epoch;
+}
+
+/*
+ * Write out the dirty clusters of FS that became dirty before EPOCH,
+ * waiting only for dirty blocks that are in use to be let go first.
+ * Clusters dirtied since are left for the syncer.
+ */
+int
+sync_fs_buffers_before(struct fs *fs, unsigned epoch)
+{
+	unsigned i;
+	int result;
+
+	for (i=0; i<BUFFER_NSHARDS; i++) {
+		result = sync_shard_buffers(&buffer_shards[i], fs, true,
+					    epoch);
+		if (result) {
+			return result;
+		}
+	}
 	return 0;
 }
 
 ////////////////////////////////////////////////////////////
 // syncer
 
+/*
+ * The syncer writes behind in disk order: it collects the keys of a
+ * batch of dirty clusters from all the shards, sorts them by block
+ * number, and writes each run of physically adjacent clusters with one
+ * transfer, gathered through syncer_staging. Clusters that are busy
+ * are left for next time; clusters that aren't entirely dirty are
+ * written on their own with cluster_sync, which writes only their
+ * dirty blocks. After each transfer it
+ * yields if reads are waiting on the disk, so that write-behind
+ * doesn't sit in front of foreground I/O.
+ *
+ * Only the syncer thread uses the state here.
+ */
+struct syncer_key {
+	struct fs *sk_fs;
+	daddr_t sk_clusterno;
+	unsigned sk_nblocks;
+};
+
+static struct syncer_key syncer_keys[SYNCER_BATCH];
+static struct bufcluster *syncer_run[SYNCER_MAXRUN];
+static void *syncer_staging;		/* SYNCER_MAXRUN clusters */
+static unsigned syncer_nextshard;	/* rotor for collecting */
+
+/*
+ * Collect the keys of up to MAX dirty clusters, oldest first within
+ * each shard, starting from a different shard each time.
+ */
+static
+unsigned
+syncer_collect(unsigned max)
+{
+	struct bufshard *bs;
+	struct bufcluster *bc;
+	unsigned i, q, n;
+
+	n = 0;
+	for (i=0; i<BUFFER_NSHARDS && n < max; i++) {
+		bs = &buffer_shards[(syncer_nextshard + i) % BUFFER_NSHARDS];
+		lock_acquire(bs->bs_lock);
+		for (q=0; q<BQ_NUM; q++) {
+			for (bc = bs->bs_dirty[q].bl_head;
+			     bc != NULL && n < max; bc = bc->bc_next) {
+				syncer_keys[n].sk_fs = bc->bc_fs;
+				syncer_keys[n].sk_clusterno = bc->bc_clusterno;
+				syncer_keys[n].sk_nblocks = bc->bc_nblocks;
+				n++;
+			}
+		}
+		lock_release(bs->bs_lock);
+	}
+	syncer_nextshard = (syncer_nextshard + 1) % BUFFER_NSHARDS;
+	return n;
+}
+
+static
+bool
+syncer_key_less(const struct syncer_key *a, const struct syncer_key *b)
+{
+	if (a->sk_fs != b->sk_fs) {
+		return (uintptr_t)a->sk_fs < (uintptr_t)b->sk_fs;
+	}
+	return a->sk_clusterno < b->sk_clusterno;
+}
+
+/*
+ * Sort the collected keys into disk order. The batch is small, so
+ * insertion sort will do.
+ */
 static
 void
-sync_some_buffers(void)
+syncer_sort(unsigned n)
 {
-	unsigned i, targetcount, limit;
-	struct buf *b;
+	struct syncer_key tmp;
+	unsigned i, j;
+
+	for (i=1; i<n; i++) {
+		tmp = syncer_keys[i];
+		for (j=i; j>0 && syncer_key_less(&tmp, &syncer_keys[j-1]); j--) {
+			syncer_keys[j] = syncer_keys[j-1];
+		}
+		syncer_keys[j] = tmp;
+	}
+}
+
+/*
+ * Write out the N clusters in syncer_run, which are adjacent on disk,
+ * entirely dirty, marked entirely busy, and on no list, in one transfer.
+ * Then put them back.
+ */
+static
+int
+syncer_writerun(unsigned n)
+{
+	struct bufcluster *bc;
+	struct bufshard *bs;
+	void *data;
+	unsigned i, allmask;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(n > 0 && n <= SYNCER_MAXRUN);
+
+	bc = syncer_run[0];
+	if (n == 1) {
+		data = bc->bc_data;
+	}
+	else {
+		/* no lock needed: we have every block busy */
+		data = syncer_staging;
+		for (i=0; i<n; i++) {
+			memcpy((char *)data + i * BUFFER_CLUSTER_SIZE,
+			       syncer_run[i]->bc_data, BUFFER_CLUSTER_SIZE);
+		}
+	}
+
+	result = FSOP_WRITEBLOCK(bc->bc_fs, bc->bc_clusterno * bc->bc_nblocks,
+				 data, n * BUFFER_CLUSTER_SIZE);
+
+	for (i=0; i<n; i++) {
+		bc = syncer_run[i];
+		bs = bc->bc_shard;
+		allmask = BLKRUN(0, bc->bc_nblocks);
+
+		lock_acquire(bs->bs_lock);
+		KASSERT(bc->bc_busy == allmask);
+		if (i == 0) {
+			bs->bs_writeouts++;
+		}
+		bs->bs_write_blocks += bc->bc_nblocks;
+		if (result == 0) {
+			cluster_clear_dirty(bc, allmask);
+		}
+		bc->bc_busy = 0;
+		cv_broadcast(bs->bs_busycv, bs->bs_lock);
+		if (bc->bc_dirty == 0) {
+			buflist_addhead(buffer_list(bc), bc);
+		}
+		else {
+			buffer_put_attached(bc);
+		}
+		lock_release(bs->bs_lock);
+	}
+
+	spinlock_acquire(&buffer_pool_lock);
+	syncer_runs++;
+	syncer_clusters += n;
+	spinlock_release(&buffer_pool_lock);
+
+	return result;
+}
+
+/*
+ * Let reads that are waiting on the disk go first.
+ */
+static
+void
+syncer_pace(void)
+{
+	unsigned reading;
+
+	spinlock_acquire(&buffer_pool_lock);
+	reading = num_reading;
+	if (reading > 0) {
+		syncer_yields++;
+	}
+	spinlock_release(&buffer_pool_lock);
+
+	if (reading > 0) {
+		thread_yield();
+	}
+}
+
+static
+void
+sync_some_buffers(void)
+{
+	struct syncer_key *key;
+	struct bufshard *bs;
+	struct bufcluster *bc;
+	unsigned targetcount, limit, nkeys, i, run;
+	int result;
 
+	spinlock_acquire(&buffer_pool_lock);
 	targetcount =
-		(num_total_buffers * SYNCER_TARGET_NUM) / SYNCER_TARGET_DENOM;
-	limit = (num_dirty_buffers * SYNCER_LIMIT_NUM) / SYNCER_LIMIT_DENOM;
+		(num_total_clusters * SYNCER_TARGET_NUM) / SYNCER_TARGET_DENOM;
+	limit = (num_dirty_clusters * SYNCER_LIMIT_NUM) / SYNCER_LIMIT_DENOM;
+	spinlock_release(&buffer_pool_lock);
 
 	if (targetcount > limit) {
 		targetcount = limit;
 	}
+	if (targetcount > SYNCER_BATCH) {
+		targetcount = SYNCER_BATCH;
+	}
 
-	/* Don't cache the array size; it might change as we work. */
-	for (i=0; i<bufarray_num(&attached_buffers) && targetcount > 0; i++) {
-		b = bufarray_get(&attached_buffers, i);
-		if (b == NULL || b->b_busy) {
-			continue;
+	nkeys = syncer_collect(targetcount);
+	syncer_sort(nkeys);
+
+	i = 0;
+	while (i < nkeys) {
+		run = 0;
+		while (i < nkeys && run < SYNCER_MAXRUN) {
+			key = &syncer_keys[i];
+			if (run > 0 &&
+			    (key->sk_fs != syncer_run[0]->bc_fs ||
+			     key->sk_nblocks != syncer_run[0]->bc_nblocks ||
+			     key->sk_clusterno !=
+			     syncer_run[0]->bc_clusterno + run)) {
+				/* not adjacent; start a new run */
+				break;
+			}
+
+			bs = buffer_shard(key->sk_fs, key->sk_clusterno);
+			lock_acquire(bs->bs_lock);
+			bc = bufhash_get(&bs->bs_hash, key->sk_fs,
+					 key->sk_clusterno);
+			if (bc == NULL || bc->bc_dirty == 0 ||
+			    bc->bc_busy != 0) {
+				/* gone, cleaned, or in use since we looked */
+				lock_release(bs->bs_lock);
+				i++;
+				if (run > 0) {
+					break;
+				}
+				continue;
+			}
+			if (bc->bc_dirty != BLKRUN(0, bc->bc_nblocks)) {
+				if (run > 0) {
+					/* do it by itself next time around */
+					lock_release(bs->bs_lock);
+					break;
+				}
+				result = cluster_sync(bc);
+				lock_release(bs->bs_lock);
+				if (result) {
+					kprintf("syncer: warning: %s\n",
+						strerror(result));
+				}
+				i++;
+				continue;
+			}
+			buffer_get_attached(bc);
+			bc->bc_busy = BLKRUN(0, bc->bc_nblocks);
+			syncer_run[run++] = bc;
+			lock_release(bs->bs_lock);
+			i++;
 		}
-		if (b->b_dirty) {
-			/* lock may be released (and then re-acquired) here */
-			result = buffer_sync(b);
+
+		if (run > 0) {
+			result = syncer_writerun(run);
 			if (result) {
 				kprintf("syncer: warning: %s\n",
 					strerror(result));
 			}
-			targetcount--;
+			syncer_pace();
 		}
 	}
 }
@@ -1221,12 +2038,115 @@ syncer_thread(void *x1, unsigned long x2)
 	(void)x1;
 	(void)x2;
 
-	lock_acquire(buffer_lock);
+	lock_acquire(syncer_lock);
 	while (1) {
-		cv_wait(syncer_cv, buffer_lock);
+		cv_wait(syncer_cv, syncer_lock);
+		lock_release(syncer_lock);
 		sync_some_buffers();
+		lock_acquire(syncer_lock);
 	}
-	lock_release(buffer_lock);
+	lock_release(syncer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// read-ahead
+
+/*
+ * Ask for a block to be read into the cache in the background. This
+ * never waits for I/O; if the block is already cached or on its way
+ * in, or the queue is full, it does nothing.
+ */
+void
+buffer_readahead(struct fs *fs, daddr_t block, size_t size)
+{
+	struct readahead *ra;
+	bool cached;
+
+	cached = buffer_incore(fs, block, size);
+
+	lock_acquire(readahead_lock);
+	if (cached) {
+		readahead_cached++;
+	}
+	else if (readahead_count == READAHEAD_QUEUE_SIZE) {
+		readahead_dropped++;
+	}
+	else {
+		ra = &readahead_queue[(readahead_head + readahead_count) %
+				      READAHEAD_QUEUE_SIZE];
+		ra->ra_fs = fs;
+		ra->ra_block = block;
+		ra->ra_size = size;
+		readahead_count++;
+		readahead_queued++;
+		cv_signal(readahead_cv, readahead_lock);
+	}
+	lock_release(readahead_lock);
+}
+
+/*
+ * Throw away queued read-ahead for FS and wait for any that's in
+ * progress, so FS can go away.
+ */
+void
+buffer_readahead_cancel(struct fs *fs)
+{
+	struct readahead *ra;
+	unsigned i, n;
+
+	lock_acquire(readahead_lock);
+	n = 0;
+	for (i=0; i<readahead_count; i++) {
+		ra = &readahead_queue[(readahead_head + i) %
+				      READAHEAD_QUEUE_SIZE];
+		if (ra->ra_fs != fs) {
+			readahead_queue[(readahead_head + n) %
+					READAHEAD_QUEUE_SIZE] = *ra;
+			n++;
+		}
+	}
+	readahead_count = n;
+	while (readahead_busyfs == fs) {
+		cv_wait(readahead_idle_cv, readahead_lock);
+	}
+	lock_release(readahead_lock);
+}
+
+static
+void
+readahead_thread(void *x1, unsigned long x2)
+{
+	struct readahead ra;
+	struct buf *b;
+	int result;
+
+	(void)x1;
+	(void)x2;
+
+	lock_acquire(readahead_lock);
+	while (1) {
+		while (readahead_count == 0) {
+			cv_wait(readahead_cv, readahead_lock);
+		}
+		ra = readahead_queue[readahead_head];
+		readahead_head = (readahead_head + 1) % READAHEAD_QUEUE_SIZE;
+		readahead_count--;
+		readahead_busyfs = ra.ra_fs;
+		lock_release(readahead_lock);
+
+		/* a cluster hit if an earlier request brought it in */
+		reserve_buffers(1, ra.ra_size);
+		result = buffer_read(ra.ra_fs, ra.ra_block, ra.ra_size, &b);
+		if (result == 0) {
+			buffer_release(b);
+		}
+		unreserve_buffers(1, ra.ra_size);
+
+		lock_acquire(readahead_lock);
+		readahead_busyfs = NULL;
+		cv_broadcast(readahead_idle_cv, readahead_lock);
+	}
+	lock_release(readahead_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1241,20 +2161,19 @@ syncer_thread(void *x1, unsigned long x2)
 void
 reserve_buffers(unsigned count, size_t size)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
+	lock_acquire(buffer_reserve_lock);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(buffer_size_ok(size));
 
 	/* All buffer reservations must be done up front, all at once. */
 	KASSERT(curthread->t_reserved_buffers == 0);
 
-	while (num_reserved_buffers + count > max_total_buffers) {
-		cv_wait(buffer_reserve_cv, buffer_lock);
+	while (num_reserved_buffers + count > max_total_clusters) {
+		cv_wait(buffer_reserve_cv, buffer_reserve_lock);
 	}
 	num_reserved_buffers += count;
 	curthread->t_reserved_buffers = count;
-	lock_release(buffer_lock);
+	lock_release(buffer_reserve_lock);
 }
 
 /*
@@ -1263,20 +2182,19 @@ reserve_buffers(unsigned count, size_t size)
 void
 unreserve_buffers(unsigned count, size_t size)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
+	lock_acquire(buffer_reserve_lock);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	KASSERT(buffer_size_ok(size));
 
 	KASSERT(count <= curthread->t_reserved_buffers);
 	KASSERT(count <= num_reserved_buffers);
 
 	curthread->t_reserved_buffers -= count;
 	num_reserved_buffers -= count;
-	cv_broadcast(buffer_reserve_cv, buffer_lock);
+	cv_broadcast(buffer_reserve_cv, buffer_reserve_lock);
 
 	KASSERT(curthread->t_inuse_buffers <= curthread->t_reserved_buffers);
-	lock_release(buffer_lock);
+	lock_release(buffer_reserve_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1285,24 +2203,77 @@ unreserve_buffers(unsigned count, size_t size)
 void
 buffer_printstats(void)
 {
-	lock_acquire(buffer_lock);
+	struct bufshard *bs;
+	unsigned attached, probation, inuse;
+	unsigned gets, valid_gets, reads, read_blocks;
+	unsigned writeouts, write_blocks;
+	unsigned evictions, dirty_evictions, promotions;
+	unsigned ra_queued, ra_cached, ra_dropped;
+	unsigned runs, runclusters, yields;
+	unsigned detached, dirty, total, i;
+
+	attached = probation = inuse = 0;
+	gets = valid_gets = reads = read_blocks = 0;
+	writeouts = write_blocks = 0;
+	evictions = dirty_evictions = promotions = 0;
+
+	/* Not a snapshot: each shard is read under its own lock. */
+	for (i=0; i<BUFFER_NSHARDS; i++) {
+		bs = &buffer_shards[i];
+		lock_acquire(bs->bs_lock);
+		attached += bs->bs_nclusters;
+		probation += bs->bs_clean[BQ_A1].bl_count +
+			bs->bs_dirty[BQ_A1].bl_count;
+		inuse += bs->bs_inuse;
+		gets += bs->bs_gets;
+		valid_gets += bs->bs_valid_gets;
+		reads += bs->bs_reads;
+		read_blocks += bs->bs_read_blocks;
+		writeouts += bs->bs_writeouts;
+		write_blocks += bs->bs_write_blocks;
+		evictions += bs->bs_evictions;
+		dirty_evictions += bs->bs_dirty_evictions;
+		promotions += bs->bs_promotions;
+		lock_release(bs->bs_lock);
+	}
 
-	kprintf("Buffers: %u of %u allocated\n",
-		num_total_buffers, max_total_buffers);
-	kprintf("   %u detached, %u attached, %u inuse\n",
-		num_detached_buffers, num_attached_buffers, num_inuse_buffers);
-	kprintf("   %u reserved\n", num_reserved_buffers);
-	kprintf("   %u dirty\n", num_dirty_buffers);
+	lock_acquire(readahead_lock);
+	ra_queued = readahead_queued;
+	ra_cached = readahead_cached;
+	ra_dropped = readahead_dropped;
+	lock_release(readahead_lock);
+
+	spinlock_acquire(&buffer_pool_lock);
+	detached = detached_clusters.bl_count;
+	dirty = num_dirty_clusters;
+	total = num_total_clusters;
+	runs = syncer_runs;
+	runclusters = syncer_clusters;
+	yields = syncer_yields;
+	spinlock_release(&buffer_pool_lock);
+
+	kprintf("Buffers: %u of %u %uk clusters allocated, in %u shards\n",
+		total, max_total_clusters, BUFFER_CLUSTER_SIZE/1024,
+		BUFFER_NSHARDS);
+	kprintf("   %u detached, %u attached (%u probationary)\n",
+		detached, attached, probation);
+	kprintf("   %u buffers inuse, %u reserved\n",
+		inuse, num_reserved_buffers);
+	kprintf("   %u clusters dirty\n", dirty);
 
 	kprintf("Buffer operations:\n");
-	kprintf("   %u gets (%u hits, %u reads)\n",
-		num_total_gets, num_valid_gets, num_read_gets);
-	kprintf("   %u writeouts\n",
-		num_total_writeouts);
+	kprintf("   %u gets (%u hits, %u promotions)\n",
+		gets, valid_gets, promotions);
+	kprintf("   %u reads (%u blocks)\n",
+		reads, read_blocks);
+	kprintf("   %u writeouts (%u blocks)\n",
+		writeouts, write_blocks);
 	kprintf("   %u evictions (%u when dirty)\n",
-		num_total_evictions, num_dirty_evictions);
-
-	lock_release(buffer_lock);
+		evictions, dirty_evictions);
+	kprintf("   %u read-aheads (%u already cached, %u dropped)\n",
+		ra_queued, ra_cached, ra_dropped);
+	kprintf("   %u syncer writes (%u clusters, %u yields to reads)\n",
+		runs, runclusters, yields);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1311,51 +2282,76 @@ buffer_printstats(void)
 void
 buffer_bootstrap(void)
 {
+	struct bufshard *bs;
 	size_t max_buffer_mem;
+	unsigned i, q, numbuckets;
 	int result;
 
-	num_detached_buffers = 0;
-	num_attached_buffers = 0;
-	num_inuse_buffers = 0;
-	num_dirty_buffers = 0;
+	COMPILE_ASSERT(BUFFER_MAXBLOCKS <= sizeof(unsigned) * 8);
+
+	spinlock_init(&buffer_pool_lock);
+	buflist_init(&detached_clusters);
+	num_dirty_clusters = 0;
 	num_reserved_buffers = 0;
-	num_total_buffers = 0;
+	num_total_clusters = 0;
+	buffer_steal_next = 0;
+	num_reading = 0;
+	buffer_epoch = 0;
+	syncer_runs = syncer_clusters = syncer_yields = 0;
 
 	/* Limit total memory usage for buffers */
 	max_buffer_mem =
 		(mainbus_ramsize() * BUFFER_MAXMEM_NUM) / BUFFER_MAXMEM_DENOM;
-	max_total_buffers = max_buffer_mem / ONE_TRUE_BUFFER_SIZE;
+	max_total_clusters = max_buffer_mem / BUFFER_CLUSTER_SIZE;
 
 	kprintf("buffers: max count %lu; max size %luk\n",
-		(unsigned long) max_total_buffers,
+		(unsigned long) max_total_clusters,
 		(unsigned long) max_buffer_mem/1024);
 
-	num_total_gets = 0;
-	num_valid_gets = 0;
-	num_read_gets = 0;
-	num_total_writeouts = 0;
-	num_total_evictions = 0;
-	num_dirty_evictions = 0;
+	numbuckets = max_total_clusters / 2 / BUFFER_NSHARDS;
+	if (numbuckets == 0) {
+		numbuckets = 1;
+	}
 
-	bufarray_init(&detached_buffers);
-	bufarray_init(&attached_buffers);
-	bufarray_init(&inuse_buffers);
-	attached_buffers_first = 0;
-	attached_buffers_thresh = 0;
+	for (i=0; i<BUFFER_NSHARDS; i++) {
+		bs = &buffer_shards[i];
 
-	result = bufhash_init(&buffer_hash, max_total_buffers/16);
-	if (result) {
-		panic("Creating buffer_hash failed\n");
-	}
+		result = bufhash_init(&bs->bs_hash, numbuckets);
+		if (result) {
+			panic("Creating buffer_hash failed\n");
+		}
+
+		bs->bs_lock = lock_create("buffer cache shard");
+		if (bs->bs_lock == NULL) {
+			panic("Creating buffer cache lock failed\n");
+		}
 
-	buffer_lock = lock_create("buffer cache lock");
-	if (buffer_lock == NULL) {
-		panic("Creating buffer cache lock failed\n");
+		bs->bs_busycv = cv_create("bufbusy");
+		if (bs->bs_busycv == NULL) {
+			panic("Creating buffer busy cv failed\n");
+		}
+
+		for (q=0; q<BQ_NUM; q++) {
+			buflist_init(&bs->bs_clean[q]);
+			buflist_init(&bs->bs_dirty[q]);
+		}
+		bs->bs_nclusters = 0;
+		bs->bs_inuse = 0;
+
+		bs->bs_gets = 0;
+		bs->bs_valid_gets = 0;
+		bs->bs_reads = 0;
+		bs->bs_read_blocks = 0;
+		bs->bs_writeouts = 0;
+		bs->bs_write_blocks = 0;
+		bs->bs_evictions = 0;
+		bs->bs_dirty_evictions = 0;
+		bs->bs_promotions = 0;
 	}
 
-	buffer_busy_cv = cv_create("bufbusy");
-	if (buffer_busy_cv == NULL) {
-		panic("Creating buffer_busy_cv failed\n");
+	buffer_reserve_lock = lock_create("buffer reserve lock");
+	if (buffer_reserve_lock == NULL) {
+		panic("Creating buffer reserve lock failed\n");
 	}
 
 	buffer_reserve_cv = cv_create("bufreserve");
@@ -1363,13 +2359,48 @@ buffer_bootstrap(void)
 		panic("Creating buffer_reserve_cv failed\n");
 	}
 
+	syncer_lock = lock_create("syncer");
+	if (syncer_lock == NULL) {
+		panic("Creating syncer_lock failed\n");
+	}
+
 	syncer_cv = cv_create("syncer");
-	if (buffer_reserve_cv == NULL) {
+	if (syncer_cv == NULL) {
 		panic("Creating syncer_cv failed\n");
 	}
 
+	syncer_staging = kmalloc(SYNCER_MAXRUN * BUFFER_CLUSTER_SIZE);
+	if (syncer_staging == NULL) {
+		panic("Allocating syncer staging area failed\n");
+	}
+	syncer_nextshard = 0;
+
 	result = thread_fork("syncer", NULL, syncer_thread, NULL, 0);
 	if (result) {
 		panic("Starting syncer failed\n");
 	}
+
+	readahead_lock = lock_create("readahead");
+	if (readahead_lock == NULL) {
+		panic("Creating readahead_lock failed\n");
+	}
+
+	readahead_cv = cv_create("readahead");
+	if (readahead_cv == NULL) {
+		panic("Creating readahead_cv failed\n");
+	}
+
+	readahead_idle_cv = cv_create("raidle");
+	if (readahead_idle_cv == NULL) {
+		panic("Creating readahead_idle_cv failed\n");
+	}
+
+	readahead_head = readahead_count = 0;
+	readahead_busyfs = NULL;
+	readahead_queued = readahead_cached = readahead_dropped = 0;
+
+	result = thread_fork("readahead", NULL, readahead_thread, NULL, 0);
+	if (result) {
+		panic("Starting readahead thread failed\n");
+	}
 }
@@ -4,13 +4,25 @@
 #include <current.h>
 #include <synch.h>
 #include <vfs.h>
+#include <objcache.h>
+
+/*
+ * File descriptors come from an object cache. The lock is created per
+ * descriptor in fd_init, not by a constructor, so descriptors sitting
+ * free in the cache don't each hold a lock.
+ */
+static struct objcache fd_cache =
+    OBJCACHE_INITIALIZER("file_desc", sizeof(struct file_desc), NULL, NULL);
 
 struct file_desc *fd_init(struct vnode *vn, mode_t mode, int flags) {
-    struct file_desc *fd = kmalloc(sizeof *fd);
-    if (fd == NULL) goto out;
+    struct file_desc *fd = objcache_alloc(&fd_cache);
+    if (fd == NULL) return NULL;    /* effectively it means ENOMEM */
 
     fd->lock = lock_create("fd_lock");
-    if (fd->lock == NULL) goto lk_out;
+    if (fd->lock == NULL) {
+        objcache_free(&fd_cache, fd);
+        return NULL;
+    }
 
     fd->vn = vn;
     fd->offset = 0;
@@ -19,11 +31,14 @@ struct file_desc *fd_init(struct vnode *vn, mode_t mode, int flags) {
     fd->flags = flags;
 
     return fd;
+}
 
-lk_out:
-	kfree(fd);
-out:
-    return NULL;    /* effectively it means ENOMEM */
+/* Close the file and free the descriptor; the caller dropped the last ref. */
+void fd_destroy(struct file_desc *fd) {
+    KASSERT(!lock_do_i_hold(fd->lock));
+    vfs_close(fd->vn);
+    lock_destroy(fd->lock);
+    objcache_free(&fd_cache, fd);
 }
 
 void fd_dec_or_destroy(int index, struct proc *proc) {
@@ -34,9 +49,7 @@ void fd_dec_or_destroy(int index, struct proc *proc) {
     lock_acquire(fd->lock);
     if (fd->ref_count == 1) {
         lock_release(fd->lock);
-        lock_destroy(fd->lock);
-        vfs_close(fd->vn);
-        kfree(fd);
+        fd_destroy(fd);
         proc->fd_table[index]=NULL;
         return;
     } else {
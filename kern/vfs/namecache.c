@@ -0,0 +1,256 @@
+/*
+ * Pathname component cache. See namecache.h.
+ *
+ * A fixed pool of entries, hashed on (directory, name) and kept in
+ * one LRU list; entering a new name reuses the least recently used
+ * entry. Unused entries sit at the cold end of the list with a null
+ * directory. Everything is under one spinlock: the critical sections
+ * are a short hash chain walk, and lookups that hit don't otherwise
+ * take any lock at all.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <namecache.h>
+
+#define NAMECACHE_ENTRIES	512
+#define NAMECACHE_BUCKETS	256	/* power of 2 */
+
+struct ncentry {
+	struct vnode *nc_dir;		/* NULL if the entry is unused */
+	struct vnode *nc_vn;		/* NULL for a negative entry */
+	uint32_t nc_hash;
+	char nc_name[NAMECACHE_NAMELEN];
+	struct ncentry *nc_hnext;	/* hash chain */
+	struct ncentry **nc_hprevp;
+	struct ncentry *nc_lrunext;	/* LRU list, toward colder */
+	struct ncentry *nc_lruprev;	/* LRU list, toward hotter */
+};
+
+static struct spinlock nc_lock = SPINLOCK_INITIALIZER;
+static struct ncentry nc_pool[NAMECACHE_ENTRIES];
+static struct ncentry *nc_hash[NAMECACHE_BUCKETS];
+static struct ncentry nc_lru;		/* list head; next is hottest */
+
+static unsigned nc_hits, nc_neghits, nc_misses, nc_enters;
+
+static
+uint32_t
+nc_hashof(struct vnode *dir, const char *name)
+{
+	uint32_t h = 2166136261U ^ (uint32_t)(uintptr_t)dir;
+
+	for (; *name != 0; name++) {
+		h = (h ^ (unsigned char)*name) * 16777619U;
+	}
+	return h;
+}
+
+static
+void
+nc_lru_remove(struct ncentry *e)
+{
+	e->nc_lruprev->nc_lrunext = e->nc_lrunext;
+	e->nc_lrunext->nc_lruprev = e->nc_lruprev;
+}
+
+/* Make E the hottest entry */
+static
+void
+nc_lru_front(struct ncentry *e)
+{
+	nc_lru_remove(e);
+	e->nc_lrunext = nc_lru.nc_lrunext;
+	e->nc_lruprev = &nc_lru;
+	nc_lru.nc_lrunext->nc_lruprev = e;
+	nc_lru.nc_lrunext = e;
+}
+
+/* Make E the coldest entry */
+static
+void
+nc_lru_back(struct ncentry *e)
+{
+	nc_lru_remove(e);
+	e->nc_lrunext = &nc_lru;
+	e->nc_lruprev = nc_lru.nc_lruprev;
+	nc_lru.nc_lruprev->nc_lrunext = e;
+	nc_lru.nc_lruprev = e;
+}
+
+/* Take E out of the hash and put it on the unused end of the list */
+static
+void
+nc_free(struct ncentry *e)
+{
+	KASSERT(e->nc_dir != NULL);
+	*e->nc_hprevp = e->nc_hnext;
+	if (e->nc_hnext != NULL) {
+		e->nc_hnext->nc_hprevp = e->nc_hprevp;
+	}
+	e->nc_hnext = NULL;
+	e->nc_hprevp = NULL;
+	e->nc_dir = NULL;
+	e->nc_vn = NULL;
+	nc_lru_back(e);
+}
+
+static
+struct ncentry *
+nc_find(struct vnode *dir, const char *name, uint32_t hash)
+{
+	struct ncentry *e;
+
+	KASSERT(spinlock_do_i_hold(&nc_lock));
+
+	for (e = nc_hash[hash % NAMECACHE_BUCKETS]; e != NULL;
+	     e = e->nc_hnext) {
+		if (e->nc_hash == hash && e->nc_dir == dir &&
+		    !strcmp(e->nc_name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+void
+namecache_bootstrap(void)
+{
+	unsigned i;
+
+	nc_lru.nc_lrunext = nc_lru.nc_lruprev = &nc_lru;
+	for (i=0; i<NAMECACHE_ENTRIES; i++) {
+		nc_pool[i].nc_dir = NULL;
+		nc_pool[i].nc_vn = NULL;
+		nc_pool[i].nc_hnext = NULL;
+		nc_pool[i].nc_hprevp = NULL;
+		nc_pool[i].nc_lrunext = &nc_lru;
+		nc_pool[i].nc_lruprev = nc_lru.nc_lruprev;
+		nc_lru.nc_lruprev->nc_lrunext = &nc_pool[i];
+		nc_lru.nc_lruprev = &nc_pool[i];
+	}
+	for (i=0; i<NAMECACHE_BUCKETS; i++) {
+		nc_hash[i] = NULL;
+	}
+}
+
+bool
+namecache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct ncentry *e;
+	uint32_t hash;
+
+	if (strlen(name) >= NAMECACHE_NAMELEN) {
+		return false;
+	}
+	hash = nc_hashof(dir, name);
+
+	spinlock_acquire(&nc_lock);
+	e = nc_find(dir, name, hash);
+	if (e == NULL) {
+		nc_misses++;
+		spinlock_release(&nc_lock);
+		return false;
+	}
+	nc_lru_front(e);
+	if (e->nc_vn != NULL) {
+		/* Safe: reclaim purges us before checking the refcount */
+		VOP_INCREF(e->nc_vn);
+		nc_hits++;
+	}
+	else {
+		nc_neghits++;
+	}
+	*ret = e->nc_vn;
+	spinlock_release(&nc_lock);
+	return true;
+}
+
+void
+namecache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct ncentry *e, **bucket;
+	uint32_t hash;
+
+	if (strlen(name) >= NAMECACHE_NAMELEN) {
+		return;
+	}
+	hash = nc_hashof(dir, name);
+
+	spinlock_acquire(&nc_lock);
+	e = nc_find(dir, name, hash);
+	if (e == NULL) {
+		/* Recycle the coldest entry */
+		e = nc_lru.nc_lruprev;
+		KASSERT(e != &nc_lru);
+		if (e->nc_dir != NULL) {
+			nc_free(e);
+		}
+		e->nc_dir = dir;
+		e->nc_hash = hash;
+		strcpy(e->nc_name, name);
+
+		bucket = &nc_hash[hash % NAMECACHE_BUCKETS];
+		e->nc_hnext = *bucket;
+		e->nc_hprevp = bucket;
+		if (*bucket != NULL) {
+			(*bucket)->nc_hprevp = &e->nc_hnext;
+		}
+		*bucket = e;
+	}
+	e->nc_vn = vn;
+	nc_lru_front(e);
+	nc_enters++;
+	spinlock_release(&nc_lock);
+}
+
+void
+namecache_remove(struct vnode *dir, const char *name)
+{
+	struct ncentry *e;
+	uint32_t hash;
+
+	if (strlen(name) >= NAMECACHE_NAMELEN) {
+		return;
+	}
+	hash = nc_hashof(dir, name);
+
+	spinlock_acquire(&nc_lock);
+	e = nc_find(dir, name, hash);
+	if (e != NULL) {
+		nc_free(e);
+	}
+	spinlock_release(&nc_lock);
+}
+
+void
+namecache_purge(struct vnode *vn)
+{
+	unsigned i;
+
+	spinlock_acquire(&nc_lock);
+	for (i=0; i<NAMECACHE_ENTRIES; i++) {
+		if (nc_pool[i].nc_dir != NULL &&
+		    (nc_pool[i].nc_dir == vn || nc_pool[i].nc_vn == vn)) {
+			nc_free(&nc_pool[i]);
+		}
+	}
+	spinlock_release(&nc_lock);
+}
+
+void
+namecache_printstats(void)
+{
+	unsigned hits, neghits, misses, enters;
+
+	spinlock_acquire(&nc_lock);
+	hits = nc_hits;
+	neghits = nc_neghits;
+	misses = nc_misses;
+	enters = nc_enters;
+	spinlock_release(&nc_lock);
+
+	kprintf("namecache: %u hits, %u negative hits, %u misses, "
+		"%u entered\n", hits, neghits, misses, enters);
+}
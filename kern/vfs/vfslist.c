@@ -42,6 +42,7 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <namecache.h>
 #include <device.h>
 #include <log.h>
 
@@ -106,6 +107,7 @@ vfs_bootstrap(void)
 	}
 
 	vfs_initbootfs();
+	namecache_bootstrap();
 	devnull_create();
 }
 
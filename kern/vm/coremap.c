@@ -105,6 +105,22 @@ vm_bootstrap(void) {
     kprintf("%c\n", _end);
 }
 
+// The address space of the process that owns a page, or NULL if it is exiting. The proc can be freed
+// once we're out of the read section, but the address space can't go away while the caller holds
+// the page busy (or is that process), as as_destroy has to take each of its pages busy first.
+static struct addrspace *cme_owner_as(unsigned pid){
+	struct proc *proc;
+	struct addrspace *as = NULL;
+	int spl;
+
+	spl = rcu_read_lock();
+	proc = get_proc(pid);
+	if (proc != NULL)
+		as = proc->p_addrspace;
+	rcu_read_unlock(spl);
+	return as;
+}
+
 // Given a locked non-kern dirty cme, it cleans it to disk
 int clean_cme(int index){
 	KASSERT(coremap.cm[index].pid!=0);
@@ -112,10 +128,14 @@ int clean_cme(int index){
 	KASSERT(coremap.cm[index].dirty == 1);
 	KASSERT(coremap.cm[index].busybit == 1);
 
-	struct addrspace *as = get_proc(coremap.cm[index].pid)->p_addrspace;
+	struct addrspace *as = cme_owner_as(coremap.cm[index].pid);
 	int pdi = VPN_PDI(coremap.cm[index].vpn);
 	int pti = VPN_PTI(coremap.cm[index].vpn);
 
+	// Owner is exiting; as_destroy will free the page
+	if(as == NULL)
+		return -1;
+
 	// Give up here to avoid deadlock
 	// TODO must I lock here?
 	if(page_set_busy(as->page_dir->dir[pdi], pti, false) != 0)
@@ -140,10 +160,14 @@ static int evict_cme(int index){
 	KASSERT(coremap.cm[index].kern != 1);
 	KASSERT(coremap.cm[index].busybit == 1);
 
-	struct addrspace *as = get_proc(coremap.cm[index].pid)->p_addrspace;
+	struct addrspace *as = cme_owner_as(coremap.cm[index].pid);
 	int pdi = VPN_PDI(coremap.cm[index].vpn);
 	int pti = VPN_PTI(coremap.cm[index].vpn);
 
+	// Owner is exiting; as_destroy will free the page
+	if(as == NULL)
+		return -1;
+
 	// Give up here to avoid deadlock
 	if(page_set_busy(as->page_dir->dir[pdi], pti, false) != 0)
 		return -1;
@@ -513,7 +537,8 @@ tlb_miss_on_store(vaddr_t vaddr, struct page_table *pt){
     KASSERT(pid != 0);
     KASSERT(coremap.cm[pt->table[pti].ppn].kern == 0);
 
-    struct addrspace *as = get_proc(pid)->p_addrspace;
+    struct addrspace *as = cme_owner_as(pid);
+    if (as == NULL) return EFAULT;
     if (pt->table[pti].write == 0 && !as->loading) return EFAULT;
 
 	core_set_busy(pt->table[pti].ppn, WAIT);
@@ -533,7 +558,8 @@ static int tlb_fault_readonly(vaddr_t vaddr, struct page_table *pt){
 
     uint32_t cmi = pt->table[pti].ppn;
     unsigned pid = coremap.cm[cmi].pid;
-    struct addrspace *as = get_proc(pid)->p_addrspace;
+    struct addrspace *as = cme_owner_as(pid);
+    if (as == NULL) return EFAULT;
     if (pt->table[pti].write == 0 && !as->loading) return EFAULT;
 
 	core_set_busy(cmi, WAIT);
@@ -586,3 +612,52 @@ vm_fault(int faulttype, vaddr_t faultaddress)
     return -1;  /* should never get here */
 }
 
+/*
+ * Pin a user page for I/O: the page table entry stays busy, which
+ * keeps the page from being evicted or cleaned, until vm_unpin_user.
+ */
+int
+vm_pin_user(vaddr_t vaddr, bool willmodify, paddr_t *ret)
+{
+    struct addrspace *as = curproc->p_addrspace;
+    struct page_table *pt;
+    uint32_t cmi;
+    int pti, result;
+
+    if (vaddr >= MIPS_KSEG0 || vaddr < TEXT_START) return EFAULT;
+    if (!is_valid_addr(vaddr, as)) return EFAULT;
+
+    pt = as->page_dir->dir[PDI(vaddr)];
+    if (pt == NULL) return EFAULT;
+    pti = PTI(vaddr);
+
+    result = validate_vaddr(vaddr, pt, pti);
+    if (result) {
+        page_set_free(pt, pti);
+        return result;
+    }
+
+    cmi = pt->table[pti].ppn;
+    if (willmodify) {
+        if (pt->table[pti].write == 0 && !as->loading) {
+            page_set_free(pt, pti);
+            return EFAULT;
+        }
+        /* written behind the TLB's back, so the fault path won't see it */
+        core_set_busy(cmi, WAIT);
+        set_dirty_bit(cmi, 1);
+        core_set_free(cmi);
+    }
+    coremap.cm[cmi].age = 0;
+
+    *ret = CMI_TO_PADDR(cmi);
+    return 0;
+}
+
+void
+vm_unpin_user(vaddr_t vaddr)
+{
+    struct page_table *pt = curproc->p_addrspace->page_dir->dir[PDI(vaddr)];
+
+    page_set_free(pt, PTI(vaddr));
+}
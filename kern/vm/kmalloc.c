@@ -30,7 +30,11 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -121,6 +125,17 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * KMAGAZINES puts per-cpu caches of free blocks in front of the shared
+ * freelists (see below). Blocks in a magazine look allocated to the
+ * heap checker but hold 0xdeadbeef, so it's turned off for
+ * CHECKGUARDS.
+ */
+#define KMAGAZINES
+#ifdef CHECKGUARDS
+#undef KMAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -160,10 +175,8 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the shared heap. Most allocations and frees
+ * are satisfied from the per-cpu magazines and don't touch it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -345,6 +358,57 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Map from physical page number to the pageref of the subpage page
+ * there (or NULL), so kfree can find a block's page without walking
+ * allbase. This only covers the first 16M of RAM; pages above that
+ * aren't entered here and are found by walking allbase instead (see
+ * findpageref).
+ */
+#define KHEAP_MAXPAGES (16*1024*1024 / PAGE_SIZE)
+#define KHEAP_PAGEINDEX(va) (KVADDR_TO_PADDR(va) / PAGE_SIZE)
+
+static struct pageref *pagerefsbypage[KHEAP_MAXPAGES];
+
+/*
+ * Find the pageref for the subpage page at PAGE, or NULL if it isn't
+ * one. Pages past the end of pagerefsbypage need a walk of allbase,
+ * for which the caller must hold kmalloc_spinlock.
+ */
+static
+struct pageref *
+findpageref(vaddr_t page)
+{
+	struct pageref *pr;
+
+	if (KHEAP_PAGEINDEX(page) < KHEAP_MAXPAGES) {
+		return pagerefsbypage[KHEAP_PAGEINDEX(page)];
+	}
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		if (PR_PAGEADDR(pr) == page) {
+			return pr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Per-cpu caches of free blocks; see kmag_alloc below.
+ */
+#define KMAG_SIZE  16	/* max blocks cached per size per cpu */
+#define KMAG_BATCH 8	/* blocks moved to/from the shared lists at once */
+
+#ifdef KMAGAZINES
+struct kmalloc_magazine {
+	unsigned km_count;
+	vaddr_t km_blocks[KMAG_SIZE];
+};
+
+static struct kmalloc_magazine kmagazines[MAXCPUS][NSIZES];
+#endif
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -867,60 +931,45 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take up to N free blocks of type BLKTYPE off the shared freelists and
+ * store their addresses in BLOCKS. Gets a fresh page if there are no
+ * free blocks at all. Returns the number of blocks taken, which is
+ * zero only if we're out of memory.
  */
 static
-void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+unsigned
+subpage_getblocks(unsigned blktype, vaddr_t *blocks, unsigned n)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	unsigned got = 0;	// # of blocks taken so far
 
 	volatile int i;
 
-#ifdef GUARDS
-	size_t clientsz;
-#endif
-
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	KASSERT(n > 0);
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
+	doalloc: /* comes here after getting a whole fresh page */
 
+		while (pr->nfree > 0 && got < n) {
 			KASSERT(pr->freelist_offset < PAGE_SIZE);
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
 
-			retptr = fl;
+			blocks[got++] = fla;
 			fl = fl->next;
 			pr->nfree--;
 
@@ -934,20 +983,15 @@ subpage_kmalloc(size_t sz
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
 		}
 	}
 
+	if (got > 0) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return got;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -962,7 +1006,7 @@ subpage_kmalloc(size_t sz
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
-		return NULL;
+		return 0;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
@@ -977,7 +1021,7 @@ subpage_kmalloc(size_t sz
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
+		return 0;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -1007,10 +1051,279 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	if (KHEAP_PAGEINDEX(prpage) < KHEAP_MAXPAGES) {
+		pagerefsbypage[KHEAP_PAGEINDEX(prpage)] = pr;
+	}
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Put the block at BLOCKADDR, which is on the page managed by PR, back
+ * on that page's freelist. If that frees the whole page, the pageref
+ * is released and the page address is returned so the caller can hand
+ * it to free_kpages once it's dropped the spinlock; otherwise returns 0.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, vaddr_t blockaddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = blockaddr - prpage;
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fl = (struct freelist *)blockaddr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		if (KHEAP_PAGEINDEX(prpage) < KHEAP_MAXPAGES) {
+			pagerefsbypage[KHEAP_PAGEINDEX(prpage)] = NULL;
+		}
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
+
+/*
+ * Return N raw blocks to the shared freelists in one go, freeing any
+ * pages that become empty.
+ */
+static
+void
+subpage_putblocks(const vaddr_t *blocks, unsigned n)
+{
+	vaddr_t freepages[KMAG_BATCH];
+	unsigned i, nfreepages = 0;
+	vaddr_t page;
+
+	KASSERT(n <= KMAG_BATCH);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (i=0; i<n; i++) {
+		page = subpage_putblock(findpageref(blocks[i] & PAGE_FRAME),
+					blocks[i]);
+		if (page != 0) {
+			freepages[nfreepages++] = page;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+
+#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+#endif
+}
+
+////////////////////////////////////////
+
+#ifdef KMAGAZINES
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps a small stack of free blocks of each size. kmalloc and
+ * kfree work on the current cpu's magazine with interrupts off (so we
+ * can't be moved to another cpu halfway through) and only go to the
+ * shared freelists, under kmalloc_spinlock, when the magazine is empty
+ * or full; then they move KMAG_BATCH blocks at once.
+ *
+ * Blocks sitting in a magazine are still counted as allocated by their
+ * pages, so a page can't be released while any of its blocks are
+ * cached. The cache is bounded at KMAG_SIZE blocks per size per cpu.
+ */
+
+static
+struct kmalloc_magazine *
+kmag_get(unsigned blktype)
+{
+	KASSERT(curcpu->c_number < MAXCPUS);
+	return &kmagazines[curcpu->c_number][blktype];
+}
+
+/*
+ * Get a raw block of type BLKTYPE, preferably from this cpu's magazine.
+ */
+static
+vaddr_t
+kmag_alloc(unsigned blktype)
+{
+	struct kmalloc_magazine *mag;
+	vaddr_t blocks[KMAG_BATCH];
+	vaddr_t ret;
+	unsigned got, i;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* too early in boot for per-cpu anything */
+		got = subpage_getblocks(blktype, blocks, 1);
+		return got ? blocks[0] : 0;
+	}
+
+	spl = splhigh();
+	mag = kmag_get(blktype);
+	if (mag->km_count > 0) {
+		ret = mag->km_blocks[--mag->km_count];
+		splx(spl);
+		return ret;
+	}
+	splx(spl);
+
+	/*
+	 * Empty; refill from the shared freelists. This can sleep (in
+	 * alloc_kpages) so we may come back on another cpu; look the
+	 * magazine up again afterwards.
+	 */
+	got = subpage_getblocks(blktype, blocks, KMAG_BATCH);
+	if (got == 0) {
+		return 0;
+	}
+	ret = blocks[--got];
+
+	spl = splhigh();
+	mag = kmag_get(blktype);
+	for (i=0; i<got && mag->km_count < KMAG_SIZE; i++) {
+		mag->km_blocks[mag->km_count++] = blocks[i];
+	}
+	splx(spl);
+
+	if (i < got) {
+		/* Someone else filled it meanwhile; give back the rest. */
+		subpage_putblocks(&blocks[i], got - i);
+	}
+	return ret;
+}
+
+/*
+ * Release a raw block, preferably into this cpu's magazine.
+ */
+static
+void
+kmag_free(unsigned blktype, vaddr_t block)
+{
+	struct kmalloc_magazine *mag;
+	vaddr_t blocks[KMAG_BATCH];
+	unsigned i;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		subpage_putblocks(&block, 1);
+		return;
+	}
+
+	spl = splhigh();
+	mag = kmag_get(blktype);
+	if (mag->km_count == KMAG_SIZE) {
+		/* Full; take a batch out to give back to the shared lists. */
+		for (i=0; i<KMAG_BATCH; i++) {
+			blocks[i] = mag->km_blocks[--mag->km_count];
+		}
+		mag->km_blocks[mag->km_count++] = block;
+		splx(spl);
+		subpage_putblocks(blocks, KMAG_BATCH);
+		return;
+	}
+	mag->km_blocks[mag->km_count++] = block;
+	splx(spl);
+}
+
+#endif /* KMAGAZINES */
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	vaddr_t block;		// the block we got
+	void *retptr;		// our result
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+	sz = sizes[blktype];
+
+#ifdef KMAGAZINES
+	block = kmag_alloc(blktype);
+#else
+	if (subpage_getblocks(blktype, &block, 1) == 0) {
+		block = 0;
+	}
+#endif
+	if (block == 0) {
+		return NULL;
+	}
+
+	retptr = (void *)block;
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+
+	return retptr;
+}
+
 /*
  * Free a pointer previously returned from subpage_kmalloc. If the
  * pointer is not on any heap page we recognize, return -1.
@@ -1023,8 +1336,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
@@ -1055,30 +1366,36 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
+	/*
+	 * Find the page's pageref. The table lookup doesn't need the
+	 * spinlock: if ptr really is a live block, its page can't go
+	 * away under us, and if the page isn't a subpage page the entry
+	 * is null. Pages past the table need the allbase walk, which
+	 * does.
+	 */
+	if (ptraddr < MIPS_KSEG0 || ptraddr >= MIPS_KSEG1) {
+		return -1;
+	}
+	if (KHEAP_PAGEINDEX(ptraddr) < KHEAP_MAXPAGES) {
+		pr = findpageref(ptraddr & PAGE_FRAME);
+	}
+	else {
+		spinlock_acquire(&kmalloc_spinlock);
+		pr = findpageref(ptraddr & PAGE_FRAME);
+		spinlock_release(&kmalloc_spinlock);
 	}
-
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(prpage == (ptraddr & PAGE_FRAME));
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1098,52 +1415,10 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
+#ifdef KMAGAZINES
+	kmag_free(blktype, ptraddr);
 #else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
-
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
+	subpage_putblocks(&ptraddr, 1);
 #endif
 
 	return 0;
@@ -0,0 +1,216 @@
+#include <types.h>
+#include <lib.h>
+#include <objcache.h>
+
+/*
+ * Object caches. See objcache.h.
+ *
+ * A slab is one kernel page: the struct objslab header, then
+ * oc_perslab objects of oc_stride bytes. The free-list link for an
+ * object lives in the word after it, not inside it, so that putting an
+ * object on the free list doesn't clobber its constructed state.
+ */
+
+#define OBJ_LINK(oc, obj) (*(void **)((char *)(obj) + (oc)->oc_stride - sizeof(void *)))
+#define SLAB_OF(obj)      ((struct objslab *)((vaddr_t)(obj) & PAGE_FRAME))
+#define SLAB_OBJ(oc, sl, i) \
+	((void *)((char *)(sl) + OBJCACHE_HDRSIZE + (i) * (oc)->oc_stride))
+
+struct objcache *
+objcache_create(const char *name, size_t size,
+		int (*ctor)(void *), void (*dtor)(void *))
+{
+	struct objcache *oc;
+
+	KASSERT(OBJCACHE_HDRSIZE + OBJCACHE_STRIDE(size) <= PAGE_SIZE);
+
+	oc = kmalloc(sizeof(*oc));
+	if (oc == NULL) {
+		return NULL;
+	}
+	oc->oc_name = name;
+	oc->oc_size = size;
+	oc->oc_stride = OBJCACHE_STRIDE(size);
+	oc->oc_perslab = (PAGE_SIZE - OBJCACHE_HDRSIZE) / oc->oc_stride;
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+	spinlock_init(&oc->oc_lock);
+	oc->oc_slabs = NULL;
+	oc->oc_nslabs = 0;
+	oc->oc_nfree = 0;
+	return oc;
+}
+
+static
+void
+slab_unlink(struct objcache *oc, struct objslab *sl)
+{
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		oc->oc_slabs = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+static
+void
+slab_link(struct objcache *oc, struct objslab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = oc->oc_slabs;
+	if (oc->oc_slabs != NULL) {
+		oc->oc_slabs->sl_prev = sl;
+	}
+	oc->oc_slabs = sl;
+}
+
+/*
+ * Run the destructor over the first N objects of a slab and give the
+ * page back. Called without oc_lock.
+ */
+static
+void
+slab_release(struct objcache *oc, struct objslab *sl, unsigned n)
+{
+	unsigned i;
+
+	if (oc->oc_dtor != NULL) {
+		for (i = 0; i < n; i++) {
+			oc->oc_dtor(SLAB_OBJ(oc, sl, i));
+		}
+	}
+	free_kpages((vaddr_t)sl);
+}
+
+/*
+ * Get a page and construct every object on it. Called without
+ * oc_lock, since constructors may allocate.
+ */
+static
+struct objslab *
+slab_create(struct objcache *oc)
+{
+	struct objslab *sl;
+	void *obj;
+	unsigned i;
+
+	sl = (struct objslab *)alloc_kpages(1);
+	if (sl == NULL) {
+		return NULL;
+	}
+	sl->sl_cache = oc;
+	sl->sl_next = sl->sl_prev = NULL;
+	sl->sl_free = NULL;
+	sl->sl_nfree = oc->oc_perslab;
+
+	for (i = oc->oc_perslab; i-- > 0; ) {
+		obj = SLAB_OBJ(oc, sl, i);
+		if (oc->oc_ctor != NULL && oc->oc_ctor(obj) != 0) {
+			/* objects i+1.. are constructed */
+			if (oc->oc_dtor != NULL) {
+				while (++i < oc->oc_perslab) {
+					oc->oc_dtor(SLAB_OBJ(oc, sl, i));
+				}
+			}
+			free_kpages((vaddr_t)sl);
+			return NULL;
+		}
+		OBJ_LINK(oc, obj) = sl->sl_free;
+		sl->sl_free = obj;
+	}
+	return sl;
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct objslab *sl;
+	void *obj;
+
+	spinlock_acquire(&oc->oc_lock);
+	while (oc->oc_slabs == NULL) {
+		spinlock_release(&oc->oc_lock);
+		sl = slab_create(oc);
+		if (sl == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		slab_link(oc, sl);
+		oc->oc_nslabs++;
+		oc->oc_nfree += sl->sl_nfree;
+	}
+
+	sl = oc->oc_slabs;
+	KASSERT(sl->sl_nfree > 0);
+	obj = sl->sl_free;
+	sl->sl_free = OBJ_LINK(oc, obj);
+	sl->sl_nfree--;
+	oc->oc_nfree--;
+	if (sl->sl_nfree == 0) {
+		slab_unlink(oc, sl);
+	}
+	spinlock_release(&oc->oc_lock);
+
+	return obj;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct objslab *sl;
+
+	KASSERT(obj != NULL);
+	sl = SLAB_OF(obj);
+	KASSERT(sl->sl_cache == oc);
+	KASSERT(((char *)obj - (char *)sl - OBJCACHE_HDRSIZE)
+		% oc->oc_stride == 0);
+
+	spinlock_acquire(&oc->oc_lock);
+	OBJ_LINK(oc, obj) = sl->sl_free;
+	sl->sl_free = obj;
+	sl->sl_nfree++;
+	oc->oc_nfree++;
+	if (sl->sl_nfree == 1) {
+		slab_link(oc, sl);
+	}
+
+	/*
+	 * Give an empty slab back only if there's at least a slab's
+	 * worth of free objects elsewhere, so a cache hovering around a
+	 * slab boundary doesn't construct and destroy a page each time.
+	 */
+	if (sl->sl_nfree == oc->oc_perslab &&
+	    oc->oc_nfree >= 2 * oc->oc_perslab) {
+		slab_unlink(oc, sl);
+		oc->oc_nslabs--;
+		oc->oc_nfree -= oc->oc_perslab;
+		spinlock_release(&oc->oc_lock);
+		slab_release(oc, sl, oc->oc_perslab);
+		return;
+	}
+	spinlock_release(&oc->oc_lock);
+}
+
+/*
+ * Destroy a cache made with objcache_create. Every object must have
+ * been freed.
+ */
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct objslab *sl;
+
+	KASSERT(oc->oc_nfree == oc->oc_nslabs * oc->oc_perslab);
+
+	while ((sl = oc->oc_slabs) != NULL) {
+		slab_unlink(oc, sl);
+		slab_release(oc, sl, oc->oc_perslab);
+	}
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc);
+}
@@ -4,6 +4,7 @@
 #include <pagetable.h>
 #include <kern/errno.h>
 #include <thread.h>
+#include <objcache.h>
 //
 // TODO Handle kmalloc failures
 struct page_dir*
@@ -18,53 +19,82 @@ page_dir_init(){
 	return pd;
 }
 
+/*
+ * Page tables come from an object cache. Only the header is cached:
+ * the constructor just sets up the spinlock, and the cv and PTE array
+ * are allocated in page_table_add and freed again with the table, so
+ * tables sitting free in the cache don't pin any other memory.
+ */
+static int
+page_table_ctor(void *obj){
+	struct page_table *pt = obj;
+
+	spinlock_init(&pt->lock);
+	pt->cv = NULL;
+	pt->table = NULL;
+	return 0;
+}
+
+static void
+page_table_dtor(void *obj){
+	struct page_table *pt = obj;
+
+	spinlock_cleanup(&pt->lock);
+}
+
+static struct objcache page_table_cache =
+	OBJCACHE_INITIALIZER("page_table", sizeof(struct page_table),
+			     page_table_ctor, page_table_dtor);
+
 int page_table_add(int index, struct page_dir* pd){
+	struct page_table *pt;
+
 	if(pd->dir[index] != NULL)
         return -1;  /* we already have this table */
 
-	pd->dir[index] = kmalloc(sizeof(struct page_table));
-	if(pd->dir[index] == NULL) goto out;
+	pt = objcache_alloc(&page_table_cache);
+	if(pt == NULL) goto out;
 
-    spinlock_init(&pd->dir[index]->lock);
-	//pd->dir[index]->lock = spinlock_init("page_table_lock");
-	//if(pd->dir[index]->lock == NULL) goto pt_out;
+	pt->cv = cv_create("page_table_cv");
+	if(pt->cv == NULL) goto pt_out;
 
-	pd->dir[index]->cv = cv_create("page_table_cv");
-	if(pd->dir[index]->cv == NULL) goto lock_out;
-
-	pd->dir[index]->table = kmalloc(sizeof(struct pte) * PT_SIZE);
-	if(pd->dir[index]->table == NULL) goto cv_out;
+	pt->table = kmalloc(sizeof(struct pte) * PT_SIZE);
+	if(pt->table == NULL) goto cv_out;
 
 	// Null all entries in page table
-	for(int i = 0; i < PT_SIZE; i++)
-		pd->dir[index]->table[i].valid = 0;
+	memset(pt->table, 0, sizeof(struct pte) * PT_SIZE);
 
+	pd->dir[index] = pt;
 	return 0;
 
 	cv_out:
-		cv_destroy(pd->dir[index]->cv);
-	lock_out:
-		//lock_destroy(pd->dir[index]->lock);
-	//pt_out:
-		kfree(pd->dir[index]);
+		cv_destroy(pt->cv);
+		pt->cv = NULL;
+	pt_out:
+		objcache_free(&page_table_cache, pt);
 	out:
-		//pd->dir[index]->lock = NULL;
-		pd->dir[index]->cv = NULL;
-		pd->dir[index]->table = NULL;
-        pd->dir[index] = NULL;
 		return ENOMEM;
 }
 
+static void
+page_table_free(struct page_table *pt){
+	cv_destroy(pt->cv);
+	kfree(pt->table);
+	pt->cv = NULL;
+	pt->table = NULL;
+	objcache_free(&page_table_cache, pt);
+}
+
+void page_table_remove(int index, struct page_dir* pd){
+	KASSERT(pd->dir[index] != NULL);
+	page_table_free(pd->dir[index]);
+	pd->dir[index] = NULL;
+}
+
 int page_dir_destroy(struct page_dir* pd){
 	for(int i = 0; i < PD_SIZE; i++){
 		if(pd->dir[i] != NULL){
-			//if(pd->dir[i]->lock != NULL)
-				//lock_destroy(pd->dir[i]->lock);
-			if(pd->dir[i]->cv != NULL)
-				cv_destroy(pd->dir[i]->cv);
-			if(pd->dir[i]->table != NULL)
-				kfree(pd->dir[i]->table);
-			kfree(pd->dir[i]);
+			page_table_free(pd->dir[i]);
 		}
 	}
 	kfree(pd);
@@ -400,23 +400,19 @@ recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 	printf("Done with directory %u\n", ino);
 }
 
+/*
+ * Hex dump LEN bytes of file data that start at file offset OFFSET.
+ */
 static
-void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+void
+dumpdata(uint32_t offset, const uint8_t *data, unsigned len)
 {
-	uint8_t data[SFS_BLOCKSIZE];
 	unsigned i, j;
 	char tmp[128];
 
-	if (diskblock == 0) {
-		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
-		return;
-	}
-
-	diskread(data, diskblock);
-	for (i=0; i<SFS_BLOCKSIZE; i++) {
+	for (i=0; i<len; i++) {
 		if (i % 16 == 0) {
-			snprintf(tmp, sizeof(tmp), "0x%x",
-				 fileblock * SFS_BLOCKSIZE + i);
+			snprintf(tmp, sizeof(tmp), "0x%x", offset + i);
 			printf("%8s", tmp);
 		}
 		if (i % 8 == 0) {
@@ -426,9 +422,12 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 			printf(" ");
 		}
 		printf("%02x", data[i]);
-		if (i % 16 == 15) {
+		if (i % 16 == 15 || i == len-1) {
+			for (j = i % 16; j < 15; j++) {
+				printf(j % 8 == 7 ? "    " : "   ");
+			}
 			printf("  ");
-			for (j = i-15; j<=i; j++) {
+			for (j = i - i % 16; j<=i; j++) {
 				if (data[j] < 32 || data[j] > 126) {
 					putchar('.');
 				}
@@ -441,11 +440,31 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+{
+	uint8_t data[SFS_BLOCKSIZE];
+
+	if (diskblock == 0) {
+		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
+		return;
+	}
+
+	diskread(data, diskblock);
+	dumpdata(fileblock * SFS_BLOCKSIZE, data, SFS_BLOCKSIZE);
+}
+
 static
 void
 dumpfile(uint32_t ino, const struct sfs_dinode *sfi)
 {
 	printf("File contents for inode %u:\n", ino);
+	if (SWAPL(sfi->sfi_flags) & SFS_DF_INLINE) {
+		printf("    [inline]\n");
+		dumpdata(0, (const uint8_t *)sfi->sfi_inline,
+			 SWAPL(sfi->sfi_size));
+		return;
+	}
 	traverse(sfi, dumpfileblock);
 }
 
@@ -475,6 +494,8 @@ dumpinode(uint32_t ino, const char *name)
 	dumpvalf("Type", "%u (%s)", SWAPS(sfi.sfi_type), typename);
 	dumpvalf("Size", "%u", SWAPL(sfi.sfi_size));
 	dumpvalf("Link count", "%u", SWAPS(sfi.sfi_linkcount));
+	dumpvalf("Flags", "0x%x%s", SWAPL(sfi.sfi_flags),
+		 (SWAPL(sfi.sfi_flags) & SFS_DF_INLINE) ? " (inline)" : "");
 	printf("\n");
 
         printf("    Direct blocks:\n");
@@ -506,10 +527,12 @@ dumpinode(uint32_t ino, const char *name)
 	       SWAPL(sfi.sfi_dindirect), SWAPL(sfi.sfi_dindirect));
 	printf("    Triple indirect block: %u (0x%x)\n",
 	       SWAPL(sfi.sfi_tindirect), SWAPL(sfi.sfi_tindirect));
-	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
-		if (sfi.sfi_waste[i] != 0) {
-			printf("    Word %u in waste area: 0x%x\n",
-			       i, SWAPL(sfi.sfi_waste[i]));
+	if ((SWAPL(sfi.sfi_flags) & SFS_DF_INLINE) == 0) {
+		for (i=0; i<sizeof(sfi.sfi_inline); i++) {
+			if (sfi.sfi_inline[i] != 0) {
+				printf("    Byte %u in inline area: 0x%x\n",
+				       i, (uint8_t)sfi.sfi_inline[i]);
+			}
 		}
 	}
 
@@ -183,7 +183,13 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	int changed;
 	int i;
 
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
+	/* Inline files own no blocks; any they point to get freed */
+	if (sfi->sfi_flags & SFS_DF_INLINE) {
+		size = 0;
+	}
+	else {
+		size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
+	}
 
 	ibs.ino = ino;
 	/*ibs.curfileblock = 0;*/
@@ -261,8 +267,41 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 
 	bitmap_blockinuse(ino, B_INODE, ino);
 
-	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
-		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
+	if (sfi->sfi_flags & ~(uint32_t)SFS_DF_INLINE) {
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_flags);
+		sfi->sfi_flags &= SFS_DF_INLINE;
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	if ((sfi->sfi_flags & SFS_DF_INLINE) && isdir) {
+		warnx("Inode %lu: directory marked inline (cleared)",
+		      (unsigned long) ino);
+		sfi->sfi_flags &= ~(uint32_t)SFS_DF_INLINE;
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	if (sfi->sfi_flags & SFS_DF_INLINE) {
+		if (sfi->sfi_size > SFS_INLINESIZE) {
+			warnx("Inode %lu: inline file size %lu too large "
+			      "(truncated)", (unsigned long) ino,
+			      (unsigned long) sfi->sfi_size);
+			sfi->sfi_size = SFS_INLINESIZE;
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+		if (checkzeroed(sfi->sfi_inline + sfi->sfi_size,
+				SFS_INLINESIZE - sfi->sfi_size)) {
+			warnx("Inode %lu: inline data past EOF not zeroed "
+			      "(fixed)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+	}
+	else if (checkzeroed(sfi->sfi_inline, sizeof(sfi->sfi_inline))) {
+		warnx("Inode %lu: sfi_inline section not zeroed (fixed)",
 		      (unsigned long) ino);
 		setbadness(EXIT_RECOV);
 		changed = 1;
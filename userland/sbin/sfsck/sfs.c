@@ -81,6 +81,7 @@ swapinode(struct sfs_dinode *sfi)
 	sfi->sfi_size = SWAPL(sfi->sfi_size);
 	sfi->sfi_type = SWAPS(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAPS(sfi->sfi_linkcount);
+	sfi->sfi_flags = SWAPL(sfi->sfi_flags);
 
 	for (i=0; i<NUM_D; i++) {
 		SET_D(sfi, i) = SWAPL(GET_D(sfi, i));